@@ -0,0 +1,72 @@
+// SPDX-License-Identifier: BSD-3-Clause
+/*
+ * Copyright (C) 2022 Leica Geosystems AG
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "bench.h"
+#include "toolbox.h"
+
+struct crc32_variant {
+	const char *name;
+	uint32_t (*fn)(const uint8_t *data, uint32_t size, uint32_t crc);
+};
+
+static const struct crc32_variant variants[] = {
+	{ "bitwise", crc32_compute_bitwise },
+	{ "sliced", crc32_compute_sliced },
+	{ "clmul", crc32_compute_clmul },
+	{ "dispatch", crc32_compute },
+	{ }
+};
+
+int main(int argc, char **argv)
+{
+	const struct crc32_variant *v;
+	uint32_t size, reference;
+	uint8_t *buf;
+	size_t i;
+
+	buf = malloc(64 << 20);
+	if (!buf)
+		return -1;
+
+	srand(1);
+	for (i = 0; i < 64 << 20; i++)
+		buf[i] = rand();
+
+	for (size = 1 << 20; size <= 64 << 20; size <<= 2) {
+		reference = crc32_compute_bitwise(buf, size, 0);
+
+		for (v = variants; v->name; v++) {
+			double start, elapsed;
+			uint32_t crc;
+			int runs = 0;
+
+			/* the bitwise reference is slow, one pass is enough */
+			start = bench_now();
+			do {
+				crc = v->fn(buf, size, 0);
+				runs++;
+				elapsed = bench_now() - start;
+			} while (elapsed < 0.2 && v->fn != crc32_compute_bitwise);
+
+			if (crc != reference) {
+				fprintf(stderr, "%s: 0x%08x instead of 0x%08x\n", v->name, crc, reference);
+				return -1;
+			}
+
+			printf("{\"bench\": \"crc32\", \"variant\": \"%s\", \"size\": %u, "
+			       "\"bytes_per_s\": %.0f}\n",
+			       v->name, size, (double)runs * size / elapsed);
+		}
+	}
+
+	free(buf);
+	return 0;
+}
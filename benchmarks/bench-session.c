@@ -0,0 +1,283 @@
+// SPDX-License-Identifier: BSD-3-Clause
+/*
+ * Copyright (C) 2022 Leica Geosystems AG
+ */
+
+#define _GNU_SOURCE	/* posix_openpt(), ptsname(), RUSAGE_THREAD */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <termios.h>
+#include <nrfu.h>
+
+#include "bench.h"
+#include "sim.h"
+
+#define BENCH_INIT_PACKET_SIZE	140
+
+/*
+ * Complete update sessions against the simulator on a pty. The host side
+ * goes through a transport that makes the same system calls as the
+ * serial backend (write, select/poll and read), so they can be counted,
+ * or through the serial backend itself, as nrfu_update() does.
+ */
+struct bench_config {
+	unsigned int baudrate;		/* 0: as fast as the host and pty allow */
+	unsigned int mtu;
+	unsigned int prn;
+	int frame_cache;
+	unsigned int image_size;
+	int serial;
+};
+
+static const struct bench_config configs[] = {
+	{ 0, 131, 0, 0, 256 * 1024, 1 },
+	{ 0, 131, 8, 0, 256 * 1024, 1 },
+	{ 0, 64, 0, 0, 256 * 1024, 0 },
+	{ 0, 131, 0, 0, 256 * 1024, 0 },
+	{ 0, 512, 0, 0, 256 * 1024, 0 },
+	{ 0, 131, 8, 0, 256 * 1024, 0 },
+	{ 0, 131, 0, 1, 256 * 1024, 0 },
+	{ 0, 131, 8, 1, 256 * 1024, 0 },
+	{ 1000000, 131, 0, 0, 64 * 1024, 0 },
+	{ 1000000, 131, 8, 0, 64 * 1024, 0 },
+	{ 115200, 64, 0, 0, 16 * 1024, 0 },
+	{ 115200, 131, 0, 0, 16 * 1024, 0 },
+	{ 115200, 131, 8, 0, 16 * 1024, 0 },
+	{ }
+};
+
+struct bench_link {
+	int fd;
+	unsigned long syscalls;
+};
+
+struct bench_session {
+	struct sim *sim;
+	int master_fd;
+	uint64_t firmware_ns;
+	struct nrfu_progress last;
+};
+
+static void *link_open(const char *devname, void *userdata)
+{
+	struct bench_link *link = userdata;
+	struct termios tio;
+
+	link->fd = open(devname, O_RDWR | O_NOCTTY);
+	if (link->fd < 0)
+		return NULL;
+
+	tcgetattr(link->fd, &tio);
+	cfmakeraw(&tio);
+	tcsetattr(link->fd, TCSANOW, &tio);
+	link->syscalls += 3;
+
+	return link;
+}
+
+static int link_send(void *handle, const uint8_t *data, size_t length)
+{
+	struct bench_link *link = handle;
+
+	while (length) {
+		ssize_t v = write(link->fd, data, length);
+
+		link->syscalls++;
+		if (v < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		data += v;
+		length -= v;
+	}
+
+	return 0;
+}
+
+static int link_receive(void *handle, uint8_t *buf, size_t size, int timeout_ms)
+{
+	struct bench_link *link = handle;
+	struct pollfd pfd = { .fd = link->fd, .events = POLLIN };
+	int ret;
+
+	link->syscalls++;
+	ret = poll(&pfd, 1, timeout_ms);
+	if (ret <= 0)
+		return ret;
+
+	link->syscalls++;
+	ret = read(link->fd, buf, size);
+	if (ret == 0) {
+		errno = EIO;
+		return -1;
+	}
+
+	return ret;
+}
+
+static void link_close(void *handle)
+{
+	struct bench_link *link = handle;
+
+	close(link->fd);
+	link->syscalls++;
+}
+
+static const struct nrfu_transport_ops bench_transport = {
+	.open = link_open,
+	.send = link_send,
+	.receive = link_receive,
+	.close = link_close,
+};
+
+static void progress_cb(const struct nrfu_progress *progress, void *userdata)
+{
+	struct bench_session *s = userdata;
+
+	if (progress->event == NRFU_PROGRESS_END && progress->phase == NRFU_PHASE_FIRMWARE)
+		s->firmware_ns = progress->elapsed_ns;
+	s->last = *progress;
+}
+
+/* The simulator ends when the host closes the last handle of the pty */
+static void *sim_thread(void *arg)
+{
+	struct bench_session *s = arg;
+
+	sim_serve(s->sim, s->master_fd);
+	return NULL;
+}
+
+static int run_session(const struct bench_config *c, const uint8_t *init_packet,
+		       const uint8_t *firmware)
+{
+	struct bench_session s = { .master_fd = -1 };
+	struct bench_link link = { .fd = -1 };
+	struct sim_config cfg;
+	struct nrfu_options opts;
+	struct nrfu_ctx *ctx = NULL;
+	pthread_t thread;
+	double start, elapsed, cpu;
+	const uint8_t *image;
+	size_t image_size;
+	int holder_fd = -1, ret = -1;
+
+	sim_config_init(&cfg);
+	cfg.mtu = c->mtu;
+	cfg.baudrate = c->baudrate;
+	s.sim = sim_create(&cfg);
+	if (!s.sim)
+		return -1;
+
+	s.master_fd = posix_openpt(O_RDWR | O_NOCTTY);
+	if (s.master_fd < 0 || grantpt(s.master_fd) || unlockpt(s.master_fd))
+		goto out;
+
+	/* keeps the pty up until the host has opened it */
+	holder_fd = open(ptsname(s.master_fd), O_RDWR | O_NOCTTY);
+	if (holder_fd < 0)
+		goto out;
+
+	ctx = nrfu_ctx_create();
+	if (!ctx)
+		goto out;
+
+	nrfu_options_init(&opts);
+	opts.log_level = NRFU_LOG_LEVEL_ERROR;
+	opts.prn = c->prn;
+	opts.frame_cache = c->frame_cache;
+	nrfu_ctx_set_options(ctx, &opts);
+	if (!c->serial)
+		nrfu_ctx_set_transport(ctx, &bench_transport, &link);
+	nrfu_ctx_set_progress_fn(ctx, progress_cb, &s);
+
+	if (pthread_create(&thread, NULL, sim_thread, &s))
+		goto out;
+
+	start = bench_now();
+	cpu = bench_cpu_time();
+	ret = nrfu_ctx_run_mem(ctx, ptsname(s.master_fd), init_packet, BENCH_INIT_PACKET_SIZE,
+			       firmware, c->image_size);
+	cpu = bench_cpu_time() - cpu;
+	elapsed = bench_now() - start;
+
+	close(holder_fd);
+	holder_fd = -1;
+	pthread_join(thread, NULL);
+
+	image = sim_image(s.sim, &image_size);
+	if (!ret && (image_size != c->image_size || memcmp(image, firmware, image_size))) {
+		fprintf(stderr, "image received by the simulator differs\n");
+		ret = -1;
+	}
+
+	if (ret) {
+		fprintf(stderr, "session failed: baudrate %u mtu %u prn %u\n",
+			c->baudrate, c->mtu, c->prn);
+		goto out;
+	}
+
+	printf("{\"bench\": \"session\", \"transport\": \"%s\", \"baudrate\": %u, "
+	       "\"mtu\": %u, \"prn\": %u, \"frame_cache\": %d, \"image_size\": %u, "
+	       "\"seconds\": %.6f, \"bytes_per_s\": %.0f, \"firmware_bytes_per_s\": %.0f, "
+	       "\"wire_tx_bytes\": %lu, \"wire_rx_bytes\": %lu, ",
+	       c->serial ? "serial" : "counted", c->baudrate, c->mtu, c->prn, c->frame_cache,
+	       c->image_size, elapsed, c->image_size / elapsed,
+	       c->image_size / (s.firmware_ns / 1e9), s.last.wire_tx_bytes, s.last.wire_rx_bytes);
+	if (c->serial)
+		printf("\"syscalls\": null, \"syscalls_per_kib\": null, ");
+	else
+		printf("\"syscalls\": %lu, \"syscalls_per_kib\": %.2f, ",
+		       link.syscalls, link.syscalls * 1024.0 / c->image_size);
+	printf("\"cpu_seconds\": %.6f}\n", cpu);
+
+out:
+	nrfu_ctx_destroy(ctx);
+	if (holder_fd >= 0)
+		close(holder_fd);
+	if (s.master_fd >= 0)
+		close(s.master_fd);
+	sim_destroy(s.sim);
+	return ret;
+}
+
+int main(int argc, char **argv)
+{
+	const struct bench_config *c;
+	uint8_t *firmware, init_packet[BENCH_INIT_PACKET_SIZE];
+	unsigned int max_size = 0;
+	size_t i;
+
+	for (c = configs; c->image_size; c++)
+		if (c->image_size > max_size)
+			max_size = c->image_size;
+
+	firmware = malloc(max_size);
+	if (!firmware)
+		return -1;
+
+	srand(1);
+	for (i = 0; i < sizeof(init_packet); i++)
+		init_packet[i] = rand();
+	for (i = 0; i < max_size; i++)
+		firmware[i] = rand();
+
+	for (c = configs; c->image_size; c++) {
+		if (run_session(c, init_packet, firmware) < 0) {
+			free(firmware);
+			return -1;
+		}
+	}
+
+	free(firmware);
+	return 0;
+}
@@ -0,0 +1,140 @@
+// SPDX-License-Identifier: BSD-3-Clause
+/*
+ * Copyright (C) 2022 Leica Geosystems AG
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bench.h"
+#include "slip.h"
+
+#define BENCH_SIZE		(4 << 20)
+/* data bytes per WRITE_OBJECT packet at the default MTU of 131 */
+#define BENCH_PACKET		64
+
+struct slip_input {
+	const char *name;
+	int fill;	/* byte to fill the buffer with, -1 for random data */
+};
+
+static const struct slip_input inputs[] = {
+	{ "random", -1 },
+	{ "worst-case", SLIP_BYTE_END },
+	{ }
+};
+
+static void report(const char *op, const char *input, double bytes, double elapsed)
+{
+	printf("{\"bench\": \"slip-%s\", \"input\": \"%s\", \"packet\": %u, "
+	       "\"bytes_per_s\": %.0f}\n", op, input, BENCH_PACKET, bytes / elapsed);
+}
+
+/* Encode data into END terminated frames of BENCH_PACKET bytes each */
+static size_t encode(uint8_t *out, const uint8_t *data, size_t length)
+{
+	size_t i, n = 0;
+
+	for (i = 0; i < length; i += BENCH_PACKET) {
+		n += slip_encode(&out[n], &data[i], BENCH_PACKET);
+		out[n++] = SLIP_BYTE_END;
+	}
+
+	return n;
+}
+
+static size_t pack(uint8_t *out, const uint8_t *data, size_t length)
+{
+	size_t offset = 0, n = 0, consumed;
+
+	while (offset < length) {
+		n += slip_pack(&out[n], 2 * BENCH_PACKET, &data[offset], length - offset, &consumed);
+		out[n++] = SLIP_BYTE_END;
+		offset += consumed;
+	}
+
+	return n;
+}
+
+static size_t decode(uint8_t *out, const uint8_t *frames, size_t length)
+{
+	struct slip_decoder dec;
+	size_t consumed, n = 0;
+	uint8_t frame[BENCH_PACKET];
+
+	slip_decoder_init(&dec, frame, sizeof(frame));
+	while (length) {
+		if (slip_decode(&dec, frames, length, &consumed) == SLIP_DECODE_FRAME) {
+			memcpy(&out[n], frame, dec.length);
+			n += dec.length;
+		}
+		slip_decoder_init(&dec, frame, sizeof(frame));
+		frames += consumed;
+		length -= consumed;
+	}
+
+	return n;
+}
+
+int main(int argc, char **argv)
+{
+	const struct slip_input *in;
+	uint8_t *data, *frames, *decoded;
+	size_t i, frames_length = 0, decoded_length = 0;
+
+	data = malloc(BENCH_SIZE);
+	frames = malloc(2 * BENCH_SIZE + BENCH_SIZE / BENCH_PACKET + 1);
+	decoded = malloc(BENCH_SIZE);
+	if (!data || !frames || !decoded)
+		return -1;
+
+	for (in = inputs; in->name; in++) {
+		double start, elapsed;
+		int runs;
+
+		srand(1);
+		for (i = 0; i < BENCH_SIZE; i++)
+			data[i] = in->fill < 0 ? rand() : in->fill;
+
+		runs = 0;
+		start = bench_now();
+		do {
+			frames_length = encode(frames, data, BENCH_SIZE);
+			runs++;
+			elapsed = bench_now() - start;
+		} while (elapsed < 0.2);
+		report("encode", in->name, (double)runs * BENCH_SIZE, elapsed);
+
+		runs = 0;
+		start = bench_now();
+		do {
+			decoded_length = decode(decoded, frames, frames_length);
+			runs++;
+			elapsed = bench_now() - start;
+		} while (elapsed < 0.2);
+
+		if (decoded_length != BENCH_SIZE || memcmp(decoded, data, BENCH_SIZE)) {
+			fprintf(stderr, "%s: decoded data differs\n", in->name);
+			return -1;
+		}
+		report("decode", in->name, (double)runs * BENCH_SIZE, elapsed);
+
+		runs = 0;
+		start = bench_now();
+		do {
+			pack(frames, data, BENCH_SIZE);
+			runs++;
+			elapsed = bench_now() - start;
+		} while (elapsed < 0.2);
+		report("pack", in->name, (double)runs * BENCH_SIZE, elapsed);
+	}
+
+	free(decoded);
+	free(frames);
+	free(data);
+	return 0;
+}
@@ -0,0 +1,35 @@
+/* SPDX-License-Identifier: BSD-3-Clause */
+/*
+ * Copyright (C) 2022 Leica Geosystems AG
+ */
+#ifndef BENCH_H_
+#define BENCH_H_
+
+#include <time.h>
+#include <sys/resource.h>
+
+/*
+ * Benchmarks print one JSON object per measurement and line on stdout,
+ * with at least "bench" and "bytes_per_s", so runs can be compared by
+ * scripts. Anything else goes to stderr.
+ */
+
+static inline double bench_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* user and system time of the calling thread, RUSAGE_THREAD needs _GNU_SOURCE */
+static inline double bench_cpu_time(void)
+{
+	struct rusage ru;
+
+	getrusage(RUSAGE_THREAD, &ru);
+	return ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6 +
+	       ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1e6;
+}
+
+#endif /* BENCH_H_ */
@@ -0,0 +1,71 @@
+#!/usr/bin/env python3
+# SPDX-License-Identifier: BSD-3-Clause
+# Copyright 2022 Leica Geosystems AG
+
+import nrfu
+import nrfu_asyncio
+import argparse
+import asyncio
+import sys
+
+
+def read_images(update_file):
+    from zipfile import ZipFile
+
+    with ZipFile(update_file, 'r') as zip_object:
+        firmware = b""
+        init_packet = b""
+        for file_name in zip_object.namelist():
+            if file_name.endswith('.bin'):
+                firmware = zip_object.read(file_name)
+            if file_name.endswith('.dat'):
+                init_packet = zip_object.read(file_name)
+    return firmware, init_packet
+
+
+async def update_firmware(devices, update_file, baudrate):
+    def progress(device, info):
+        if info['phase'] == 'firmware' and info['event'] == 'end':
+            print("%s: firmware sent (%.1f s)" % (device, info['elapsed_ns'] / 1e9))
+
+    firmware, init_packet = read_images(update_file)
+
+    print("Updating %d devices..." % len(devices))
+    results = await nrfu_asyncio.update_many(devices, init_packet, firmware,
+                                             log_level=nrfu.LOG_LEVEL_ERROR,
+                                             baudrate=baudrate, progress=progress)
+    for device, result in zip(devices, results):
+        print("%s: %s" % (device, "ok" if result is None else result))
+
+    return all(result is None for result in results)
+
+
+def parse_args(args):
+    parser = argparse.ArgumentParser(
+        description="Update Firmware on several nRF5 devices \
+        (running in bootloader) via DFU over serial ports at once.")
+    parser.add_argument(
+        dest="package",
+        help="update package",
+        type=str)
+    parser.add_argument(
+        dest="devices",
+        help="serial devices",
+        nargs='+',
+        type=str)
+    parser.add_argument(
+        "-b", "--baudrate",
+        help="serial line speed, 0 keeps the port setting",
+        type=int,
+        default=115200)
+    return parser.parse_args(args)
+
+
+def main():
+    args = parse_args(sys.argv[1:])
+    if not asyncio.run(update_firmware(args.devices, args.package, args.baudrate)):
+        sys.exit(1)
+
+
+if __name__ == "__main__":
+    main()
@@ -5,38 +5,36 @@
 import nrfu
 import argparse
 import sys
-import os
 
 
-def update_firmware(dev, update_file):
-    def extract_files():
+def update_firmware(dev, update_file, baudrate):
+    def read_images():
         from zipfile import ZipFile
 
         with ZipFile(update_file, 'r') as zip_object:
-            firmware_file = ""
-            init_packet_file = ""
-            files = zip_object.namelist()
-            for file_name in files:
+            firmware = b""
+            init_packet = b""
+            for file_name in zip_object.namelist():
                 if file_name.endswith('.bin'):
-                    zip_object.extract(file_name, '/tmp')
-                    firmware_file = "/tmp/%s" % (file_name)
+                    firmware = zip_object.read(file_name)
                 if file_name.endswith('.dat'):
-                    zip_object.extract(file_name, '/tmp')
-                    init_packet_file = "/tmp/%s" % (file_name)
-        return firmware_file, init_packet_file
+                    init_packet = zip_object.read(file_name)
+        return firmware, init_packet
 
-    def cleanup(firmware_file, init_packet_file):
-        os.remove(init_packet_file)
-        os.remove(firmware_file)
+    def progress(info):
+        if info['phase'] == 'firmware' and info['event'] != 'begin':
+            percent = 100 * info['image_bytes'] // max(info['image_size'], 1)
+            print("\rFirmware: %3d%%" % percent, end="", flush=True)
+            if info['event'] == 'end':
+                print(" (%.1f s)" % (info['elapsed_ns'] / 1e9))
 
-    firmware_file, init_packet_file = extract_files()
+    firmware, init_packet = read_images()
 
     print("Starting update...")
-    nrfu.update(dev, init_packet_file, firmware_file, log_level=nrfu.LOG_LEVEL_ERROR)
+    nrfu.update(dev, init_packet, firmware, log_level=nrfu.LOG_LEVEL_ERROR,
+                baudrate=baudrate, progress=progress)
     print("Done!")
 
-    cleanup(firmware_file, init_packet_file)
-
 
 def parse_args(args):
     parser = argparse.ArgumentParser(
@@ -50,12 +48,17 @@ def parse_args(args):
         dest="package",
         help="update package",
         type=str)
+    parser.add_argument(
+        "-b", "--baudrate",
+        help="serial line speed, 0 keeps the port setting",
+        type=int,
+        default=115200)
     return parser.parse_args(args)
 
 
 def main():
     args = parse_args(sys.argv[1:])
-    update_firmware(args.device, args.package)
+    update_firmware(args.device, args.package, args.baudrate)
 
 
 if __name__ == "__main__":
@@ -0,0 +1,82 @@
+# SPDX-License-Identifier: BSD-3-Clause
+# Copyright 2022 Leica Geosystems AG
+
+"""Run updates on an asyncio event loop.
+
+The sessions are driven by the loop itself through nrfu.Session, so any
+number of devices are updated concurrently from a single thread.
+"""
+
+import asyncio
+import select
+
+import nrfu
+
+
+async def _wait(loop, session):
+    fd = session.fileno()
+    events = session.events()
+    timeout = session.timeout()
+
+    if timeout == 0:
+        await asyncio.sleep(0)
+        return
+
+    ready = loop.create_future()
+
+    def wake():
+        if not ready.done():
+            ready.set_result(None)
+
+    reading = fd >= 0 and events & select.POLLIN
+    writing = fd >= 0 and events & select.POLLOUT
+    if reading:
+        loop.add_reader(fd, wake)
+    if writing:
+        loop.add_writer(fd, wake)
+    timer = loop.call_later(timeout, wake) if timeout is not None else None
+
+    try:
+        await ready
+    finally:
+        if reading:
+            loop.remove_reader(fd)
+        if writing:
+            loop.remove_writer(fd)
+        if timer:
+            timer.cancel()
+
+
+async def update(device, init_packet, firmware, **kwargs):
+    """Update one device, see nrfu.update() for the arguments.
+
+    Cancelling the task aborts the update.
+    """
+    loop = asyncio.get_running_loop()
+    session = nrfu.Session(device, init_packet, firmware, **kwargs)
+
+    try:
+        while session.process():
+            await _wait(loop, session)
+    finally:
+        session.cancel()
+
+
+async def update_many(devices, init_packet, firmware, **kwargs):
+    """Update several devices concurrently with the same images.
+
+    Returns a list with None for each device that was updated and the
+    exception for each that failed, in the order of devices. A progress
+    callback given in kwargs is called as progress(device, info).
+    """
+    progress = kwargs.pop('progress', None)
+
+    def device_progress(device):
+        return lambda info: progress(device, info)
+
+    return await asyncio.gather(
+        *(update(device, init_packet, firmware,
+                 progress=device_progress(device) if progress else None,
+                 **kwargs)
+          for device in devices),
+        return_exceptions=True)
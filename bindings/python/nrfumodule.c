@@ -14,26 +14,119 @@ enum {
 };
 
 PyDoc_STRVAR(update_doc,
-"update() -> None\n"
+"update(device, init_packet, firmware, log_level=LOG_LEVEL_ERROR,\n"
+"       baudrate=115200, flow_control=True, low_latency=False, prn=0,\n"
+"       fill_mtu=False, progress=None) -> None\n"
 "\n"
-"Update a NRF5 device connected to given console.\n");
+"Update a NRF5 device connected to given console.\n"
+"init_packet and firmware are either both paths or both objects\n"
+"supporting the buffer protocol, e.g. bytes, bytearray, memoryview or\n"
+"mmap, which are sent without copying them.\n"
+"A baudrate of 0 leaves the port speed untouched (USB-CDC).\n"
+"prn enables a receipt notification every prn data packets.\n"
+"fill_mtu packs data packets up to the MTU, if the bootloader supports it.\n"
+"progress is called with a dict describing each phase and the data\n"
+"progress: event, phase, status, image, image_bytes, image_size, object,\n"
+"n_objects, payload_bytes, wire_tx_bytes, wire_rx_bytes, retries,\n"
+"timestamp_ns and elapsed_ns. An exception raised by progress cancels\n"
+"the update and is raised by update().\n"
+"The GIL is released while the update runs, so other threads keep\n"
+"running and several devices can be updated from threads in parallel.\n");
 
-static PyObject *nrfu_Update(PyObject *self, PyObject *args, PyObject *kwds)
+static const char *progress_events[] = {
+	[NRFU_PROGRESS_BEGIN] = "begin",
+	[NRFU_PROGRESS_UPDATE] = "update",
+	[NRFU_PROGRESS_END] = "end",
+};
+
+struct nrfu_progress_cb {
+	PyObject *callable;
+	struct nrfu_ctx *ctx;
+	int failed;
+};
+
+/* May be called with or without the GIL held, see nrfu_Update() */
+static void nrfu_Progress(const struct nrfu_progress *prog, void *userdata)
+{
+	struct nrfu_progress_cb *cb = userdata;
+	PyGILState_STATE gil;
+	PyObject *info, *ret;
+
+	/* the first exception is raised once the update returns */
+	if (cb->failed)
+		return;
+
+	gil = PyGILState_Ensure();
+
+	info = Py_BuildValue("{s:s,s:s,s:i,s:s,s:k,s:k,s:I,s:I,s:k,s:k,s:k,s:I,s:K,s:K}",
+			     "event", progress_events[prog->event],
+			     "phase", nrfu_phase_name(prog->phase),
+			     "status", prog->status,
+			     "image", prog->image ? prog->image : "",
+			     "image_bytes", prog->image_bytes,
+			     "image_size", prog->image_size,
+			     "object", prog->object,
+			     "n_objects", prog->n_objects,
+			     "payload_bytes", prog->payload_bytes,
+			     "wire_tx_bytes", prog->wire_tx_bytes,
+			     "wire_rx_bytes", prog->wire_rx_bytes,
+			     "retries", prog->retries,
+			     "timestamp_ns", (unsigned long long)prog->timestamp_ns,
+			     "elapsed_ns", (unsigned long long)prog->elapsed_ns);
+	ret = info ? PyObject_CallFunctionObjArgs(cb->callable, info, NULL) : NULL;
+	Py_XDECREF(info);
+
+	/* an exception stops the update, it is raised once that returns */
+	if (!ret) {
+		cb->failed = 1;
+		nrfu_ctx_cancel(cb->ctx);
+	}
+	Py_XDECREF(ret);
+
+	PyGILState_Release(gil);
+}
+
+/* Arguments shared by update() and Session() */
+struct nrfu_args {
+	const char *device;
+	PyObject *init_packet;
+	PyObject *firmware;
+	struct nrfu_options opts;
+	PyObject *progress;
+};
+
+static int nrfu_ParseArgs(PyObject *args, PyObject *kwds, struct nrfu_args *a)
 {
 	static char *kwlist[] = { "device",
 				  "init_packet",
 				  "firmware",
 				  "log_level",
+				  "baudrate",
+				  "flow_control",
+				  "low_latency",
+				  "prn",
+				  "fill_mtu",
+				  "progress",
 				  NULL };
 
-	const char *device, *init_packet, *firmware;
 	int ret, log_level = nrfu_LOG_LEVEL_ERROR;
-	enum nrfu_log_level lib_log_level;
+	enum nrfu_log_level lib_log_level = NRFU_LOG_LEVEL_ERROR;
+	int flow_control = 1, low_latency = 0, fill_mtu = 0;
+
+	nrfu_options_init(&a->opts);
+	a->progress = Py_None;
 
-	ret = PyArg_ParseTupleAndKeywords(args, kwds, "sss|i", kwlist,
-					  &device, &init_packet, &firmware, &log_level);
+	ret = PyArg_ParseTupleAndKeywords(args, kwds, "sOO|iIppIpO", kwlist,
+					  &a->device, &a->init_packet, &a->firmware, &log_level,
+					  &a->opts.baudrate, &flow_control, &low_latency,
+					  &a->opts.prn, &fill_mtu, &a->progress);
 	if (!ret)
-		return NULL;
+		return -1;
+
+	if (a->progress != Py_None && !PyCallable_Check(a->progress)) {
+		PyErr_SetString(PyExc_TypeError, "progress must be callable");
+		return -1;
+	}
 
 	switch (log_level) {
 	case nrfu_LOG_LEVEL_SILENT:
@@ -50,7 +143,131 @@ static PyObject *nrfu_Update(PyObject *self, PyObject *args, PyObject *kwds)
 		break;
 	}
 
-	if (nrfu_update(device, init_packet, firmware, lib_log_level) < 0) {
+	a->opts.log_level = lib_log_level;
+	a->opts.flow_control = flow_control ? NRFU_FLOW_CONTROL_RTSCTS : NRFU_FLOW_CONTROL_NONE;
+	a->opts.low_latency = low_latency;
+	a->opts.fill_mtu = fill_mtu;
+
+	return 0;
+}
+
+/*
+ * The images of a session: paths encoded for the file system, or views
+ * of buffers, which stay exported until the session no longer reads them.
+ */
+struct nrfu_images {
+	PyObject *init_path;
+	PyObject *firmware_path;
+	Py_buffer init_view;
+	Py_buffer firmware_view;
+	int in_memory;
+};
+
+static int nrfu_GetImages(struct nrfu_images *img, PyObject *init_packet, PyObject *firmware)
+{
+	int init_is_buffer = PyObject_CheckBuffer(init_packet);
+
+	memset(img, 0, sizeof(*img));
+
+	if (init_is_buffer != PyObject_CheckBuffer(firmware)) {
+		PyErr_SetString(PyExc_TypeError,
+				"init_packet and firmware must both be paths or both be buffers");
+		return -1;
+	}
+
+	if (!init_is_buffer) {
+		if (!PyUnicode_FSConverter(init_packet, &img->init_path))
+			return -1;
+		if (!PyUnicode_FSConverter(firmware, &img->firmware_path)) {
+			Py_CLEAR(img->init_path);
+			return -1;
+		}
+		return 0;
+	}
+
+	if (PyObject_GetBuffer(init_packet, &img->init_view, PyBUF_SIMPLE) < 0)
+		return -1;
+	if (PyObject_GetBuffer(firmware, &img->firmware_view, PyBUF_SIMPLE) < 0) {
+		PyBuffer_Release(&img->init_view);
+		return -1;
+	}
+
+	img->in_memory = 1;
+	return 0;
+}
+
+static void nrfu_ReleaseImages(struct nrfu_images *img)
+{
+	if (img->in_memory) {
+		PyBuffer_Release(&img->init_view);
+		PyBuffer_Release(&img->firmware_view);
+		img->in_memory = 0;
+	}
+
+	Py_CLEAR(img->init_path);
+	Py_CLEAR(img->firmware_path);
+}
+
+static struct nrfu_ctx *nrfu_CreateCtx(const struct nrfu_args *a, struct nrfu_progress_cb *cb)
+{
+	struct nrfu_ctx *ctx;
+
+	ctx = nrfu_ctx_create();
+	if (!ctx) {
+		PyErr_NoMemory();
+		return NULL;
+	}
+
+	if (nrfu_ctx_set_options(ctx, &a->opts) < 0) {
+		nrfu_ctx_destroy(ctx);
+		PyErr_SetString(PyExc_ValueError, "Invalid options");
+		return NULL;
+	}
+
+	cb->ctx = ctx;
+	if (cb->callable != Py_None)
+		nrfu_ctx_set_progress_fn(ctx, nrfu_Progress, cb);
+
+	return ctx;
+}
+
+static PyObject *nrfu_Update(PyObject *self, PyObject *args, PyObject *kwds)
+{
+	struct nrfu_progress_cb cb = { .failed = 0 };
+	struct nrfu_images img;
+	struct nrfu_args a;
+	struct nrfu_ctx *ctx;
+	int ret;
+
+	if (nrfu_ParseArgs(args, kwds, &a) < 0)
+		return NULL;
+
+	if (nrfu_GetImages(&img, a.init_packet, a.firmware) < 0)
+		return NULL;
+
+	cb.callable = a.progress;
+	ctx = nrfu_CreateCtx(&a, &cb);
+	if (!ctx) {
+		nrfu_ReleaseImages(&img);
+		return NULL;
+	}
+
+	Py_BEGIN_ALLOW_THREADS
+	if (img.in_memory)
+		ret = nrfu_ctx_run_mem(ctx, a.device, img.init_view.buf, img.init_view.len,
+				       img.firmware_view.buf, img.firmware_view.len);
+	else
+		ret = nrfu_ctx_run(ctx, a.device, PyBytes_AS_STRING(img.init_path),
+				   PyBytes_AS_STRING(img.firmware_path));
+	nrfu_ctx_destroy(ctx);
+	Py_END_ALLOW_THREADS
+
+	nrfu_ReleaseImages(&img);
+
+	if (cb.failed)
+		return NULL;
+
+	if (ret < 0) {
 		PyErr_Format(PyExc_ValueError, "Update failed!");
 		return NULL;
 	}
@@ -58,6 +275,192 @@ static PyObject *nrfu_Update(PyObject *self, PyObject *args, PyObject *kwds)
 	Py_RETURN_NONE;
 }
 
+PyDoc_STRVAR(session_doc,
+"Session(device, init_packet, firmware, log_level=LOG_LEVEL_ERROR,\n"
+"        baudrate=115200, flow_control=True, low_latency=False, prn=0,\n"
+"        fill_mtu=False, progress=None)\n"
+"\n"
+"Update driven by an event loop, without blocking or threads. The\n"
+"arguments are the same as for update(). Call process() until it returns\n"
+"False, waiting in between for events() on fileno() for at most timeout()\n"
+"seconds. nrfu_asyncio.update() does this on an asyncio event loop.\n");
+
+typedef struct {
+	PyObject_HEAD
+	struct nrfu_ctx *ctx;
+	struct nrfu_images img;
+	struct nrfu_progress_cb cb;
+} nrfu_SessionObject;
+
+static void nrfu_Session_dealloc(nrfu_SessionObject *self)
+{
+	/* cancels a session still running, before its images go away */
+	nrfu_ctx_destroy(self->ctx);
+	nrfu_ReleaseImages(&self->img);
+	Py_XDECREF(self->cb.callable);
+	Py_TYPE(self)->tp_free((PyObject *)self);
+}
+
+static PyObject *nrfu_Session_new(PyTypeObject *type, PyObject *args, PyObject *kwds)
+{
+	nrfu_SessionObject *self;
+	struct nrfu_args a;
+	int ret;
+
+	if (nrfu_ParseArgs(args, kwds, &a) < 0)
+		return NULL;
+
+	self = (nrfu_SessionObject *)type->tp_alloc(type, 0);
+	if (!self)
+		return NULL;
+
+	Py_INCREF(a.progress);
+	self->cb.callable = a.progress;
+
+	if (nrfu_GetImages(&self->img, a.init_packet, a.firmware) < 0)
+		goto err_out;
+
+	self->ctx = nrfu_CreateCtx(&a, &self->cb);
+	if (!self->ctx)
+		goto err_out;
+
+	if (self->img.in_memory)
+		ret = nrfu_ctx_start_mem(self->ctx, a.device,
+					 self->img.init_view.buf, self->img.init_view.len,
+					 self->img.firmware_view.buf, self->img.firmware_view.len);
+	else
+		ret = nrfu_ctx_start(self->ctx, a.device, PyBytes_AS_STRING(self->img.init_path),
+				     PyBytes_AS_STRING(self->img.firmware_path));
+	if (ret < 0) {
+		PyErr_Format(PyExc_ValueError, "Update failed!");
+		goto err_out;
+	}
+
+	return (PyObject *)self;
+
+err_out:
+	Py_DECREF(self);
+	return NULL;
+}
+
+PyDoc_STRVAR(session_process_doc,
+"process() -> bool\n"
+"\n"
+"Advance the update without blocking. Returns True while it is in\n"
+"progress and False once it is done, raises if it failed.\n");
+
+static PyObject *nrfu_Session_process(nrfu_SessionObject *self, PyObject *unused)
+{
+	int ret = nrfu_ctx_process(self->ctx);
+
+	/* the exception raised by the progress callback, which cancelled it */
+	if (self->cb.failed && PyErr_Occurred())
+		return NULL;
+
+	if (ret == NRFU_IN_PROGRESS)
+		Py_RETURN_TRUE;
+
+	if (ret < 0) {
+		PyErr_Format(PyExc_ValueError, "Update failed!");
+		return NULL;
+	}
+
+	Py_RETURN_FALSE;
+}
+
+PyDoc_STRVAR(session_fileno_doc,
+"fileno() -> int\n"
+"\n"
+"Descriptor to wait on, -1 if there is none. It changes when the device\n"
+"is reopened, so query it again after each process().\n");
+
+static PyObject *nrfu_Session_fileno(nrfu_SessionObject *self, PyObject *unused)
+{
+	return PyLong_FromLong(nrfu_ctx_get_fd(self->ctx));
+}
+
+PyDoc_STRVAR(session_events_doc,
+"events() -> int\n"
+"\n"
+"select.POLLIN and/or select.POLLOUT to wait for on fileno().\n");
+
+static PyObject *nrfu_Session_events(nrfu_SessionObject *self, PyObject *unused)
+{
+	return PyLong_FromLong(nrfu_ctx_poll_events(self->ctx));
+}
+
+PyDoc_STRVAR(session_timeout_doc,
+"timeout() -> float or None\n"
+"\n"
+"Seconds to wait at most before calling process() again, None if only\n"
+"an event on fileno() can advance the update.\n");
+
+static PyObject *nrfu_Session_timeout(nrfu_SessionObject *self, PyObject *unused)
+{
+	int timeout = nrfu_ctx_get_timeout(self->ctx);
+
+	if (timeout < 0)
+		Py_RETURN_NONE;
+
+	return PyFloat_FromDouble(timeout / 1000.0);
+}
+
+PyDoc_STRVAR(session_cancel_doc,
+"cancel() -> None\n"
+"\n"
+"Abort the update if it is still running.\n");
+
+static PyObject *nrfu_Session_cancel(nrfu_SessionObject *self, PyObject *unused)
+{
+	nrfu_ctx_cancel(self->ctx);
+	Py_RETURN_NONE;
+}
+
+static PyMethodDef nrfu_session_methods[] = {
+	{
+		.ml_name = "process",
+		.ml_meth = (PyCFunction)nrfu_Session_process,
+		.ml_flags = METH_NOARGS,
+		.ml_doc = session_process_doc,
+	},
+	{
+		.ml_name = "fileno",
+		.ml_meth = (PyCFunction)nrfu_Session_fileno,
+		.ml_flags = METH_NOARGS,
+		.ml_doc = session_fileno_doc,
+	},
+	{
+		.ml_name = "events",
+		.ml_meth = (PyCFunction)nrfu_Session_events,
+		.ml_flags = METH_NOARGS,
+		.ml_doc = session_events_doc,
+	},
+	{
+		.ml_name = "timeout",
+		.ml_meth = (PyCFunction)nrfu_Session_timeout,
+		.ml_flags = METH_NOARGS,
+		.ml_doc = session_timeout_doc,
+	},
+	{
+		.ml_name = "cancel",
+		.ml_meth = (PyCFunction)nrfu_Session_cancel,
+		.ml_flags = METH_NOARGS,
+		.ml_doc = session_cancel_doc,
+	},
+	{ }
+};
+
+static PyTypeObject nrfu_SessionType = {
+	PyVarObject_HEAD_INIT(NULL, 0)
+	.tp_name = "nrfu.Session",
+	.tp_doc = session_doc,
+	.tp_basicsize = sizeof(nrfu_SessionObject),
+	.tp_flags = Py_TPFLAGS_DEFAULT,
+	.tp_new = nrfu_Session_new,
+	.tp_dealloc = (destructor)nrfu_Session_dealloc,
+	.tp_methods = nrfu_session_methods,
+};
+
 static PyMethodDef nrfu_module_methods[] = {
 	{
 		.ml_name = "update",
@@ -128,5 +531,15 @@ PyMODINIT_FUNC PyInit_nrfu(void)
 	if (ret < 0)
 		return NULL;
 
+	if (PyType_Ready(&nrfu_SessionType) < 0)
+		return NULL;
+
+	Py_INCREF(&nrfu_SessionType);
+	if (PyModule_AddObject(module, "Session", (PyObject *)&nrfu_SessionType) < 0) {
+		Py_DECREF(&nrfu_SessionType);
+		Py_DECREF(module);
+		return NULL;
+	}
+
 	return module;
 }
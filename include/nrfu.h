@@ -5,6 +5,9 @@
 #ifndef NRFU_H_
 #define NRFU_H_
 
+#include <stddef.h>
+#include <stdint.h>
+
 enum nrfu_log_level {
 	NRFU_LOG_LEVEL_SILENT = 0,
 	NRFU_LOG_LEVEL_ERROR = 1,
@@ -12,6 +15,335 @@ enum nrfu_log_level {
 	NRFU_LOG_LEVEL_DEBUG = 3,
 };
 
+enum nrfu_flow_control {
+	NRFU_FLOW_CONTROL_NONE = 0,
+	NRFU_FLOW_CONTROL_RTSCTS = 1,
+};
+
+#define NRFU_DEFAULT_BAUDRATE	115200
+
+struct nrfu_options {
+	enum nrfu_log_level log_level;
+	/* line speed in baud, any rate the driver accepts; 0 leaves the port as is (USB-CDC) */
+	unsigned int baudrate;
+	enum nrfu_flow_control flow_control;
+	/* ask the tty driver for ASYNC_LOW_LATENCY */
+	int low_latency;
+	/*
+	 * packet receipt notification interval: the bootloader reports offset
+	 * and CRC after every prn data packets, which are checked while
+	 * streaming continues. 0 only checks the CRC after each object.
+	 */
+	unsigned int prn;
+	/*
+	 * pack data packets up to the MTU by their actual escaped length. Only
+	 * for bootloaders that can decode MTU - 2 payload bytes per packet; the
+	 * nRF5 SDK serial bootloaders accept at most (MTU - 1) / 2 - 1.
+	 */
+	int fill_mtu;
+	/*
+	 * send firmware objects from pre-encoded frames, built once per image,
+	 * MTU and object size. With frame_cache_dir the frames are also kept
+	 * on disk for later runs, see nrfu_frame_cache_build().
+	 */
+	int frame_cache;
+	const char *frame_cache_dir;
+	/*
+	 * record every frame sent and received in a ring buffer of trace_size
+	 * bytes, without formatting them. With trace_file the trace is written
+	 * there when the session ends, see nrfu_trace.h and nrf-trace.
+	 */
+	unsigned int trace_size;
+	const char *trace_file;
+	/*
+	 * write every byte exchanged with the bootloader to capture_file. A
+	 * device named "replay:<file>" plays such a capture back in place of
+	 * the bootloader, with the recorded timing unless replay_full_speed.
+	 */
+	const char *capture_file;
+	int replay_full_speed;
+	/*
+	 * response timeouts adapt to the round trip times measured for each
+	 * kind of request, see nrfu_rtt_stats: a request waits srtt + 4 *
+	 * rttvar, at least response_timeout_min_ms and at most
+	 * response_timeout_ms, plus the time the data queued before it needs
+	 * on the line at baudrate. Until a kind was measured, for replays and
+	 * for the execute that ends the image, which the bootloader answers
+	 * after validating it, the maximum applies. Creating and executing an
+	 * object may take flash_timeout_ms longer per started 4 KiB, to erase
+	 * and write flash.
+	 */
+	unsigned int response_timeout_ms;
+	unsigned int response_timeout_min_ms;
+	unsigned int flash_timeout_ms;
+	/*
+	 * a data object that fails, e.g. on a timeout or a CRC mismatch, is
+	 * sent again up to retries times. After retry_delay_ms, doubled for
+	 * each further attempt up to 32 times as long, the link is
+	 * resynchronised with a ping and the object is continued after the
+	 * data the bootloader holds intact, or sent anew. No retry starts
+	 * later than retry_deadline_ms after the session started, 0 sets no
+	 * deadline.
+	 */
+	unsigned int retries;
+	unsigned int retry_delay_ms;
+	unsigned int retry_deadline_ms;
+};
+
+/* ring buffer size if only trace_file is given */
+#define NRFU_TRACE_DEFAULT_SIZE	(1024 * 1024)
+
+#define NRFU_RESPONSE_TIMEOUT_MS	1000
+#define NRFU_RESPONSE_TIMEOUT_MIN_MS	100
+#define NRFU_FLASH_TIMEOUT_MS		100
+#define NRFU_DEFAULT_RETRIES		3
+#define NRFU_RETRY_DELAY_MS		100
+
+/* Fill opts with the defaults used by nrfu_update() */
+void nrfu_options_init(struct nrfu_options *opts);
+
+/*
+ * Context based API
+ *
+ * A context holds the options, the log handler and the state of one update
+ * session at a time. The library has no mutable global state: different
+ * contexts may be used concurrently from different threads, but a single
+ * context must not be used from two threads at the same time.
+ */
+struct nrfu_ctx;
+
+/* Receives each formatted log message that passes the log level */
+typedef void (*nrfu_log_fn)(enum nrfu_log_level level, const char *msg, void *userdata);
+
+/*
+ * Progress reporting
+ *
+ * A session is divided into phases. Each phase reports BEGIN and END, the
+ * init packet and firmware phases also report UPDATE while data is being
+ * streamed, at most every NRFU_PROGRESS_INTERVAL_MS.
+ */
+enum nrfu_phase {
+	NRFU_PHASE_CONNECT,		/* open and configure the transport */
+	NRFU_PHASE_PING,
+	NRFU_PHASE_PRN,			/* set the receipt notification interval */
+	NRFU_PHASE_MTU,
+	NRFU_PHASE_INIT_PACKET,
+	NRFU_PHASE_FIRMWARE,
+	NRFU_PHASE_OBJECT,		/* create, stream and verify one data object */
+	NRFU_PHASE_EXECUTE,
+	NRFU_PHASE_COUNT,
+};
+
+enum nrfu_progress_event {
+	NRFU_PROGRESS_BEGIN,
+	NRFU_PROGRESS_UPDATE,
+	NRFU_PROGRESS_END,
+};
+
+#define NRFU_PROGRESS_INTERVAL_MS	100
+
+struct nrfu_progress {
+	enum nrfu_progress_event event;
+	enum nrfu_phase phase;
+	int status;			/* END: 0 on success, -1 on failure */
+	const char *image;		/* name of the image being sent */
+	unsigned long image_bytes;	/* bytes of the image sent so far, incl. resumed ones */
+	unsigned long image_size;
+	unsigned int object;		/* current data object */
+	unsigned int n_objects;
+	/* counters of the whole session */
+	unsigned long payload_bytes;	/* image data sent in data packets */
+	unsigned long wire_tx_bytes;	/* bytes written to the port, after SLIP encoding */
+	unsigned long wire_rx_bytes;	/* bytes read from the port */
+	unsigned int retries;		/* objects sent again and reconnect attempts */
+	uint64_t timestamp_ns;		/* CLOCK_MONOTONIC */
+	uint64_t elapsed_ns;		/* END: duration of the phase */
+};
+
+typedef void (*nrfu_progress_fn)(const struct nrfu_progress *progress, void *userdata);
+
+/*
+ * Round trip times
+ *
+ * Measured per kind of request from sending it to its response, and for
+ * receipt notifications from the last packet of their interval, without
+ * the time the data queued before needs on the line. Object requests are
+ * kept apart by object type, as the bootloader handles them differently.
+ */
+enum nrfu_rtt_kind {
+	NRFU_RTT_PING,
+	NRFU_RTT_SET_PRN,
+	NRFU_RTT_GET_MTU,
+	NRFU_RTT_COMMAND_SELECT,
+	NRFU_RTT_COMMAND_CREATE,
+	NRFU_RTT_COMMAND_EXECUTE,
+	NRFU_RTT_DATA_SELECT,
+	NRFU_RTT_DATA_CREATE,
+	NRFU_RTT_DATA_EXECUTE,
+	NRFU_RTT_GET_CRC,
+	NRFU_RTT_RECEIPT,		/* receipt notifications */
+	NRFU_RTT_COUNT,
+};
+
+struct nrfu_rtt_stats {
+	unsigned int samples;
+	unsigned int timeouts;
+	uint64_t min_ns;
+	uint64_t max_ns;
+	uint64_t srtt_ns;		/* smoothed round trip time, as in RFC 6298 */
+	uint64_t rttvar_ns;		/* and its mean deviation */
+};
+
+/*
+ * Transports
+ *
+ * The device name selects how the bootloader is reached:
+ *   /dev/ttyACM0		serial port, configured with termios
+ *   tcp:<host>:<port>		raw TCP, e.g. a serial-over-network server
+ *   unix:<path>		Unix stream socket
+ *   fd:<n>			descriptor opened by the caller, e.g. one end of a
+ *				socketpair() or a pty master; it is switched to
+ *				non-blocking mode and not closed
+ *   replay:<file>		a capture played back, see capture_file
+ * Any other link can be plugged into a context with nrfu_ctx_set_transport().
+ */
+struct nrfu_transport_ops {
+	/* returns a handle passed to the other calls, NULL with errno set on failure */
+	void *(*open)(const char *devname, void *userdata);
+	/* write all of data; 0 on success, -1 with errno set */
+	int (*send)(void *handle, const uint8_t *data, size_t length);
+	/*
+	 * wait up to timeout_ms for data, nrfu_ctx_process() passes 0; bytes
+	 * read, 0 on timeout, -1 with errno set
+	 */
+	int (*receive)(void *handle, uint8_t *buf, size_t size, int timeout_ms);
+	void (*close)(void *handle);
+};
+
+/* Name of a phase, e.g. "init-packet" */
+const char *nrfu_phase_name(enum nrfu_phase phase);
+/* Name of a kind of request, e.g. "data-create" */
+const char *nrfu_rtt_name(enum nrfu_rtt_kind kind);
+
+struct nrfu_ctx *nrfu_ctx_create(void);
+void nrfu_ctx_destroy(struct nrfu_ctx *ctx);
+int nrfu_ctx_set_options(struct nrfu_ctx *ctx, const struct nrfu_options *opts);
+/* NULL restores the default handler, which writes to stderr */
+void nrfu_ctx_set_log_fn(struct nrfu_ctx *ctx, nrfu_log_fn fn, void *userdata);
+/* Open every device through ops instead of the built-in transports; NULL restores them */
+void nrfu_ctx_set_transport(struct nrfu_ctx *ctx, const struct nrfu_transport_ops *ops,
+			    void *userdata);
+/* Write the trace of the last session, see nrfu_options.trace_size */
+int nrfu_ctx_write_trace(struct nrfu_ctx *ctx, const char *path);
+/* Called from the thread running the session; NULL disables progress reports */
+void nrfu_ctx_set_progress_fn(struct nrfu_ctx *ctx, nrfu_progress_fn fn, void *userdata);
+/* Round trip times of the current or last session; -1 for an invalid kind */
+int nrfu_ctx_get_rtt_stats(const struct nrfu_ctx *ctx, enum nrfu_rtt_kind kind,
+			   struct nrfu_rtt_stats *stats);
+int nrfu_ctx_run(struct nrfu_ctx *ctx, const char *devname, const char *init_packet,
+		 const char *firmware);
+/* The buffers are used in place and must stay valid until the call returns */
+int nrfu_ctx_run_mem(struct nrfu_ctx *ctx, const char *devname,
+		     const void *init_packet, size_t init_packet_size,
+		     const void *firmware, size_t firmware_size);
+/*
+ * Send the images of a DFU zip package created by nrfutil, reconnecting to
+ * the bootloader between SoftDevice, bootloader and application.
+ */
+int nrfu_ctx_run_package(struct nrfu_ctx *ctx, const char *devname, const char *package);
+
+/*
+ * Non-blocking API
+ *
+ * nrfu_ctx_start*() set up the same sessions as nrfu_ctx_run*() and return
+ * at once, nrfu_ctx_process() then advances them as far as it can without
+ * blocking, e.g. from the event loop of a daemon updating many devices:
+ *
+ *	while (nrfu_ctx_process(ctx) == NRFU_IN_PROGRESS)
+ *		wait until nrfu_ctx_get_fd(ctx) is ready for the
+ *		nrfu_ctx_poll_events(ctx), at most nrfu_ctx_get_timeout(ctx) ms
+ *
+ * The descriptor changes when the device is opened again, e.g. between the
+ * images of a package, and is -1 while there is none, so all three are to
+ * be queried after every nrfu_ctx_process(). The events are POLLIN and
+ * POLLOUT, which equal EPOLLIN and EPOLLOUT. Progress and log handlers are
+ * called from nrfu_ctx_process(). The nrfu_ctx_run*() calls are this loop
+ * around poll().
+ *
+ * Network connects are waited for with POLLOUT like any other event. What
+ * still blocks is the name lookup of a tcp: host, which a numeric address
+ * avoids, and the open() of a custom transport or a replay file.
+ */
+#define NRFU_IN_PROGRESS	1
+
+int nrfu_ctx_start(struct nrfu_ctx *ctx, const char *devname, const char *init_packet,
+		   const char *firmware);
+/* The buffers are used in place and must stay valid until the session ends */
+int nrfu_ctx_start_mem(struct nrfu_ctx *ctx, const char *devname,
+		       const void *init_packet, size_t init_packet_size,
+		       const void *firmware, size_t firmware_size);
+int nrfu_ctx_start_package(struct nrfu_ctx *ctx, const char *devname, const char *package);
+/* NRFU_IN_PROGRESS, 0 once the session is complete or -1 if it failed */
+int nrfu_ctx_process(struct nrfu_ctx *ctx);
+int nrfu_ctx_get_fd(const struct nrfu_ctx *ctx);
+/* 0 if only the timeout is waited for */
+int nrfu_ctx_poll_events(const struct nrfu_ctx *ctx);
+/* -1 if there is no timeout */
+int nrfu_ctx_get_timeout(const struct nrfu_ctx *ctx);
+/*
+ * Abort a running session, the device is left to resume later. Progress
+ * and log handlers may call this too, the session then ends as soon as
+ * the handler returns to the library.
+ */
+void nrfu_ctx_cancel(struct nrfu_ctx *ctx);
+
 int nrfu_update(const char *devname, const char *init_packet, const char *firmware, enum nrfu_log_level log_level);
+int nrfu_update_opts(const char *devname, const char *init_packet, const char *firmware,
+		     const struct nrfu_options *opts);
+/* Same as nrfu_update_opts() with images the caller already holds in memory */
+int nrfu_update_mem(const char *devname, const void *init_packet, size_t init_packet_size,
+		    const void *firmware, size_t firmware_size, const struct nrfu_options *opts);
+int nrfu_update_package(const char *devname, const char *package,
+			const struct nrfu_options *opts);
+
+/*
+ * Encode the data frames of firmware for a bootloader with the given MTU and
+ * maximum object size ahead of time and store them in cache_dir, where
+ * sessions with frame_cache_dir set pick them up.
+ */
+int nrfu_frame_cache_build(const char *firmware, const char *cache_dir, unsigned int mtu,
+			   unsigned int object_size, int fill_mtu);
+
+/*
+ * Fleet API
+ *
+ * Flashes the same init packet and firmware onto many devices. The images
+ * are loaded once and shared, the devices are updated in parallel by a pool
+ * of worker threads, each with its own context.
+ */
+struct nrfu_fleet;
+
+struct nrfu_fleet_result {
+	const char *devname;
+	int status;		/* 0 on success, -1 on failure */
+	double seconds;		/* duration of this device's session */
+	unsigned long bytes;	/* image bytes transferred on success */
+};
+
+struct nrfu_fleet *nrfu_fleet_create(const char *init_packet, const char *firmware);
+/* The buffers are used in place and must outlive the fleet */
+struct nrfu_fleet *nrfu_fleet_create_mem(const void *init_packet, size_t init_packet_size,
+					 const void *firmware, size_t firmware_size);
+void nrfu_fleet_destroy(struct nrfu_fleet *fleet);
+/* -1 with errno EINVAL for options nrfu_ctx_set_options() would reject */
+int nrfu_fleet_set_options(struct nrfu_fleet *fleet, const struct nrfu_options *opts);
+int nrfu_fleet_add_device(struct nrfu_fleet *fleet, const char *devname);
+/* max_parallel 0 runs all devices at once; returns the number of failed devices */
+int nrfu_fleet_run(struct nrfu_fleet *fleet, unsigned int max_parallel);
+unsigned int nrfu_fleet_device_count(const struct nrfu_fleet *fleet);
+int nrfu_fleet_get_result(const struct nrfu_fleet *fleet, unsigned int index,
+			  struct nrfu_fleet_result *result);
+/* wall clock time of the last nrfu_fleet_run() in seconds */
+double nrfu_fleet_elapsed(const struct nrfu_fleet *fleet);
 
 #endif /* NRFU_H_ */
@@ -0,0 +1,42 @@
+/* SPDX-License-Identifier: BSD-3-Clause */
+/*
+ * Copyright (C) 2022 Leica Geosystems AG
+ */
+#ifndef NRFU_TRACE_H_
+#define NRFU_TRACE_H_
+
+#include <stdint.h>
+
+/*
+ * Trace file format, written by nrfu_ctx_write_trace() in host byte order:
+ * a header followed by records in chronological order. Each record is
+ * followed by its captured bytes, padded to a multiple of 8.
+ */
+#define NRFU_TRACE_MAGIC	0x314352545546524eULL	/* "NRFUTRC1" */
+#define NRFU_TRACE_SNAPLEN	256
+#define NRFU_TRACE_ALIGN(n)	(((n) + 7) & ~7u)
+
+struct nrfu_trace_header {
+	uint64_t magic;
+	uint32_t snaplen;
+	uint32_t reserved;
+	/* records lost because the ring buffer wrapped */
+	uint64_t dropped;
+};
+
+enum nrfu_trace_dir {
+	/* bytes written to the port, SLIP encoded, possibly several frames */
+	NRFU_TRACE_TX = 0,
+	/* one decoded frame received from the bootloader */
+	NRFU_TRACE_RX = 1,
+};
+
+struct nrfu_trace_record {
+	uint64_t timestamp_ns;	/* CLOCK_MONOTONIC */
+	uint32_t length;	/* original length */
+	uint16_t captured;	/* bytes stored, at most NRFU_TRACE_SNAPLEN */
+	uint8_t dir;
+	uint8_t opcode;		/* first byte of the frame */
+};
+
+#endif /* NRFU_TRACE_H_ */
@@ -0,0 +1,20 @@
+/* SPDX-License-Identifier: BSD-3-Clause */
+/*
+ * Copyright (C) 2022 Leica Geosystems AG
+ */
+#ifndef CONTEXT_H_
+#define CONTEXT_H_
+
+struct nrfu_ctx;
+struct nrfu_options;
+struct image;
+
+/* What is wrong with opts, NULL if they are valid */
+const char *nrfu_options_check(const struct nrfu_options *opts);
+
+int nrfu_ctx_start_images(struct nrfu_ctx *ctx, const char *devname,
+			  const struct image *init_packet, const struct image *firmware);
+int nrfu_ctx_run_images(struct nrfu_ctx *ctx, const char *devname,
+			const struct image *init_packet, const struct image *firmware);
+
+#endif /* CONTEXT_H_ */
@@ -0,0 +1,40 @@
+/* SPDX-License-Identifier: BSD-3-Clause */
+/*
+ * Copyright (C) 2022 Leica Geosystems AG
+ */
+#ifndef DFU_H_
+#define DFU_H_
+
+/* nRF5 SDK serial DFU protocol */
+
+/* room for one data byte in a WRITE_OBJECT packet: (MTU - 1) / 2 - 1 >= 1 */
+#define DFU_MTU_MIN		5
+
+enum dfu_opcode {
+	DFU_OPCODE_OBJECT_CREATE	= 0x01,
+	DFU_OPCODE_SET_PRN		= 0x02,
+	DFU_OPCODE_GET_CRC		= 0x03,
+	DFU_OPCODE_SET_EXECUTE		= 0x04,
+	DFU_OPCODE_OBJECT_SELECT	= 0x06,
+	DFU_OPCODE_GET_MTU		= 0x07,
+	DFU_OPCODE_WRITE_OBJECT		= 0x08,
+	DFU_OPCODE_PING			= 0x09,
+	DFU_OPCODE_RESPONSE		= 0x60,
+};
+
+enum dfu_rescode {
+	DFU_RESCODE_SUCCESS		= 0x01,
+	DFU_RESCODE_OP_CODE_NOT_SUPPORTED = 0x02,
+	DFU_RESCODE_INVALID_PARAMETER	= 0x03,
+	DFU_RESCODE_INSUFFICIENT_RESOURCES = 0x04,
+	DFU_RESCODE_INVALID_OBJECT	= 0x05,
+	DFU_RESCODE_UNSUPPORTED_TYPE	= 0x07,
+	DFU_RESCODE_OPERATION_NOT_PERMITTED = 0x08,
+};
+
+enum dfu_object_type {
+	DFU_OBJECT_TYPE_COMMAND		= 0x01,
+	DFU_OBJECT_TYPE_DATA		= 0x02,
+};
+
+#endif /* DFU_H_ */
@@ -0,0 +1,308 @@
+// SPDX-License-Identifier: BSD-3-Clause
+/*
+ * Copyright (C) 2022 Leica Geosystems AG
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <nrfu.h>
+
+#include "context.h"
+#include "image.h"
+
+struct fleet_device {
+	char *devname;
+	struct nrfu_fleet *fleet;
+	struct nrfu_fleet_result result;
+	/* log output is collected into whole lines prefixed with the device name */
+	char line[256];
+	size_t line_length;
+};
+
+struct nrfu_fleet {
+	struct nrfu_options opts;
+	struct image init_packet;
+	struct image firmware;
+
+	struct fleet_device *devices;
+	unsigned int n_devices;
+
+	pthread_mutex_t lock;
+	unsigned int next;	/* next device to be picked up by a worker */
+	double elapsed;
+};
+
+static double fleet_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* A single call, so lines of devices logging at the same time don't mix */
+static void fleet_log_flush(struct fleet_device *dev)
+{
+	if (!dev->line_length)
+		return;
+
+	if (dev->line[dev->line_length - 1] != '\n')
+		dev->line[dev->line_length++] = '\n';
+	dev->line[dev->line_length] = '\0';
+
+	fputs(dev->line, stderr);
+	dev->line_length = 0;
+}
+
+static void fleet_log(enum nrfu_log_level level, const char *msg, void *userdata)
+{
+	struct fleet_device *dev = userdata;
+	/* room for the newline and terminator added by fleet_log_flush() */
+	size_t size = sizeof(dev->line) - 2;
+	size_t n;
+
+	while (*msg) {
+		if (!dev->line_length)
+			dev->line_length = snprintf(dev->line, size, "[%.64s] ", dev->devname);
+
+		n = strcspn(msg, "\n");
+		if (msg[n])
+			n++;
+		if (n > size - dev->line_length)
+			n = size - dev->line_length;
+
+		memcpy(&dev->line[dev->line_length], msg, n);
+		dev->line_length += n;
+		msg += n;
+
+		/* overlong lines are broken up */
+		if (dev->line[dev->line_length - 1] == '\n' || dev->line_length == size)
+			fleet_log_flush(dev);
+	}
+}
+
+static struct nrfu_fleet *fleet_alloc(void)
+{
+	struct nrfu_fleet *fleet;
+
+	fleet = calloc(1, sizeof(*fleet));
+	if (!fleet)
+		return NULL;
+
+	nrfu_options_init(&fleet->opts);
+	pthread_mutex_init(&fleet->lock, NULL);
+
+	return fleet;
+}
+
+struct nrfu_fleet *nrfu_fleet_create(const char *init_packet, const char *firmware)
+{
+	struct nrfu_fleet *fleet;
+
+	if (!init_packet || !firmware)
+		return NULL;
+
+	fleet = fleet_alloc();
+	if (!fleet)
+		return NULL;
+
+	/* the images are mapped and indexed once and shared by all sessions */
+	if (image_load_file(&fleet->init_packet, init_packet) < 0 ||
+	    image_load_file(&fleet->firmware, firmware) < 0) {
+		int err = errno;
+
+		nrfu_fleet_destroy(fleet);
+		errno = err;
+		return NULL;
+	}
+
+	return fleet;
+}
+
+struct nrfu_fleet *nrfu_fleet_create_mem(const void *init_packet, size_t init_packet_size,
+					 const void *firmware, size_t firmware_size)
+{
+	struct nrfu_fleet *fleet;
+
+	fleet = fleet_alloc();
+	if (!fleet)
+		return NULL;
+
+	if (image_from_memory(&fleet->init_packet, "init-packet", init_packet, init_packet_size) < 0 ||
+	    image_from_memory(&fleet->firmware, "firmware", firmware, firmware_size) < 0) {
+		int err = errno;
+
+		nrfu_fleet_destroy(fleet);
+		errno = err;
+		return NULL;
+	}
+
+	return fleet;
+}
+
+void nrfu_fleet_destroy(struct nrfu_fleet *fleet)
+{
+	unsigned int i;
+
+	if (!fleet)
+		return;
+
+	for (i = 0; i < fleet->n_devices; i++)
+		free(fleet->devices[i].devname);
+	free(fleet->devices);
+
+	image_release(&fleet->init_packet);
+	image_release(&fleet->firmware);
+	pthread_mutex_destroy(&fleet->lock);
+	free(fleet);
+}
+
+int nrfu_fleet_set_options(struct nrfu_fleet *fleet, const struct nrfu_options *opts)
+{
+	if (!fleet || !opts)
+		return -1;
+
+	/* rather than once for each device when its session starts */
+	if (nrfu_options_check(opts)) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	fleet->opts = *opts;
+	return 0;
+}
+
+int nrfu_fleet_add_device(struct nrfu_fleet *fleet, const char *devname)
+{
+	struct fleet_device *devices, *dev;
+
+	if (!fleet || !devname)
+		return -1;
+
+	devices = realloc(fleet->devices, (fleet->n_devices + 1) * sizeof(*devices));
+	if (!devices)
+		return -1;
+	fleet->devices = devices;
+
+	dev = &devices[fleet->n_devices];
+	memset(dev, 0, sizeof(*dev));
+	dev->devname = strdup(devname);
+	if (!dev->devname)
+		return -1;
+
+	fleet->n_devices++;
+	return 0;
+}
+
+static void fleet_run_device(struct nrfu_fleet *fleet, struct fleet_device *dev)
+{
+	struct nrfu_ctx *ctx;
+	double start;
+
+	dev->result.devname = dev->devname;
+	dev->result.status = -1;
+	dev->result.bytes = 0;
+	dev->line_length = 0;
+
+	start = fleet_now();
+
+	ctx = nrfu_ctx_create();
+	if (ctx) {
+		nrfu_ctx_set_log_fn(ctx, fleet_log, dev);
+		if (nrfu_ctx_set_options(ctx, &fleet->opts) == 0)
+			dev->result.status = nrfu_ctx_run_images(ctx, dev->devname,
+								 &fleet->init_packet,
+								 &fleet->firmware);
+		nrfu_ctx_destroy(ctx);
+		fleet_log_flush(dev);
+	}
+
+	dev->result.seconds = fleet_now() - start;
+	if (dev->result.status == 0)
+		dev->result.bytes = fleet->init_packet.size + fleet->firmware.size;
+}
+
+static void *fleet_worker(void *arg)
+{
+	struct nrfu_fleet *fleet = arg;
+	unsigned int i;
+
+	for (;;) {
+		pthread_mutex_lock(&fleet->lock);
+		i = fleet->next++;
+		pthread_mutex_unlock(&fleet->lock);
+
+		if (i >= fleet->n_devices)
+			break;
+
+		fleet_run_device(fleet, &fleet->devices[i]);
+	}
+
+	return NULL;
+}
+
+int nrfu_fleet_run(struct nrfu_fleet *fleet, unsigned int max_parallel)
+{
+	pthread_t *threads;
+	unsigned int i, n_threads, failed = 0;
+	double start;
+
+	if (!fleet)
+		return -1;
+
+	n_threads = max_parallel && max_parallel < fleet->n_devices ? max_parallel : fleet->n_devices;
+	fleet->next = 0;
+
+	threads = calloc(n_threads ? n_threads : 1, sizeof(*threads));
+	if (!threads)
+		return -1;
+
+	start = fleet_now();
+
+	for (i = 0; i < n_threads; i++) {
+		if (pthread_create(&threads[i], NULL, fleet_worker, fleet))
+			break;
+	}
+	n_threads = i;
+
+	/* no thread could be started, do the work in the caller */
+	if (!n_threads)
+		fleet_worker(fleet);
+
+	for (i = 0; i < n_threads; i++)
+		pthread_join(threads[i], NULL);
+	free(threads);
+
+	fleet->elapsed = fleet_now() - start;
+
+	for (i = 0; i < fleet->n_devices; i++)
+		if (fleet->devices[i].result.status)
+			failed++;
+
+	return failed;
+}
+
+unsigned int nrfu_fleet_device_count(const struct nrfu_fleet *fleet)
+{
+	return fleet ? fleet->n_devices : 0;
+}
+
+int nrfu_fleet_get_result(const struct nrfu_fleet *fleet, unsigned int index,
+			  struct nrfu_fleet_result *result)
+{
+	if (!fleet || !result || index >= fleet->n_devices)
+		return -1;
+
+	*result = fleet->devices[index].result;
+	return 0;
+}
+
+double nrfu_fleet_elapsed(const struct nrfu_fleet *fleet)
+{
+	return fleet ? fleet->elapsed : 0;
+}
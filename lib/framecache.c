@@ -0,0 +1,504 @@
+// SPDX-License-Identifier: BSD-3-Clause
+/*
+ * Copyright (C) 2022 Leica Geosystems AG
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <nrfu.h>
+
+#include "dfu.h"
+#include "framecache.h"
+#include "image.h"
+#include "slip.h"
+#include "toolbox.h"
+
+/*
+ * Cache file layout, in host byte order (the magic doubles as byte order
+ * check): the header, first_packet[n_objects + 1], packets[n_packets] and
+ * the frames. An in-memory cache uses the same layout in a single buffer,
+ * so it can be written out as is.
+ */
+#define FRAME_CACHE_MAGIC	0x3143465546524e00ULL	/* "\0NRFUFC1" */
+
+struct frame_cache_header {
+	uint64_t magic;
+	uint64_t image_hash;
+	uint32_t image_size;
+	uint32_t object_size;
+	uint16_t mtu;
+	uint16_t fill_mtu;
+	uint32_t n_objects;
+	uint32_t n_packets;
+	/* CRC of everything after the header */
+	uint32_t crc;
+	uint64_t frames_length;
+};
+
+struct frame_cache_list {
+	pthread_mutex_t lock;
+	int hashed;
+	uint64_t image_hash;
+	struct frame_cache *head;
+};
+
+/*
+ * Pack the start of data into one SLIP encoded WRITE_OBJECT frame of at
+ * most mtu bytes, see stream_data(). Returns the frame length and the
+ * number of data bytes it carries in consumed.
+ */
+size_t frame_pack(uint8_t *frame, uint16_t mtu, int fill_mtu, const uint8_t *data,
+		  size_t data_length, size_t *consumed)
+{
+	size_t n = fill_mtu ? data_length : ((mtu - 1) / 2) - 1;
+	size_t frame_length;
+
+	if (n > data_length)
+		n = data_length;
+
+	/* leave room for the opcode and the END byte */
+	frame[0] = DFU_OPCODE_WRITE_OBJECT;
+	frame_length = 1 + slip_pack(&frame[1], mtu - 2, data, n, consumed);
+	frame[frame_length++] = SLIP_BYTE_END;
+
+	return frame_length;
+}
+
+/* FNV-1a, identifies the image a cache file was built for */
+static uint64_t image_hash(const struct image *img)
+{
+	uint64_t h = 0xcbf29ce484222325ULL;
+	uint32_t i;
+
+	for (i = 0; i < img->size; i++) {
+		h ^= img->data[i];
+		h *= 0x100000001b3ULL;
+	}
+
+	return h ^ img->size;
+}
+
+static size_t frame_cache_layout(const struct frame_cache_header *hdr)
+{
+	return sizeof(*hdr) + (hdr->n_objects + 1) * sizeof(uint32_t) +
+	       hdr->n_packets * sizeof(struct frame_cache_packet);
+}
+
+static void frame_cache_attach(struct frame_cache *fc, const uint8_t *base)
+{
+	const struct frame_cache_header *hdr = (const void *)base;
+
+	fc->image_hash = hdr->image_hash;
+	fc->image_size = hdr->image_size;
+	fc->object_size = hdr->object_size;
+	fc->mtu = hdr->mtu;
+	fc->fill_mtu = hdr->fill_mtu;
+	fc->n_objects = hdr->n_objects;
+	fc->n_packets = hdr->n_packets;
+	fc->frames_length = hdr->frames_length;
+
+	fc->first_packet = (const void *)(base + sizeof(*hdr));
+	fc->packets = (const void *)&fc->first_packet[fc->n_objects + 1];
+	fc->frames = base + frame_cache_layout(hdr);
+}
+
+static void frame_cache_free(struct frame_cache *fc)
+{
+	if (fc->map)
+		munmap(fc->map, fc->map_length);
+	free(fc->buf);
+	free(fc);
+}
+
+static struct frame_cache *frame_cache_build(const struct image *img, uint64_t hash,
+					     uint16_t mtu, uint32_t object_size, int fill_mtu)
+{
+	struct frame_cache_header hdr = {
+		.magic = FRAME_CACHE_MAGIC,
+		.image_hash = hash,
+		.image_size = img->size,
+		.object_size = object_size,
+		.mtu = mtu,
+		.fill_mtu = !!fill_mtu,
+	};
+	struct frame_cache_packet *packets;
+	struct frame_cache *fc;
+	uint32_t *first_packet;
+	uint32_t obj, offset, packet, crc;
+	uint8_t *scratch, *base, *frames;
+	size_t frame_length, consumed, length = 0;
+	int pass;
+
+	scratch = malloc(mtu);
+	fc = calloc(1, sizeof(*fc));
+	if (!scratch || !fc)
+		goto err_out;
+
+	hdr.n_objects = (img->size + (uint64_t)object_size - 1) / object_size;
+
+	/* the first pass only counts, the second one fills the cache */
+	for (pass = 0; pass < 2; pass++) {
+		base = NULL;
+		if (pass) {
+			length = frame_cache_layout(&hdr) + hdr.frames_length;
+			base = malloc(length);
+			if (!base)
+				goto err_out;
+			memcpy(base, &hdr, sizeof(hdr));
+			frame_cache_attach(fc, base);
+			fc->buf = base;
+		}
+
+		first_packet = (uint32_t *)fc->first_packet;
+		packets = (struct frame_cache_packet *)fc->packets;
+		frames = (uint8_t *)fc->frames;
+		hdr.frames_length = 0;
+		packet = 0;
+		offset = 0;
+		crc = 0;
+
+		for (obj = 0; obj < hdr.n_objects; obj++) {
+			uint32_t obj_end = offset + object_size;
+
+			if (obj_end > img->size || obj_end < offset)
+				obj_end = img->size;
+
+			if (base)
+				first_packet[obj] = packet;
+
+			/* packets never cross an object, the counter restarts with each */
+			while (offset < obj_end) {
+				uint8_t *frame = base ? &frames[hdr.frames_length] : scratch;
+
+				frame_length = frame_pack(frame, mtu, fill_mtu, &img->data[offset],
+							  obj_end - offset, &consumed);
+				hdr.frames_length += frame_length;
+
+				if (base) {
+					crc = crc32_compute(&img->data[offset], consumed, crc);
+					packets[packet].end_offset = offset + consumed;
+					packets[packet].crc = crc;
+					packets[packet].frame_end = hdr.frames_length;
+				}
+				offset += consumed;
+				packet++;
+			}
+		}
+
+		if (base)
+			first_packet[obj] = packet;
+		hdr.n_packets = packet;
+
+		if (hdr.frames_length > UINT32_MAX) {
+			errno = EFBIG;
+			goto err_out;
+		}
+	}
+
+	((struct frame_cache_header *)base)->crc =
+		crc32_compute(base + sizeof(hdr), length - sizeof(hdr), 0);
+
+	free(scratch);
+	return fc;
+
+err_out:
+	free(scratch);
+	if (fc)
+		frame_cache_free(fc);
+	return NULL;
+}
+
+static int frame_cache_path(char *path, size_t size, const char *dir, uint64_t hash,
+			    uint16_t mtu, uint32_t object_size, int fill_mtu)
+{
+	int n;
+
+	n = snprintf(path, size, "%s/%016llx-%u-%u%s.nfc", dir, (unsigned long long)hash,
+		     mtu, object_size, fill_mtu ? "-fill" : "");
+	if (n < 0 || n >= size) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+
+	return 0;
+}
+
+/* Map a cache file, NULL with errno ENOENT if it is missing or does not match */
+static struct frame_cache *frame_cache_load(const struct image *img, const char *path,
+					    uint64_t hash, uint16_t mtu, uint32_t object_size,
+					    int fill_mtu)
+{
+	const struct frame_cache_header *hdr;
+	struct frame_cache *fc;
+	struct stat st;
+	uint32_t i;
+	void *map;
+	int fd;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return NULL;
+
+	if (fstat(fd, &st) || st.st_size < sizeof(*hdr)) {
+		close(fd);
+		errno = ENOENT;
+		return NULL;
+	}
+
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+		return NULL;
+
+	fc = calloc(1, sizeof(*fc));
+	if (!fc) {
+		munmap(map, st.st_size);
+		return NULL;
+	}
+	fc->map = map;
+	fc->map_length = st.st_size;
+
+	hdr = map;
+	if (hdr->magic != FRAME_CACHE_MAGIC || hdr->image_hash != hash ||
+	    hdr->image_size != img->size || hdr->mtu != mtu ||
+	    hdr->object_size != object_size || hdr->fill_mtu != !!fill_mtu ||
+	    hdr->n_objects != (img->size + (uint64_t)object_size - 1) / object_size ||
+	    hdr->n_packets > img->size ||
+	    frame_cache_layout(hdr) + hdr->frames_length != st.st_size)
+		goto invalid;
+
+	if (crc32_compute((const uint8_t *)map + sizeof(*hdr), st.st_size - sizeof(*hdr), 0) != hdr->crc)
+		goto invalid;
+
+	frame_cache_attach(fc, map);
+
+	/* make sure the indices cannot point outside of the file */
+	if (fc->first_packet[fc->n_objects] != fc->n_packets)
+		goto invalid;
+	for (i = 0; i < fc->n_objects; i++)
+		if (fc->first_packet[i] > fc->first_packet[i + 1])
+			goto invalid;
+	for (i = 0; i < fc->n_packets; i++)
+		if (fc->packets[i].frame_end < frame_cache_frame_start(fc, i) ||
+		    fc->packets[i].frame_end > fc->frames_length)
+			goto invalid;
+	if (fc->n_packets && fc->packets[fc->n_packets - 1].crc != image_crc(img, img->size))
+		goto invalid;
+
+	return fc;
+
+invalid:
+	frame_cache_free(fc);
+	errno = ENOENT;
+	return NULL;
+}
+
+/* Write the cache atomically, concurrent writers of the same file are fine */
+static int frame_cache_store(const struct frame_cache *fc, const char *path, const char *dir)
+{
+	char tmp[PATH_MAX];
+	const uint8_t *data = fc->buf;
+	size_t length = fc->frames - data + fc->frames_length;
+	size_t n = 0;
+	int fd, err;
+
+	if (snprintf(tmp, sizeof(tmp), "%s/.nfc-XXXXXX", dir) >= sizeof(tmp)) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+
+	if (mkdir(dir, 0755) && errno != EEXIST)
+		return -1;
+
+	fd = mkstemp(tmp);
+	if (fd < 0)
+		return -1;
+
+	while (n < length) {
+		ssize_t v = write(fd, &data[n], length - n);
+
+		if (v < 0 && errno == EINTR)
+			continue;
+		if (v < 0)
+			goto err_out;
+		n += v;
+	}
+
+	if (fchmod(fd, 0644) || close(fd)) {
+		fd = -1;
+		goto err_out;
+	}
+
+	if (rename(tmp, path)) {
+		fd = -1;
+		goto err_out;
+	}
+
+	return 0;
+
+err_out:
+	err = errno;
+	if (fd >= 0)
+		close(fd);
+	unlink(tmp);
+	errno = err;
+	return -1;
+}
+
+struct frame_cache_list *frame_cache_list_create(void)
+{
+	struct frame_cache_list *list;
+
+	list = calloc(1, sizeof(*list));
+	if (!list)
+		return NULL;
+
+	pthread_mutex_init(&list->lock, NULL);
+	return list;
+}
+
+void frame_cache_list_destroy(struct frame_cache_list *list)
+{
+	struct frame_cache *fc;
+
+	if (!list)
+		return;
+
+	while ((fc = list->head)) {
+		list->head = fc->next;
+		frame_cache_free(fc);
+	}
+
+	pthread_mutex_destroy(&list->lock);
+	free(list);
+}
+
+static int frame_cache_match(const struct frame_cache *fc, uint16_t mtu,
+			     uint32_t object_size, int fill_mtu)
+{
+	return fc->mtu == mtu && fc->object_size == object_size && fc->fill_mtu == !!fill_mtu;
+}
+
+static void frame_cache_hash(struct frame_cache_list *list, const struct image *img)
+{
+	if (!list->hashed) {
+		list->image_hash = image_hash(img);
+		list->hashed = 1;
+	}
+}
+
+/*
+ * Find or create the cache of img for one MTU and object size: in memory,
+ * then in cache_dir if given, otherwise it is built and saved there.
+ * The cache is owned by the image. Returns NULL with errno on failure.
+ */
+const struct frame_cache *frame_cache_get(const struct image *img, uint16_t mtu,
+					  uint32_t object_size, int fill_mtu,
+					  const char *cache_dir)
+{
+	struct frame_cache_list *list;
+	struct frame_cache *fc;
+	char path[PATH_MAX];
+
+	if (!img || !img->caches || !object_size || mtu < DFU_MTU_MIN) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	list = img->caches;
+	pthread_mutex_lock(&list->lock);
+
+	for (fc = list->head; fc; fc = fc->next)
+		if (frame_cache_match(fc, mtu, object_size, fill_mtu))
+			goto out;
+
+	frame_cache_hash(list, img);
+
+	if (cache_dir && frame_cache_path(path, sizeof(path), cache_dir, list->image_hash,
+					  mtu, object_size, fill_mtu))
+		goto out;
+
+	if (cache_dir) {
+		fc = frame_cache_load(img, path, list->image_hash, mtu, object_size, fill_mtu);
+		if (fc)
+			goto add;
+	}
+
+	fc = frame_cache_build(img, list->image_hash, mtu, object_size, fill_mtu);
+	if (!fc)
+		goto out;
+
+	/* a read-only cache directory still leaves a usable in-memory cache */
+	if (cache_dir)
+		frame_cache_store(fc, path, cache_dir);
+
+add:
+	fc->next = list->head;
+	list->head = fc;
+out:
+	pthread_mutex_unlock(&list->lock);
+	return fc;
+}
+
+/* Build the cache of img and save it to cache_dir, replacing an older file */
+int frame_cache_prebuild(const struct image *img, uint16_t mtu, uint32_t object_size,
+			 int fill_mtu, const char *cache_dir)
+{
+	struct frame_cache_list *list;
+	struct frame_cache *fc;
+	char path[PATH_MAX];
+	int ret = -1;
+
+	if (!img || !img->caches || !cache_dir || !object_size || mtu < DFU_MTU_MIN) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	list = img->caches;
+	pthread_mutex_lock(&list->lock);
+
+	frame_cache_hash(list, img);
+
+	if (frame_cache_path(path, sizeof(path), cache_dir, list->image_hash,
+			     mtu, object_size, fill_mtu))
+		goto out;
+
+	fc = frame_cache_build(img, list->image_hash, mtu, object_size, fill_mtu);
+	if (!fc)
+		goto out;
+
+	ret = frame_cache_store(fc, path, cache_dir);
+	frame_cache_free(fc);
+out:
+	pthread_mutex_unlock(&list->lock);
+	return ret;
+}
+
+int nrfu_frame_cache_build(const char *firmware, const char *cache_dir, unsigned int mtu,
+			   unsigned int object_size, int fill_mtu)
+{
+	struct image img;
+	int ret;
+
+	if (!firmware || !cache_dir || mtu > UINT16_MAX) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (image_load_file(&img, firmware) < 0)
+		return -1;
+
+	ret = frame_cache_prebuild(&img, mtu, object_size, fill_mtu, cache_dir);
+
+	image_release(&img);
+	return ret;
+}
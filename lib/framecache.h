@@ -0,0 +1,63 @@
+/* SPDX-License-Identifier: BSD-3-Clause */
+/*
+ * Copyright (C) 2022 Leica Geosystems AG
+ */
+#ifndef FRAMECACHE_H_
+#define FRAMECACHE_H_
+
+struct image;
+
+/* One WRITE_OBJECT frame of the cache */
+struct frame_cache_packet {
+	uint32_t end_offset;	/* image offset after this packet */
+	uint32_t crc;		/* cumulative CRC up to end_offset */
+	uint32_t frame_end;	/* end of the encoded frame in frames[] */
+};
+
+/*
+ * All WRITE_OBJECT frames of an image, SLIP encoded for one MTU, object
+ * size and packing mode. Object k covers packets[first_packet[k]] up to
+ * packets[first_packet[k + 1] - 1]. A cache is immutable once built.
+ */
+struct frame_cache {
+	uint64_t image_hash;
+	uint32_t image_size;
+	uint32_t object_size;
+	uint16_t mtu;
+	uint16_t fill_mtu;
+	uint32_t n_objects;
+	uint32_t n_packets;
+
+	const uint32_t *first_packet;
+	const struct frame_cache_packet *packets;
+	const uint8_t *frames;
+	uint64_t frames_length;
+
+	/* backing storage: a mapped cache file or heap memory */
+	void *map;
+	size_t map_length;
+	void *buf;
+	struct frame_cache *next;
+};
+
+/* in-memory caches of an image, safe to use from several threads */
+struct frame_cache_list;
+
+size_t frame_pack(uint8_t *frame, uint16_t mtu, int fill_mtu, const uint8_t *data,
+		  size_t data_length, size_t *consumed);
+
+struct frame_cache_list *frame_cache_list_create(void);
+void frame_cache_list_destroy(struct frame_cache_list *list);
+
+const struct frame_cache *frame_cache_get(const struct image *img, uint16_t mtu,
+					  uint32_t object_size, int fill_mtu,
+					  const char *cache_dir);
+int frame_cache_prebuild(const struct image *img, uint16_t mtu, uint32_t object_size,
+			 int fill_mtu, const char *cache_dir);
+
+static inline uint32_t frame_cache_frame_start(const struct frame_cache *fc, uint32_t packet)
+{
+	return packet ? fc->packets[packet - 1].frame_end : 0;
+}
+
+#endif /* FRAMECACHE_H_ */
@@ -0,0 +1,280 @@
+// SPDX-License-Identifier: BSD-3-Clause
+/*
+ * Copyright (C) 2022 Leica Geosystems AG
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "image.h"
+#include "toolbox.h"
+
+/* the largest nRF5 flash with room to spare, guards against huge gaps */
+#define IHEX_MAX_SIZE		(16 * 1024 * 1024)
+#define IHEX_GAP_FILL		0xff
+/* length byte, address, type, up to 255 data bytes and the checksum */
+#define IHEX_RECORD_MAX		(255 + 5)
+
+enum ihex_record_type {
+	IHEX_DATA			= 0x00,
+	IHEX_END_OF_FILE		= 0x01,
+	IHEX_EXTENDED_SEGMENT_ADDRESS	= 0x02,
+	IHEX_START_SEGMENT_ADDRESS	= 0x03,
+	IHEX_EXTENDED_LINEAR_ADDRESS	= 0x04,
+	IHEX_START_LINEAR_ADDRESS	= 0x05,
+};
+
+/*
+ * The binary image is built from the lowest address on, gaps are filled
+ * with 0xff like flash after erase. As long as the records come in
+ * ascending order, which is what every toolchain emits, the CRC
+ * checkpoints are computed as soon as a step is complete.
+ */
+struct ihex_image {
+	uint8_t *buf;
+	uint32_t size;
+	uint32_t capacity;
+	uint32_t base;
+	int based;
+	uint32_t *crc_steps;
+	uint32_t n_crc_steps;
+	uint32_t crc;
+	int ordered;
+};
+
+static int hex_nibble(char c)
+{
+	if (c >= '0' && c <= '9')
+		return c - '0';
+	if (c >= 'a' && c <= 'f')
+		return c - 'a' + 10;
+	if (c >= 'A' && c <= 'F')
+		return c - 'A' + 10;
+	return -1;
+}
+
+/*
+ * Decode a record line into rec, which holds IHEX_RECORD_MAX bytes.
+ * Returns the number of bytes or -1.
+ */
+static int ihex_decode_line(const char *line, size_t length, uint8_t *rec)
+{
+	size_t i;
+	uint8_t sum = 0;
+	int n = 0;
+
+	while (length && (line[length - 1] == '\n' || line[length - 1] == '\r'))
+		length--;
+
+	if (length < 11 || length > 1 + 2 * IHEX_RECORD_MAX || line[0] != ':' || !(length & 1))
+		return -1;
+
+	for (i = 1; i < length; i += 2) {
+		int hi = hex_nibble(line[i]);
+		int lo = hex_nibble(line[i + 1]);
+
+		if (hi < 0 || lo < 0)
+			return -1;
+		rec[n] = hi << 4 | lo;
+		sum += rec[n++];
+	}
+
+	/* the checksum is the two's complement of the other bytes */
+	if (sum || n != rec[0] + 5)
+		return -1;
+
+	return n;
+}
+
+static int ihex_reserve(struct ihex_image *ih, uint32_t size)
+{
+	uint32_t capacity = ih->capacity ? ih->capacity : 64 * 1024;
+	uint8_t *buf;
+
+	if (size > IHEX_MAX_SIZE) {
+		errno = EFBIG;
+		return -1;
+	}
+
+	if (size <= ih->capacity)
+		return 0;
+
+	while (capacity < size)
+		capacity *= 2;
+
+	buf = realloc(ih->buf, capacity);
+	if (!buf)
+		return -1;
+
+	ih->buf = buf;
+	ih->capacity = capacity;
+	return 0;
+}
+
+/* Checkpoint every step below offset, which will not change anymore */
+static int ihex_crc_update(struct ihex_image *ih, uint32_t offset)
+{
+	uint32_t n = offset / IMAGE_CRC_STEP;
+	uint32_t *steps;
+
+	if (n <= ih->n_crc_steps)
+		return 0;
+
+	steps = realloc(ih->crc_steps, n * sizeof(*steps));
+	if (!steps)
+		return -1;
+	ih->crc_steps = steps;
+
+	for (; ih->n_crc_steps < n; ih->n_crc_steps++) {
+		ih->crc = crc32_compute(&ih->buf[ih->n_crc_steps * IMAGE_CRC_STEP],
+					IMAGE_CRC_STEP, ih->crc);
+		steps[ih->n_crc_steps] = ih->crc;
+	}
+
+	return 0;
+}
+
+static int ihex_write(struct ihex_image *ih, uint32_t address, const uint8_t *data, uint32_t length)
+{
+	uint32_t offset, end;
+
+	if (!ih->based) {
+		ih->base = address;
+		ih->based = 1;
+	}
+
+	if (address < ih->base) {
+		/* move everything up, the new start is the lowest address */
+		uint32_t shift = ih->base - address;
+
+		if (ihex_reserve(ih, ih->size + shift))
+			return -1;
+		memmove(&ih->buf[shift], ih->buf, ih->size);
+		memset(ih->buf, IHEX_GAP_FILL, shift);
+		ih->size += shift;
+		ih->base = address;
+		ih->ordered = 0;
+	}
+
+	offset = address - ih->base;
+	end = offset + length;
+	if (end < offset || end > IHEX_MAX_SIZE) {
+		errno = EFBIG;
+		return -1;
+	}
+
+	if (offset < ih->size)
+		ih->ordered = 0;
+
+	if (end > ih->size) {
+		if (ihex_reserve(ih, end))
+			return -1;
+		if (offset > ih->size)
+			memset(&ih->buf[ih->size], IHEX_GAP_FILL, offset - ih->size);
+		ih->size = end;
+	}
+	memcpy(&ih->buf[offset], data, length);
+
+	return ih->ordered ? ihex_crc_update(ih, offset) : 0;
+}
+
+/*
+ * Convert an Intel HEX file into the contiguous binary image in a single
+ * pass over the file. Errors are reported through errno, EBADMSG for
+ * malformed records.
+ */
+int image_load_hex(struct image *img, const char *path)
+{
+	struct ihex_image ih = { .ordered = 1 };
+	uint32_t upper = 0, address;
+	uint8_t rec[IHEX_RECORD_MAX];
+	char *line = NULL;
+	size_t line_size = 0;
+	ssize_t length;
+	int n, eof = 0, err;
+	FILE *f;
+
+	memset(img, 0, sizeof(*img));
+
+	f = fopen(path, "r");
+	if (!f)
+		return -1;
+
+	while (!eof && (length = getline(&line, &line_size, f)) >= 0) {
+		if (length == 0 || line[0] == '\n' || line[0] == '\r')
+			continue;
+
+		n = ihex_decode_line(line, length, rec);
+		if (n < 0) {
+			errno = EBADMSG;
+			goto err_out;
+		}
+
+		address = upper + (rec[1] << 8 | rec[2]);
+
+		switch (rec[3]) {
+		case IHEX_DATA:
+			if (ihex_write(&ih, address, &rec[4], rec[0]))
+				goto err_out;
+			break;
+		case IHEX_END_OF_FILE:
+			eof = 1;
+			break;
+		case IHEX_EXTENDED_SEGMENT_ADDRESS:
+			if (rec[0] != 2) {
+				errno = EBADMSG;
+				goto err_out;
+			}
+			upper = (rec[4] << 8 | rec[5]) << 4;
+			break;
+		case IHEX_EXTENDED_LINEAR_ADDRESS:
+			if (rec[0] != 2) {
+				errno = EBADMSG;
+				goto err_out;
+			}
+			upper = (uint32_t)(rec[4] << 8 | rec[5]) << 16;
+			break;
+		case IHEX_START_SEGMENT_ADDRESS:
+		case IHEX_START_LINEAR_ADDRESS:
+			break;
+		default:
+			errno = EBADMSG;
+			goto err_out;
+		}
+	}
+
+	if (!eof) {
+		if (!ferror(f))
+			errno = EBADMSG;
+		goto err_out;
+	}
+
+	free(line);
+	fclose(f);
+
+	/* records out of order leave the checkpoints to image_from_buffer() */
+	if (ih.ordered) {
+		if (ihex_crc_update(&ih, ih.size)) {
+			free(ih.buf);
+			free(ih.crc_steps);
+			return -1;
+		}
+	} else {
+		free(ih.crc_steps);
+		ih.crc_steps = NULL;
+	}
+
+	return image_from_buffer(img, path, ih.buf, ih.size, ih.crc_steps);
+
+err_out:
+	err = errno;
+	free(line);
+	fclose(f);
+	free(ih.buf);
+	free(ih.crc_steps);
+	errno = err;
+	return -1;
+}
@@ -0,0 +1,210 @@
+// SPDX-License-Identifier: BSD-3-Clause
+/*
+ * Copyright (C) 2022 Leica Geosystems AG
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "framecache.h"
+#include "image.h"
+#include "toolbox.h"
+
+/* crc_steps may hold checkpoints the loader already computed */
+static int image_index(struct image *img, uint32_t *crc_steps)
+{
+	uint32_t i, crc = 0;
+
+	img->n_crc_steps = img->size / IMAGE_CRC_STEP;
+	img->crc_steps = crc_steps;
+
+	img->caches = frame_cache_list_create();
+	if (!img->caches)
+		return -1;
+
+	if (!img->n_crc_steps || crc_steps)
+		return 0;
+
+	img->crc_steps = malloc(img->n_crc_steps * sizeof(*img->crc_steps));
+	if (!img->crc_steps)
+		return -1;
+
+	for (i = 0; i < img->n_crc_steps; i++) {
+		crc = crc32_compute(&img->data[i * IMAGE_CRC_STEP], IMAGE_CRC_STEP, crc);
+		img->crc_steps[i] = crc;
+	}
+
+	return 0;
+}
+
+static int image_read_fd(struct image *img, int fd, size_t size)
+{
+	uint8_t *buf;
+	size_t n = 0;
+
+	buf = malloc(size ? size : 1);
+	if (!buf)
+		return -1;
+
+	while (n < size) {
+		ssize_t v = read(fd, &buf[n], size - n);
+
+		if (v < 0 && errno == EINTR)
+			continue;
+		if (v <= 0) {
+			int err = v ? errno : EIO;
+
+			free(buf);
+			errno = err;
+			return -1;
+		}
+		n += v;
+	}
+
+	img->buf = buf;
+	img->data = buf;
+	return 0;
+}
+
+static int image_is_hex(const char *path)
+{
+	size_t n = strlen(path);
+
+	return n > 4 && !strcasecmp(&path[n - 4], ".hex");
+}
+
+/*
+ * Map the file read-only, falling back to reading it into memory where
+ * that is not possible. Intel HEX files (*.hex) are converted to the
+ * binary image. Errors are reported through errno.
+ */
+int image_load_file(struct image *img, const char *path)
+{
+	struct stat st;
+	void *map;
+	int fd, err;
+
+	if (image_is_hex(path))
+		return image_load_hex(img, path);
+
+	memset(img, 0, sizeof(*img));
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return -1;
+
+	if (fstat(fd, &st))
+		goto err_out;
+
+	if (st.st_size > UINT32_MAX) {
+		errno = EFBIG;
+		goto err_out;
+	}
+
+	map = st.st_size ? mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+	if (map != MAP_FAILED) {
+		madvise(map, st.st_size, MADV_SEQUENTIAL);
+		img->map = map;
+		img->map_length = st.st_size;
+		img->data = map;
+	} else if (image_read_fd(img, fd, st.st_size)) {
+		goto err_out;
+	}
+	img->size = st.st_size;
+	close(fd);
+
+	img->name = strdup(path);
+	if (!img->name || image_index(img, NULL)) {
+		image_release(img);
+		return -1;
+	}
+
+	return 0;
+
+err_out:
+	err = errno;
+	close(fd);
+	errno = err;
+	return -1;
+}
+
+static int image_attach(struct image *img, const char *name, const void *data, size_t size,
+			uint32_t *crc_steps)
+{
+	memset(img, 0, sizeof(*img));
+
+	if (!data || size > UINT32_MAX) {
+		free(crc_steps);
+		errno = EINVAL;
+		return -1;
+	}
+
+	img->data = data;
+	img->size = size;
+
+	img->name = strdup(name);
+	if (!img->name || image_index(img, crc_steps)) {
+		if (!img->crc_steps)
+			free(crc_steps);
+		image_release(img);
+		return -1;
+	}
+
+	return 0;
+}
+
+/* Use a buffer owned by the caller, which has to outlive the image */
+int image_from_memory(struct image *img, const char *name, const void *data, size_t size)
+{
+	return image_attach(img, name, data, size, NULL);
+}
+
+/*
+ * Take over a malloc()ed buffer and, if the loader computed them on the
+ * way, the CRC checkpoints. Both are freed on failure.
+ */
+int image_from_buffer(struct image *img, const char *name, void *buf, size_t size,
+		      uint32_t *crc_steps)
+{
+	if (image_attach(img, name, buf, size, crc_steps)) {
+		free(buf);
+		return -1;
+	}
+
+	img->buf = buf;
+	return 0;
+}
+
+void image_release(struct image *img)
+{
+	free(img->name);
+	free(img->crc_steps);
+	frame_cache_list_destroy(img->caches);
+	if (img->map)
+		munmap(img->map, img->map_length);
+	free(img->buf);
+	memset(img, 0, sizeof(*img));
+}
+
+/* CRC of the first length bytes, continued from the closest checkpoint */
+uint32_t image_crc(const struct image *img, uint32_t length)
+{
+	uint32_t step = length / IMAGE_CRC_STEP;
+	uint32_t crc = 0;
+
+	if (step > img->n_crc_steps)
+		step = img->n_crc_steps;
+
+	if (step)
+		crc = img->crc_steps[step - 1];
+
+	return crc32_compute(&img->data[step * IMAGE_CRC_STEP],
+			     length - step * IMAGE_CRC_STEP, crc);
+}
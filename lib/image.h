@@ -0,0 +1,42 @@
+/* SPDX-License-Identifier: BSD-3-Clause */
+/*
+ * Copyright (C) 2022 Leica Geosystems AG
+ */
+#ifndef IMAGE_H_
+#define IMAGE_H_
+
+/* distance of the precomputed CRC checkpoints, the nRF5 flash page size */
+#define IMAGE_CRC_STEP		4096
+
+struct frame_cache_list;
+
+/*
+ * A firmware or init packet image held in memory: a mapped file, a copy of
+ * a file that cannot be mapped, or a buffer owned by the caller. Once loaded
+ * an image is never modified, so it can be shared by any number of sessions
+ * and threads.
+ */
+struct image {
+	char *name;
+	const uint8_t *data;
+	uint32_t size;
+	/* crc_steps[i] is the CRC of the first (i + 1) * IMAGE_CRC_STEP bytes */
+	uint32_t *crc_steps;
+	uint32_t n_crc_steps;
+	/* backing storage owned by the image, if any */
+	void *map;
+	size_t map_length;
+	void *buf;
+	/* pre-encoded data frames, built on demand, see framecache.h */
+	struct frame_cache_list *caches;
+};
+
+int image_load_file(struct image *img, const char *path);
+int image_from_memory(struct image *img, const char *name, const void *data, size_t size);
+int image_from_buffer(struct image *img, const char *name, void *buf, size_t size,
+		      uint32_t *crc_steps);
+int image_load_hex(struct image *img, const char *path);
+void image_release(struct image *img);
+uint32_t image_crc(const struct image *img, uint32_t length);
+
+#endif /* IMAGE_H_ */
@@ -5,30 +5,60 @@
 
 #include <stdio.h>
 #include <stdint.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <poll.h>
 #include <unistd.h>
 #include <nrfu.h>
 
+#include "context.h"
+#include "dfu.h"
+#include "framecache.h"
+#include "image.h"
+#include "package.h"
+#include "replay.h"
+#include "rtt.h"
 #include "serial.h"
+#include "slip.h"
 #include "toolbox.h"
+#include "trace.h"
+#include "transport.h"
 
-#define SLIP_BYTE_END		0xC0	/* indicates end of packet */
-#define SLIP_BYTE_ESC		0xDB	/* indicates byte stuffing */
-#define SLIP_BYTE_ESC_END	0xDC	/* ESC ESC_END means END data byte */
-#define SLIP_BYTE_ESC_ESC	0xDD	/* ESC ESC_ESC means ESC data byte */
+/* messages above NRFU_LOG_LEVEL_MAX are compiled out */
+#ifndef NRFU_LOG_LEVEL_MAX
+#define NRFU_LOG_LEVEL_MAX	NRFU_LOG_LEVEL_DEBUG
+#endif
 
-int error_level = NRFU_LOG_LEVEL_ERROR;
+#define dfu_log_enabled(p, level) \
+	(NRFU_LOG_LEVEL_MAX >= (level) && (p)->opts.log_level >= (level))
 
-#define dfu_log(level, fmt, arg...) \
+#define dfu_log(p, level, fmt, arg...) \
 	do { \
-		if (error_level >= (level)) \
-			fprintf(stderr, fmt, ## arg); \
+		if (dfu_log_enabled(p, level)) \
+			nrfu_log(p, level, fmt, ## arg); \
 	} while (0)
 
-struct nrfu_data_t {
-	int serial_fd;
-	uint16_t mtu;
-	uint16_t receipt_notify_n;
-};
+/* control messages and responses; data packets are sized from the MTU */
+#define DFU_MSG_SIZE		128
+/* unit of the flash allowance of object requests, see nrfu_options */
+#define DFU_FLASH_PAGE_SIZE	4096
+/* longest control message on the wire, and the line time of more data if unknown */
+#define DFU_CONTROL_BYTES	(SLIP_ENCODED_MAX(DFU_MSG_SIZE) + 1)
+#define DFU_LINE_UNKNOWN	UINT64_MAX
+/* doublings of the retry delay, see object_failed() */
+#define DFU_RETRY_BACKOFF_MAX	5
+/* how long a device may take to restart into the bootloader between images */
+#define DFU_RECONNECT_TIMEOUT_MS	20000
+#define DFU_RECONNECT_INTERVAL_MS	500
+/* longest wait for a network connect to complete */
+#define DFU_CONNECT_TIMEOUT_MS	5000
+/* how often input of a transport without a descriptor is polled for */
+#define DFU_POLL_INTERVAL_MS	1
+/* data written by one nrfu_ctx_process() before it lets other work run */
+#define DFU_TURN_BYTES		(64 * 1024)
 
 struct object_select_response_t {
 	uint32_t max_size;
@@ -48,547 +78,2341 @@ struct dfu_msg_t {
 			uint8_t op_code;
 			uint8_t payload[];
 		} command;
-		uint8_t data[128];
+		uint8_t data[DFU_MSG_SIZE];
 	};
 	size_t payload_length;
 };
 
-enum dfu_opcode {
-	DFU_OPCODE_OBJECT_CREATE	= 0x01,
-	DFU_OPCODE_SET_PRN		= 0x02,
-	DFU_OPCODE_GET_CRC		= 0x03,
-	DFU_OPCODE_SET_EXECUTE		= 0x04,
-	DFU_OPCODE_OBJECT_SELECT	= 0x06,
-	DFU_OPCODE_GET_MTU		= 0x07,
-	DFU_OPCODE_WRITE_OBJECT		= 0x08,
-	DFU_OPCODE_PING			= 0x09,
-	DFU_OPCODE_RESPONSE		= 0x60,
+/*
+ * Receipt notifications the bootloader still owes us. Up to PRN_WINDOW of
+ * them may be outstanding, i.e. the host keeps streaming while the
+ * notification for the previous receipt_notify_n packets is on its way.
+ * One more slot holds the interval just sent while waiting for the oldest.
+ */
+#define PRN_WINDOW		2
+#define PRN_SLOTS		(PRN_WINDOW + 1)
+
+struct prn_window {
+	struct {
+		uint32_t offset;
+		uint32_t crc;
+		/* when the interval was sent and the wire bytes up to its end */
+		uint64_t sent_ns;
+		uint64_t line_ns;
+		unsigned long tx_bytes;
+	} expected[PRN_SLOTS];
+	int head;
+	int pending;
 };
 
-enum dfu_rescode {
-	DFU_RESCODE_SUCCESS		= 0x01,
+/*
+ * A session is driven by nrfu_ctx_process() as a chain of steps: each one
+ * sends a request and names the step that handles its response, streams
+ * data or sets a timer, and returns without waiting. -1 fails the step.
+ */
+typedef int (*dfu_step_fn)(struct nrfu_ctx *p);
+typedef int (*dfu_response_fn)(struct nrfu_ctx *p, struct dfu_msg_t *msg);
+
+/* Data being streamed, from an image or from a frame cache */
+struct dfu_stream {
+	int active;
+	const struct image *img;
+	const struct frame_cache *fc;
+	uint32_t packet, last;		/* frame cache packets still to send */
+	uint32_t offset, end;
+	uint32_t crc;
+	uint32_t packets;		/* sent since the stream started */
+	struct prn_window prn;
+	dfu_step_fn done;		/* step after the verified stream */
 };
 
-enum dfu_object_type {
-	DFU_OBJECT_TYPE_COMMAND		= 0x01,
-	DFU_OBJECT_TYPE_DATA		= 0x02,
+/* Images a session sends, in this order, and where they come from */
+struct dfu_job_image {
+	const char *type;
+	const struct image *init_packet;
+	const struct image *firmware;
 };
 
-static int slip_sendc(struct nrfu_data_t *p, uint8_t c)
-{
-	uint8_t to_send[2];
-	size_t length = 0;
+struct dfu_job {
+	char *devname;
+	unsigned int n_images;
+	unsigned int current;
+	struct dfu_job_image images[PACKAGE_MAX_IMAGES];
+	/* loaded by nrfu_ctx_start*() and released with the session */
+	struct package pkg;
+	struct image init_packet;
+	struct image firmware;
+	int owns_images;
+};
 
-	switch (c) {
-	case SLIP_BYTE_END:
-		to_send[length++] = SLIP_BYTE_ESC;
-		to_send[length++] = SLIP_BYTE_ESC_END;
-		break;
+enum dfu_engine_state {
+	DFU_ENGINE_IDLE,
+	DFU_ENGINE_RUNNING,
+	DFU_ENGINE_DONE,
+	DFU_ENGINE_FAILED,
+};
 
-	case SLIP_BYTE_ESC:
-		to_send[length++] = SLIP_BYTE_ESC;
-		to_send[length++] = SLIP_BYTE_ESC_ESC;
-		break;
+struct nrfu_ctx {
+	struct nrfu_options opts;
+	nrfu_log_fn log_fn;
+	void *log_data;
+	nrfu_progress_fn progress_fn;
+	void *progress_data;
+	const struct nrfu_transport_ops *transport_ops;
+	void *transport_data;
+
+	/*
+	 * Buffers are allocated with the context and reused by every request
+	 * of every session; tx_buf only grows if a bootloader's MTU exceeds it.
+	 */
+	struct dfu_msg_t msg;
+	uint8_t rx_frame[DFU_MSG_SIZE];
+	uint8_t *tx_buf;
+	size_t tx_buf_size;
+
+	/* session state, valid from nrfu_ctx_start*() until the session ends */
+	struct dfu_job job;
+	enum dfu_engine_state state;
+	struct transport link;
+	struct capture *capture;
+	struct replay *replay;
+	struct serial_rx_ring rx;
+	struct slip_decoder rx_dec;
+	uint16_t mtu;
+	uint16_t receipt_notify_n;
 
-	default:
-		to_send[length++] = c;
+	/* what the engine waits for, see engine_run() */
+	const uint8_t *tx_data;		/* unwritten rest of the last frame */
+	size_t tx_left;
+	dfu_response_fn on_response;
+	enum dfu_opcode response_opcode;
+	dfu_step_fn on_timer;
+	dfu_step_fn on_connect;
+	uint64_t deadline;		/* of the response, notification or timer */
+	int timed_out;			/* the link reported the deadline as passed */
+	int events;
+	int yield;
+	int in_engine;			/* handlers called from here may not end the session */
+	int cancel_pending;
+	unsigned long turn_tx_bytes;
+
+	/* the request awaiting its response, for its round trip time */
+	enum nrfu_rtt_kind request_kind;
+	uint64_t request_ns;
+	uint64_t request_line_ns;
+	unsigned long request_tx_bytes;
+	/* wire bytes the bootloader is known to have received */
+	unsigned long acked_tx_bytes;
+	/* type and size of the object selected or created last */
+	enum dfu_object_type object_type;
+	uint32_t object_bytes;
+	int execute_validates;		/* the data execute completes the image */
+	struct nrfu_rtt_stats rtt[NRFU_RTT_COUNT];
+
+	/* step to continue with instead of failing, see dfu_on_error() */
+	dfu_step_fn on_error;
+	unsigned int error_phases;
+
+	dfu_step_fn execute_next;
+	struct dfu_stream stream;
+
+	/* firmware objects */
+	uint32_t fw_object_size;
+	uint32_t fw_offset;		/* of the next object to send */
+	uint32_t fw_crc;		/* of the image up to fw_offset */
+	const struct frame_cache *fw_cache;
+	unsigned int reconnect_waited;
+
+	/* retries of a failed data object, see object_failed() */
+	unsigned int retry_object;
+	unsigned int object_retries;
+	uint64_t retry_deadline;
+	uint8_t ping_id;
+	int resyncing;			/* drop frames until the ping is answered */
+	int tx_break;			/* end a partial frame before the next message */
+
+	/* progress of the session, the counters are kept up to date in any case */
+	struct nrfu_progress progress;
+	enum nrfu_phase data_phase;
+	uint64_t phase_start[NRFU_PHASE_COUNT];
+	unsigned int open_phases;	/* bit per phase that began but did not end */
+	uint64_t last_update;
+
+	/* frames of the last session, if tracing is enabled */
+	struct trace_ring trace;
+	int tracing;
+};
+
+__attribute__((format(printf, 3, 4)))
+static void nrfu_log(struct nrfu_ctx *p, enum nrfu_log_level level, const char *fmt, ...)
+{
+	char msg[256];
+	va_list ap;
+
+	va_start(ap, fmt);
+	if (p->log_fn) {
+		vsnprintf(msg, sizeof(msg), fmt, ap);
+		p->log_fn(level, msg, p->log_data);
+	} else {
+		vfprintf(stderr, fmt, ap);
 	}
-	return serial_send(p->serial_fd, to_send, length);
+	va_end(ap);
 }
 
-static int dfu_send_msg(struct nrfu_data_t *p, struct dfu_msg_t *msg)
+static const char *phase_names[NRFU_PHASE_COUNT] = {
+	[NRFU_PHASE_CONNECT] = "connect",
+	[NRFU_PHASE_PING] = "ping",
+	[NRFU_PHASE_PRN] = "prn",
+	[NRFU_PHASE_MTU] = "mtu",
+	[NRFU_PHASE_INIT_PACKET] = "init-packet",
+	[NRFU_PHASE_FIRMWARE] = "firmware",
+	[NRFU_PHASE_OBJECT] = "object",
+	[NRFU_PHASE_EXECUTE] = "execute",
+};
+
+const char *nrfu_phase_name(enum nrfu_phase phase)
 {
-	int ret;
-	uint8_t *data;
-	uint8_t end_byte = SLIP_BYTE_END;
-	int i = 2;
+	if (phase < 0 || phase >= NRFU_PHASE_COUNT)
+		return "unknown";
 
-	if (!p || !msg)
-		return -1;
+	return phase_names[phase];
+}
 
-	dfu_log(NRFU_LOG_LEVEL_DEBUG, "--> ");
-	dfu_log(NRFU_LOG_LEVEL_DEBUG, "0x%02x ", msg->command.op_code);
+static const char *rtt_names[NRFU_RTT_COUNT] = {
+	[NRFU_RTT_PING] = "ping",
+	[NRFU_RTT_SET_PRN] = "set-prn",
+	[NRFU_RTT_GET_MTU] = "get-mtu",
+	[NRFU_RTT_COMMAND_SELECT] = "command-select",
+	[NRFU_RTT_COMMAND_CREATE] = "command-create",
+	[NRFU_RTT_COMMAND_EXECUTE] = "command-execute",
+	[NRFU_RTT_DATA_SELECT] = "data-select",
+	[NRFU_RTT_DATA_CREATE] = "data-create",
+	[NRFU_RTT_DATA_EXECUTE] = "data-execute",
+	[NRFU_RTT_GET_CRC] = "get-crc",
+	[NRFU_RTT_RECEIPT] = "receipt",
+};
 
-	ret = slip_sendc(p, msg->command.op_code);
-	if (ret < 0) {
-		dfu_log(NRFU_LOG_LEVEL_ERROR, "Failed to send \"0x%02x\"\n", msg->command.op_code);
-		return ret;
-	}
+const char *nrfu_rtt_name(enum nrfu_rtt_kind kind)
+{
+	if (kind < 0 || kind >= NRFU_RTT_COUNT)
+		return "unknown";
 
-	for (data = msg->command.payload; data < &msg->command.payload[msg->payload_length]; data++) {
-		dfu_log(NRFU_LOG_LEVEL_DEBUG, "0x%02x ", *data);
-		if (i > 0 && !(i % 16))
-			dfu_log(NRFU_LOG_LEVEL_DEBUG, "\n");
-		i++;
+	return rtt_names[kind];
+}
 
-		ret = slip_sendc(p, *data);
-		if (ret < 0) {
-			dfu_log(NRFU_LOG_LEVEL_ERROR, "\n");
-			dfu_log(NRFU_LOG_LEVEL_ERROR, "Failed to send \"0x%02x\"\n", *data);
-			break;
-		}
-	}
+static void progress_emit(struct nrfu_ctx *p, enum nrfu_progress_event event,
+			  enum nrfu_phase phase, uint64_t now)
+{
+	p->progress.event = event;
+	p->progress.phase = phase;
+	p->progress.timestamp_ns = now;
+	p->progress_fn(&p->progress, p->progress_data);
+}
+
+static void phase_begin(struct nrfu_ctx *p, enum nrfu_phase phase)
+{
+	uint64_t now;
+
+	p->open_phases |= 1U << phase;
+	if (!p->progress_fn)
+		return;
 
-	if (ret < 0)
-		return ret;
-	dfu_log(NRFU_LOG_LEVEL_DEBUG, "\n");
-	return serial_send(p->serial_fd, &end_byte, 1);
+	now = monotonic_ns();
+	p->phase_start[phase] = now;
+	p->progress.status = 0;
+	p->progress.elapsed_ns = 0;
+	progress_emit(p, NRFU_PROGRESS_BEGIN, phase, now);
 }
 
-static int dfu_get_response(struct nrfu_data_t *p, enum dfu_opcode opcode, struct dfu_msg_t *msg)
+/* Report the end of a phase, passes status through */
+static int phase_end(struct nrfu_ctx *p, enum nrfu_phase phase, int status)
 {
-	size_t resp_length;
-	int i;
+	uint64_t now;
 
-	if (!p || !msg)
-		return -1;
+	p->open_phases &= ~(1U << phase);
+	if (!p->progress_fn)
+		return status;
 
-	msg->payload_length = 0;
-	resp_length = serial_receive(p->serial_fd, msg->data, sizeof(msg->data), SLIP_BYTE_END);
+	now = monotonic_ns();
+	p->progress.status = status < 0 ? -1 : 0;
+	p->progress.elapsed_ns = now - p->phase_start[phase];
+	progress_emit(p, NRFU_PROGRESS_END, phase, now);
+	p->progress.elapsed_ns = 0;
 
-	dfu_log(NRFU_LOG_LEVEL_DEBUG, "<-- ");
-	for (i = 0; i < resp_length; i++) {
-		dfu_log(NRFU_LOG_LEVEL_DEBUG, "0x%02x ", msg->data[i]);
-		if (i > 0 && !(i % 16))
-			dfu_log(NRFU_LOG_LEVEL_DEBUG, "\n");
-	}
-	dfu_log(NRFU_LOG_LEVEL_DEBUG, "\n");
+	return status;
+}
 
-	if (resp_length < 3) {
-		dfu_log(NRFU_LOG_LEVEL_ERROR, "Response too short: %zu\n", resp_length);
-		return -1;
-	}
+/* Report data progress, rate limited to NRFU_PROGRESS_INTERVAL_MS */
+static void progress_update(struct nrfu_ctx *p)
+{
+	uint64_t now;
 
-	if (msg->response.op_code != DFU_OPCODE_RESPONSE) {
-		dfu_log(NRFU_LOG_LEVEL_ERROR, "No response: 0x%02x\n", msg->response.op_code);
-		return -1;
-	}
+	if (!p->progress_fn)
+		return;
 
-	if (msg->response.resp_op_code != opcode) {
-		dfu_log(NRFU_LOG_LEVEL_ERROR, "Unexpected OP_CODE: 0x%02x (expected 0x%02x)\n", msg->response.resp_op_code, opcode);
-		return -1;
-	}
+	now = monotonic_ns();
+	if (now - p->last_update < NRFU_PROGRESS_INTERVAL_MS * 1000000ULL)
+		return;
 
-	if (msg->response.res_code == DFU_RESCODE_SUCCESS) {
-		msg->payload_length = resp_length - 3;
-		return 0;
-	}
+	p->last_update = now;
+	p->progress.status = 0;
+	progress_emit(p, NRFU_PROGRESS_UPDATE, p->data_phase, now);
+}
 
-	dfu_log(NRFU_LOG_LEVEL_ERROR, "Response Error! Received:\n");
-	for (i = 0; i < resp_length - 2; i++)
-		dfu_log(NRFU_LOG_LEVEL_ERROR, "0x%02x ", msg->data[i]);
-	dfu_log(NRFU_LOG_LEVEL_ERROR, "\n");
-	return -1;
+static void progress_image(struct nrfu_ctx *p, enum nrfu_phase phase, const struct image *img)
+{
+	p->data_phase = phase;
+	p->progress.image = img->name;
+	p->progress.image_size = img->size;
+	p->progress.image_bytes = 0;
+	p->progress.object = 0;
+	p->progress.n_objects = 1;
 }
 
-static int send_ping(struct nrfu_data_t *p)
+/* One message per 16 bytes, the log function may be expensive */
+static void dfu_log_hex(struct nrfu_ctx *p, const char *prefix, const uint8_t *data, size_t length)
 {
-	struct dfu_msg_t msg;
+	char line[16 * 5 + 1];
+	size_t i, n = 0;
+
+	for (i = 0; i < length; i++) {
+		n += snprintf(&line[n], sizeof(line) - n, "0x%02x ", data[i]);
+		if (!((i + 1) % 16) || i + 1 == length) {
+			dfu_log(p, NRFU_LOG_LEVEL_DEBUG, "%s%s\n", i < 16 ? prefix : "    ", line);
+			n = 0;
+		}
+	}
+}
 
-	msg.command.op_code = DFU_OPCODE_PING;
-	msg.payload_length = 0;
-	msg.command.payload[msg.payload_length++] = 0x01;
+static int engine_waits_for_input(const struct nrfu_ctx *p);
+static int engine_finish(struct nrfu_ctx *p, int result);
+static void engine_set_timer(struct nrfu_ctx *p, dfu_step_fn fn, unsigned int ms);
 
-	dfu_log(NRFU_LOG_LEVEL_INFO, "Sending ping...\n");
-	if (dfu_send_msg(p, &msg) < 0) {
-		dfu_log(NRFU_LOG_LEVEL_ERROR, "Failed to send ping!\n");
-		return -1;
-	}
+/* Write what the link takes of the pending frame without blocking */
+static int dfu_flush(struct nrfu_ctx *p)
+{
+	while (p->tx_left) {
+		ssize_t v = p->link.ops->send(&p->link, p->tx_data, p->tx_left);
 
-	if (dfu_get_response(p, DFU_OPCODE_PING, &msg) < 0) {
-		dfu_log(NRFU_LOG_LEVEL_ERROR, "Failed to receive ping!\n");
-		return -1;
+		if (v < 0) {
+			dfu_log(p, NRFU_LOG_LEVEL_ERROR, "Failed to write: %s\n", strerror(errno));
+			return -1;
+		}
+		if (v == 0)
+			return 1;
+
+		p->tx_data += v;
+		p->tx_left -= v;
 	}
 
-	dfu_log(NRFU_LOG_LEVEL_INFO, "[OK]\n");
 	return 0;
 }
 
-static int set_receipt_notify(struct nrfu_data_t *p)
+/*
+ * Queue a frame and write as much of it as the link takes, the engine
+ * writes the rest before anything else is sent. The frame must stay valid
+ * until then, so a new one may only be built once tx_left is 0.
+ */
+static int dfu_send_frame(struct nrfu_ctx *p, const uint8_t *frame, size_t frame_length)
 {
-	struct dfu_msg_t msg;
-
-	msg.command.op_code = DFU_OPCODE_SET_PRN;
-	msg.payload_length = 0;
-	msg.payload_length += uint16_encode(p->receipt_notify_n, &msg.command.payload[msg.payload_length]);
-
-	dfu_log(NRFU_LOG_LEVEL_INFO, "Setting receipt notify to %u...\n", p->receipt_notify_n);
-	if (dfu_send_msg(p, &msg) < 0) {
-		dfu_log(NRFU_LOG_LEVEL_ERROR, "Failed to set receipt notify to %u!\n", p->receipt_notify_n);
+	if (p->tx_left) {
+		dfu_log(p, NRFU_LOG_LEVEL_ERROR, "Message 0x%02x sent while busy\n", frame[0]);
 		return -1;
 	}
 
-	if (dfu_get_response(p, DFU_OPCODE_SET_PRN, &msg) < 0) {
-		dfu_log(NRFU_LOG_LEVEL_ERROR, "Failed to receive response for receipt notify!\n");
-		return -1;
-	}
+	p->progress.wire_tx_bytes += frame_length;
 
-	dfu_log(NRFU_LOG_LEVEL_INFO, "[OK]\n");
-	return 0;
+	if (p->capture)
+		capture_add(p->capture, CAPTURE_TX, frame, frame_length);
+
+	if (p->tracing)
+		trace_add(&p->trace, monotonic_ns(), NRFU_TRACE_TX, frame, frame_length);
+
+	p->tx_data = frame;
+	p->tx_left = frame_length;
+
+	return dfu_flush(p) < 0 ? -1 : 0;
 }
 
-static int get_mtu(struct nrfu_data_t *p)
+static int dfu_send_msg(struct nrfu_ctx *p, struct dfu_msg_t *msg)
 {
-	struct dfu_msg_t msg;
+	size_t frame_length;
 
-	if (!p)
+	if (!p || !msg)
 		return -1;
 
-	msg.command.op_code = DFU_OPCODE_GET_MTU;
-	msg.payload_length = 0;
-
-	dfu_log(NRFU_LOG_LEVEL_INFO, "Getting MTU...\n");
-	if (dfu_send_msg(p, &msg) < 0) {
-		dfu_log(NRFU_LOG_LEVEL_ERROR, "Failed to send command GET_MTU!\n");
+	if (msg->payload_length > sizeof(msg->data) - 1)
 		return -1;
-	}
 
-	if (dfu_get_response(p, DFU_OPCODE_GET_MTU, &msg) < 0) {
-		dfu_log(NRFU_LOG_LEVEL_ERROR, "Failed to receive MTU!\n");
-		return -1;
+	if (dfu_log_enabled(p, NRFU_LOG_LEVEL_DEBUG))
+		dfu_log_hex(p, "--> ", msg->data, msg->payload_length + 1);
+
+	frame_length = 0;
+	if (p->tx_break) {
+		p->tx_buf[frame_length++] = SLIP_BYTE_END;
+		p->tx_break = 0;
 	}
 
-	if (msg.payload_length < sizeof(p->mtu)) {
-		dfu_log(NRFU_LOG_LEVEL_ERROR, "Response too short for MTU!\n");
-		dfu_log(NRFU_LOG_LEVEL_ERROR, "Received: %lu Expected: %lu!\n", msg.payload_length, sizeof(p->mtu));
+	frame_length += slip_encode(&p->tx_buf[frame_length], msg->data, msg->payload_length + 1);
+	p->tx_buf[frame_length++] = SLIP_BYTE_END;
+
+	return dfu_send_frame(p, p->tx_buf, frame_length);
+}
+
+/*
+ * Read what the link has buffered into the receive ring, waiting up to
+ * timeout_ms for it. Returns the number of bytes read or -1 on error.
+ */
+static int dfu_read(struct nrfu_ctx *p, int timeout_ms)
+{
+	int ret;
+
+	ret = p->link.ops->receive(&p->link, &p->rx, timeout_ms);
+	if (ret < 0 && errno == ETIMEDOUT && timeout_ms) {
+		p->timed_out = 1;
+		return 0;
+	}
+	if (ret < 0) {
+		dfu_log(p, NRFU_LOG_LEVEL_ERROR, "Failed to read: %s\n", strerror(errno));
 		return -1;
 	}
+	p->progress.wire_rx_bytes += ret;
+
+	if (ret && p->capture)
+		capture_add_ring(p->capture, &p->rx, ret);
+
+	return ret;
+}
+
+/*
+ * Decode the next SLIP frame from the receive ring into buf. A partially
+ * received frame is kept in the decoder and bytes received after the END
+ * byte stay in the ring. Returns 1 if a frame was complete, 0 otherwise.
+ */
+static int dfu_decode_frame(struct nrfu_ctx *p, uint8_t *buf, size_t size, size_t *length)
+{
+	const uint8_t *data;
+	size_t data_length, consumed;
+	enum slip_decode_status status;
+
+	while (p->rx.count) {
+		serial_ring_peek(&p->rx, &data, &data_length);
+		status = slip_decode(&p->rx_dec, data, data_length, &consumed);
+		serial_ring_consume(&p->rx, consumed);
+
+		if (status == SLIP_DECODE_FRAME) {
+			if (p->tracing)
+				trace_add(&p->trace, monotonic_ns(), NRFU_TRACE_RX,
+					  p->rx_frame, p->rx_dec.length);
+			*length = p->rx_dec.length < size ? p->rx_dec.length : size;
+			memcpy(buf, p->rx_frame, *length);
+			slip_decoder_init(&p->rx_dec, p->rx_frame, sizeof(p->rx_frame));
+			return 1;
+		}
 
-	p->mtu = uint16_decode(msg.response.payload);
+		if (status == SLIP_DECODE_ERROR) {
+			dfu_log(p, NRFU_LOG_LEVEL_ERROR, "Dropping malformed frame\n");
+			slip_decoder_init(&p->rx_dec, p->rx_frame, sizeof(p->rx_frame));
+		}
+	}
 
-	dfu_log(NRFU_LOG_LEVEL_INFO, "[OK]: MTU is %u\n", p->mtu);
 	return 0;
 }
 
-static int object_select(struct nrfu_data_t *p, enum dfu_object_type type, struct object_select_response_t *resp)
+/* Check that a frame of resp_length bytes is a successful response to opcode */
+static int dfu_check_response(struct nrfu_ctx *p, enum dfu_opcode opcode, struct dfu_msg_t *msg,
+			      size_t resp_length)
 {
-	struct dfu_msg_t msg;
+	int i;
 
-	if (!resp)
-		return -1;
+	msg->payload_length = 0;
 
-	msg.command.op_code = DFU_OPCODE_OBJECT_SELECT;
-	msg.payload_length = 0;
-	msg.command.payload[msg.payload_length++] = type;
+	if (dfu_log_enabled(p, NRFU_LOG_LEVEL_DEBUG))
+		dfu_log_hex(p, "<-- ", msg->data, resp_length);
 
-	dfu_log(NRFU_LOG_LEVEL_INFO, "Selecting object type %s...\n",
-		type == DFU_OBJECT_TYPE_COMMAND ? "COMMAND" : "DATA");
-	if (dfu_send_msg(p, &msg) < 0) {
-		dfu_log(NRFU_LOG_LEVEL_ERROR, "Failed to send command OBJ_SELECT!\n");
+	if (resp_length < 3) {
+		dfu_log(p, NRFU_LOG_LEVEL_ERROR, "Response too short: %zu\n", resp_length);
 		return -1;
 	}
 
-	if (dfu_get_response(p, DFU_OPCODE_OBJECT_SELECT, &msg) < 0) {
-		dfu_log(NRFU_LOG_LEVEL_ERROR, "Failed to receive OBJ_SELECT!\n");
+	if (msg->response.op_code != DFU_OPCODE_RESPONSE) {
+		dfu_log(p, NRFU_LOG_LEVEL_ERROR, "No response: 0x%02x\n", msg->response.op_code);
 		return -1;
 	}
 
-	if (msg.payload_length < sizeof(*resp)) {
-		dfu_log(NRFU_LOG_LEVEL_ERROR, "Response too short for OBJ_SELECT!\n");
-		dfu_log(NRFU_LOG_LEVEL_ERROR, "Received: %lu Expected: %lu!\n",
-			msg.payload_length, sizeof(*resp));
+	if (msg->response.resp_op_code != opcode) {
+		dfu_log(p, NRFU_LOG_LEVEL_ERROR, "Unexpected OP_CODE: 0x%02x (expected 0x%02x)\n", msg->response.resp_op_code, opcode);
 		return -1;
 	}
 
-	resp->max_size = uint32_decode(&msg.response.payload[0]);
-		resp->offset = uint32_decode(&msg.response.payload[4]);
-		resp->crc = uint32_decode(&msg.response.payload[8]);
+	if (msg->response.res_code == DFU_RESCODE_SUCCESS) {
+		msg->payload_length = resp_length - 3;
+		return 0;
+	}
 
-	dfu_log(NRFU_LOG_LEVEL_INFO, "[OK]: [0x%x, 0x%x, 0x%x]\n",
-		resp->max_size, resp->offset, resp->crc);
-	return 0;
+	dfu_log(p, NRFU_LOG_LEVEL_ERROR, "Response Error! Received:\n");
+	for (i = 0; i < resp_length - 2; i++)
+		dfu_log(p, NRFU_LOG_LEVEL_ERROR, "0x%02x ", msg->data[i]);
+	dfu_log(p, NRFU_LOG_LEVEL_ERROR, "\n");
+	return -1;
 }
 
-static int object_create(struct nrfu_data_t *p, enum dfu_object_type type, uint32_t size)
+static const char *dfu_opcode_name(enum dfu_opcode opcode)
 {
-	struct dfu_msg_t msg;
+	switch (opcode) {
+	case DFU_OPCODE_OBJECT_CREATE:
+		return "OBJ_CREATE";
+	case DFU_OPCODE_SET_PRN:
+		return "SET_PRN";
+	case DFU_OPCODE_GET_CRC:
+		return "GET_CRC";
+	case DFU_OPCODE_SET_EXECUTE:
+		return "SET_EXECUTE";
+	case DFU_OPCODE_OBJECT_SELECT:
+		return "OBJ_SELECT";
+	case DFU_OPCODE_GET_MTU:
+		return "GET_MTU";
+	case DFU_OPCODE_PING:
+		return "PING";
+	default:
+		return "UNKNOWN";
+	}
+}
 
-	msg.command.op_code = DFU_OPCODE_OBJECT_CREATE;
-	msg.payload_length = 0;
+static enum nrfu_rtt_kind dfu_rtt_kind(const struct nrfu_ctx *p, const struct dfu_msg_t *msg)
+{
+	int data;
+
+	switch (msg->command.op_code) {
+	case DFU_OPCODE_PING:
+		return NRFU_RTT_PING;
+	case DFU_OPCODE_SET_PRN:
+		return NRFU_RTT_SET_PRN;
+	case DFU_OPCODE_GET_MTU:
+		return NRFU_RTT_GET_MTU;
+	case DFU_OPCODE_GET_CRC:
+		return NRFU_RTT_GET_CRC;
+	default:
+		break;
+	}
 
-	msg.command.payload[msg.payload_length++] = type;
-	msg.payload_length += uint32_encode(size, &msg.command.payload[msg.payload_length]);
+	data = p->object_type == DFU_OBJECT_TYPE_DATA;
 
-	dfu_log(NRFU_LOG_LEVEL_INFO, "Creating object type %s, size 0x%x...\n",
-		type == DFU_OBJECT_TYPE_COMMAND ? "COMMAND" : "DATA", size);
-	if (dfu_send_msg(p, &msg) < 0) {
-		dfu_log(NRFU_LOG_LEVEL_ERROR, "Failed to send command OBJ_CREATE!\n");
-		return -1;
+	switch (msg->command.op_code) {
+	case DFU_OPCODE_OBJECT_SELECT:
+		return data ? NRFU_RTT_DATA_SELECT : NRFU_RTT_COMMAND_SELECT;
+	case DFU_OPCODE_OBJECT_CREATE:
+		return data ? NRFU_RTT_DATA_CREATE : NRFU_RTT_COMMAND_CREATE;
+	default:
+		return data ? NRFU_RTT_DATA_EXECUTE : NRFU_RTT_COMMAND_EXECUTE;
 	}
+}
 
-	if (dfu_get_response(p, DFU_OPCODE_OBJECT_CREATE, &msg) < 0) {
-		dfu_log(NRFU_LOG_LEVEL_ERROR,
-			"Failed to create object of type 0x%02x with size %u!\n", type, size);
-		return -1;
-	}
+/*
+ * Time unacknowledged bytes need on the line, 8N1. It is only known for a
+ * serial port at a set baud rate; on other links a control message is
+ * taken to need none and more data DFU_LINE_UNKNOWN.
+ */
+static uint64_t dfu_line_ns(const struct nrfu_ctx *p, unsigned long bytes)
+{
+	if (p->link.tty && p->opts.baudrate)
+		return bytes * 10 * 1000000000ULL / p->opts.baudrate;
 
-	dfu_log(NRFU_LOG_LEVEL_INFO, "[OK]\n");
-	return 0;
+	return bytes > DFU_CONTROL_BYTES ? DFU_LINE_UNKNOWN : 0;
 }
 
-static int get_crc(struct nrfu_data_t *p, uint32_t *offset, uint32_t *crc)
+/*
+ * How long to wait for the response of kind to a request behind line_ns:
+ * adapted to its round trip times, see nrfu_options. Waits behind data of
+ * unknown line time, and replays, which reproduce the delays of a session
+ * whose timeouts differed, get the maximum.
+ */
+static uint64_t dfu_timeout_ns(const struct nrfu_ctx *p, enum nrfu_rtt_kind kind,
+			       uint64_t line_ns)
 {
-	struct dfu_msg_t msg;
+	uint64_t min_ns = p->opts.response_timeout_min_ms * 1000000ULL;
+	uint64_t max_ns = p->opts.response_timeout_ms * 1000000ULL;
+	uint64_t timeout;
+	uint32_t pages;
+
+	/*
+	 * Before it answers the execute of the last data object, the
+	 * bootloader checks the hash and signature of the whole image. The
+	 * round trips of the other objects say nothing about how long that
+	 * takes.
+	 */
+	if (p->replay || line_ns == DFU_LINE_UNKNOWN)
+		timeout = max_ns;
+	else if (kind == NRFU_RTT_DATA_EXECUTE && p->execute_validates)
+		timeout = line_ns + max_ns;
+	else
+		timeout = line_ns + rtt_timeout(&p->rtt[kind], min_ns, max_ns);
+
+	switch (kind) {
+	case NRFU_RTT_COMMAND_CREATE:
+	case NRFU_RTT_COMMAND_EXECUTE:
+	case NRFU_RTT_DATA_CREATE:
+	case NRFU_RTT_DATA_EXECUTE:
+		pages = (p->object_bytes + DFU_FLASH_PAGE_SIZE - 1) / DFU_FLASH_PAGE_SIZE;
+		timeout += (pages ? pages : 1) * p->opts.flash_timeout_ms * 1000000ULL;
+		break;
+	default:
+		break;
+	}
 
-	if (!crc || !offset)
-		return -1;
+	return timeout;
+}
 
-	msg.command.op_code = DFU_OPCODE_GET_CRC;
-	msg.payload_length = 0;
+static void dfu_rtt_sample(struct nrfu_ctx *p, enum nrfu_rtt_kind kind, uint64_t sent_ns,
+			   uint64_t line_ns)
+{
+	uint64_t rtt = monotonic_ns() - sent_ns;
 
-	dfu_log(NRFU_LOG_LEVEL_INFO, "Fetching CRC...\n");
-	if (dfu_send_msg(p, &msg) < 0) {
-		dfu_log(NRFU_LOG_LEVEL_ERROR, "Failed to send command GET_CRC!\n");
-		return -1;
-	}
+	if (line_ns != DFU_LINE_UNKNOWN)
+		rtt = rtt > line_ns ? rtt - line_ns : 0;
 
-	if (dfu_get_response(p, DFU_OPCODE_GET_CRC, &msg) < 0) {
-		dfu_log(NRFU_LOG_LEVEL_ERROR, "Failed to receive CRC!\n");
-		return -1;
-	}
+	rtt_sample(&p->rtt[kind], rtt);
+}
+
+/*
+ * Send the command in p->msg and continue with fn once its response
+ * arrived, which has to be within the timeout of its kind.
+ */
+static int dfu_request(struct nrfu_ctx *p, dfu_response_fn fn)
+{
+	p->response_opcode = p->msg.command.op_code;
+	p->request_kind = dfu_rtt_kind(p, &p->msg);
 
-	if (msg.payload_length < sizeof(*offset) + sizeof(*crc)) {
-		dfu_log(NRFU_LOG_LEVEL_ERROR, "Response too short for GET_CRC!\n");
-		dfu_log(NRFU_LOG_LEVEL_ERROR, "Received: %lu Expected: %lu!\n",
-			msg.payload_length, sizeof(*offset) + sizeof(*crc));
+	if (dfu_send_msg(p, &p->msg) < 0) {
+		dfu_log(p, NRFU_LOG_LEVEL_ERROR, "Failed to send command %s!\n",
+			dfu_opcode_name(p->response_opcode));
 		return -1;
 	}
 
-	*offset = uint32_decode(&msg.response.payload[0]);
-	*crc = uint32_decode(&msg.response.payload[sizeof(*offset)]);
-
-	dfu_log(NRFU_LOG_LEVEL_INFO, "[OK]: [0x%x, 0x%x ]\n", *offset, *crc);
+	p->on_response = fn;
+	p->request_ns = monotonic_ns();
+	p->request_tx_bytes = p->progress.wire_tx_bytes;
+	p->request_line_ns = dfu_line_ns(p, p->request_tx_bytes - p->acked_tx_bytes);
+	p->deadline = p->request_ns + dfu_timeout_ns(p, p->request_kind, p->request_line_ns);
 	return 0;
 }
 
-static int stream_data(struct nrfu_data_t *p, FILE *fp, long file_size, uint32_t *crc,
-			   uint32_t start_offset)
+static int prn_check(struct nrfu_ctx *p, struct dfu_msg_t *msg, size_t length);
+
+/* Handle a received frame: the awaited response or a receipt notification */
+static int dfu_handle_frame(struct nrfu_ctx *p, size_t length)
 {
-	int chunk_size;
-	struct dfu_msg_t msg;
-	uint32_t offset = 0;
-	uint32_t offset_target, crc_target;
+	struct dfu_msg_t *msg = &p->msg;
+	dfu_response_fn fn = p->on_response;
+
+	/* responses to the requests of a failed attempt may still come in */
+	if (p->resyncing) {
+		if (length < 4 || msg->response.op_code != DFU_OPCODE_RESPONSE ||
+		    msg->response.resp_op_code != DFU_OPCODE_PING ||
+		    msg->response.res_code != DFU_RESCODE_SUCCESS ||
+		    msg->response.payload[0] != p->ping_id) {
+			if (dfu_log_enabled(p, NRFU_LOG_LEVEL_DEBUG))
+				dfu_log_hex(p, "<-- stale ", msg->data, length);
+			return 0;
+		}
+		p->resyncing = 0;
+	}
 
-	if (!p || !fp || !crc)
-		return -1;
+	if (!fn) {
+		if (p->stream.active && p->stream.prn.pending)
+			return prn_check(p, msg, length);
 
-	msg.command.op_code = DFU_OPCODE_WRITE_OBJECT;
-	msg.payload_length = 0;
+		if (dfu_log_enabled(p, NRFU_LOG_LEVEL_DEBUG))
+			dfu_log_hex(p, "<-- ", msg->data, length);
+		dfu_log(p, NRFU_LOG_LEVEL_ERROR, "Unexpected frame: 0x%02x\n", msg->data[0]);
+		return -1;
+	}
 
-	chunk_size = ((p->mtu - 1) / 2) - 1;
-	if (chunk_size > sizeof(msg.data) - 1) {
-		dfu_log(NRFU_LOG_LEVEL_ERROR, "Message buffer too small for chunk size: %zu vs. %d\n",
-			sizeof(msg.data), chunk_size);
+	if (dfu_check_response(p, p->response_opcode, msg, length) < 0) {
+		dfu_log(p, NRFU_LOG_LEVEL_ERROR, "No valid response to %s!\n",
+			dfu_opcode_name(p->response_opcode));
 		return -1;
 	}
 
-	dfu_log(NRFU_LOG_LEVEL_INFO, "Streaming file of size 0x%lx with chunk size 0x%x...",
-		file_size, chunk_size);
+	dfu_rtt_sample(p, p->request_kind, p->request_ns, p->request_line_ns);
+	p->acked_tx_bytes = p->request_tx_bytes;
 
-	while (offset < file_size) {
-		msg.payload_length = fread(msg.command.payload, 1, chunk_size, fp);
-		if (ferror(fp)) {
-			dfu_log(NRFU_LOG_LEVEL_ERROR, "Failed to read file\n");
-			return -1;
-		}
+	p->on_response = NULL;
+	p->deadline = 0;
+	return fn(p, msg);
+}
 
-		offset += msg.payload_length;
-		*crc = crc32_compute(msg.command.payload, msg.payload_length, *crc);
+/*
+ * Handle the frames in the receive ring. If there are none and the engine
+ * waits for one, read what the link has without blocking, at most once per
+ * call. Stops early when a handler queued a frame, which is written first.
+ * Returns the number of frames handled or -1 on error.
+ */
+static int dfu_input(struct nrfu_ctx *p)
+{
+	size_t length;
+	int n = 0, read = 0, ret;
+
+	while (p->state == DFU_ENGINE_RUNNING && !p->tx_left) {
+		if (!dfu_decode_frame(p, p->msg.data, sizeof(p->msg.data), &length)) {
+			if (n || read || !engine_waits_for_input(p))
+				break;
+
+			ret = dfu_read(p, 0);
+			if (ret <= 0)
+				return ret < 0 ? -1 : 0;
+			read = 1;
+			continue;
+		}
 
-		if (dfu_send_msg(p, &msg) < 0) {
-			dfu_log(NRFU_LOG_LEVEL_ERROR, "Failed to send data!\n");
+		if (dfu_handle_frame(p, length) < 0)
 			return -1;
-		}
+		n++;
 	}
 
-	dfu_log(NRFU_LOG_LEVEL_INFO, "[OK]\n");
+	return n;
+}
+
+/*
+ * Compare the oldest outstanding receipt notification against what was
+ * sent up to that point.
+ */
+static int prn_check(struct nrfu_ctx *p, struct dfu_msg_t *msg, size_t length)
+{
+	struct prn_window *w = &p->stream.prn;
+	uint32_t offset, crc;
 
-	if (get_crc(p, &offset_target, &crc_target) < 0)
+	if (dfu_check_response(p, DFU_OPCODE_GET_CRC, msg, length) < 0)
 		return -1;
 
-	if (*crc != crc_target) {
-		dfu_log(NRFU_LOG_LEVEL_ERROR, "CRC validation failed.");
-		dfu_log(NRFU_LOG_LEVEL_ERROR, "Expected: 0x%08x Received 0x%08x\n", *crc, crc_target);
+	if (msg->payload_length < sizeof(offset) + sizeof(crc)) {
+		dfu_log(p, NRFU_LOG_LEVEL_ERROR, "Receipt notification too short: %zu\n", msg->payload_length);
 		return -1;
 	}
 
-	offset += start_offset;
-	if (offset != offset_target) {
-		dfu_log(NRFU_LOG_LEVEL_ERROR, "Offset validation failed.");
-		dfu_log(NRFU_LOG_LEVEL_ERROR, "Expected: 0x%08x Received 0x%08x\n",
-			offset, offset_target);
+	offset = uint32_decode(&msg->response.payload[0]);
+	crc = uint32_decode(&msg->response.payload[sizeof(offset)]);
+
+	if (offset != w->expected[w->head].offset || crc != w->expected[w->head].crc) {
+		dfu_log(p, NRFU_LOG_LEVEL_ERROR, "Receipt notification mismatch. ");
+		dfu_log(p, NRFU_LOG_LEVEL_ERROR, "Expected: [0x%x, 0x%08x] Received [0x%x, 0x%08x]\n",
+			w->expected[w->head].offset, w->expected[w->head].crc, offset, crc);
 		return -1;
 	}
 
+	dfu_rtt_sample(p, NRFU_RTT_RECEIPT, w->expected[w->head].sent_ns,
+		       w->expected[w->head].line_ns);
+	p->acked_tx_bytes = w->expected[w->head].tx_bytes;
+
+	w->head = (w->head + 1) % PRN_SLOTS;
+	w->pending--;
+	p->deadline = 0;
 	return 0;
 }
 
-static int set_execute(struct nrfu_data_t *p)
+/*
+ * Expect a receipt notification for the data sent so far, if the packets
+ * complete a receipt_notify_n interval, and check those that already
+ * arrived without blocking.
+ */
+static int prn_expect(struct nrfu_ctx *p)
 {
-	struct dfu_msg_t msg;
-
-	msg.command.op_code = DFU_OPCODE_SET_EXECUTE;
-	msg.payload_length = 0;
+	struct dfu_stream *s = &p->stream;
+	struct prn_window *w = &s->prn;
+	int i;
 
-	dfu_log(NRFU_LOG_LEVEL_INFO, "Setting Execute...");
-	if (dfu_send_msg(p, &msg) < 0) {
-		dfu_log(NRFU_LOG_LEVEL_ERROR, "Failed to send command SET_EXECUTE!\n");
-		return -1;
-	}
+	if (!p->receipt_notify_n)
+		return 0;
 
-	if (dfu_get_response(p, DFU_OPCODE_SET_EXECUTE, &msg) < 0) {
-		dfu_log(NRFU_LOG_LEVEL_ERROR, "Failed to set execute!\n");
-		return -1;
+	if (!(s->packets % p->receipt_notify_n)) {
+		i = (w->head + w->pending) % PRN_SLOTS;
+		w->expected[i].offset = s->offset;
+		w->expected[i].crc = s->crc;
+		w->expected[i].sent_ns = monotonic_ns();
+		w->expected[i].tx_bytes = p->progress.wire_tx_bytes;
+		w->expected[i].line_ns = dfu_line_ns(p, p->progress.wire_tx_bytes - p->acked_tx_bytes);
+		w->pending++;
 	}
 
-	dfu_log(NRFU_LOG_LEVEL_INFO, "[OK]\n");
-	return 0;
+	return w->pending ? dfu_input(p) : 0;
 }
 
-static int send_init_packet(struct nrfu_data_t *p, const char *init_packet)
+/* When the oldest outstanding receipt notification is overdue */
+static uint64_t prn_deadline(const struct nrfu_ctx *p)
 {
-	FILE *fp;
-	long file_size;
-	struct object_select_response_t obj_sel_resp;
-	int ret = -1;
-	uint32_t crc = 0;
+	const struct prn_window *w = &p->stream.prn;
 
-	if (!init_packet)
-		return -1;
+	return w->expected[w->head].sent_ns +
+	       dfu_timeout_ns(p, NRFU_RTT_RECEIPT, w->expected[w->head].line_ns);
+}
 
-	dfu_log(NRFU_LOG_LEVEL_INFO, "Opening %s...\n", init_packet);
-	fp = fopen(init_packet, "rb");
-	if (!fp) {
-		dfu_log(NRFU_LOG_LEVEL_ERROR, "Failed to open %s\n", init_packet);
-		return -1;
-	}
-	dfu_log(NRFU_LOG_LEVEL_INFO, "[OK]\n");
+/* Send the data of [offset, end) of img and then continue with done */
+static int stream_start(struct nrfu_ctx *p, const struct image *img, uint32_t offset,
+			uint32_t end, uint32_t crc, dfu_step_fn done)
+{
+	struct dfu_stream *s = &p->stream;
+
+	memset(s, 0, sizeof(*s));
+	s->img = img;
+	s->offset = offset;
+	s->end = end;
+	s->crc = crc;
+	s->done = done;
+	s->active = 1;
+
+	dfu_log(p, NRFU_LOG_LEVEL_INFO, "Streaming 0x%x bytes at 0x%x with MTU %u...",
+		end - offset, offset, p->mtu);
+	return 0;
+}
 
-	fseek(fp, 0, SEEK_END);
-	file_size = ftell(fp);
-	fseek(fp, 0, SEEK_SET);
+/*
+ * Send data object obj from the frame cache. The frames of all packets up
+ * to the next receipt notification, or of the whole object, go out with a
+ * single write.
+ */
+static int stream_start_cached(struct nrfu_ctx *p, const struct frame_cache *fc, uint32_t obj,
+			       uint32_t crc, dfu_step_fn done)
+{
+	struct dfu_stream *s = &p->stream;
+
+	memset(s, 0, sizeof(*s));
+	s->fc = fc;
+	s->packet = fc->first_packet[obj];
+	s->last = fc->first_packet[obj + 1];
+	s->offset = obj * fc->object_size;
+	s->end = fc->packets[s->last - 1].end_offset;
+	s->crc = crc;
+	s->done = done;
+	s->active = 1;
+
+	dfu_log(p, NRFU_LOG_LEVEL_INFO, "Streaming cached object %u at 0x%x with MTU %u...",
+		obj, s->offset, p->mtu);
+	return 0;
+}
 
-	if (object_select(p, DFU_OBJECT_TYPE_COMMAND, &obj_sel_resp) < 0)
-		goto out;
+static int stream_send_packet(struct nrfu_ctx *p)
+{
+	struct dfu_stream *s = &p->stream;
+	const uint8_t *data = &s->img->data[s->offset];
+	size_t consumed, frame_length;
+
+	/*
+	 * By default each packet carries as many bytes as fit the MTU if all
+	 * of them had to be escaped, which is what the bootloader's decode
+	 * buffer is sized for. With fill_mtu the packets are packed by their
+	 * actual escaped length instead.
+	 */
+	frame_length = frame_pack(p->tx_buf, p->mtu, p->opts.fill_mtu, data,
+				  s->end - s->offset, &consumed);
+
+	if (dfu_log_enabled(p, NRFU_LOG_LEVEL_DEBUG))
+		dfu_log_hex(p, "--> ", p->tx_buf, frame_length);
+
+	s->offset += consumed;
+	s->crc = crc32_compute(data, consumed, s->crc);
+	s->packets++;
+
+	p->progress.payload_bytes += consumed;
+	p->progress.image_bytes = s->offset;
+	progress_update(p);
+
+	return dfu_send_frame(p, p->tx_buf, frame_length);
+}
 
-	if (file_size > obj_sel_resp.max_size) {
-		dfu_log(NRFU_LOG_LEVEL_ERROR, "Init command too long: %ld (max. %d)\n", file_size, obj_sel_resp.max_size);
-		goto out;
-	}
+static int stream_send_cached(struct nrfu_ctx *p)
+{
+	struct dfu_stream *s = &p->stream;
+	const struct frame_cache *fc = s->fc;
+	uint32_t end = s->last;
+	uint32_t start = frame_cache_frame_start(fc, s->packet);
+	const uint8_t *frames = &fc->frames[start];
 
-	if (obj_sel_resp.offset != 0)
-		dfu_log(NRFU_LOG_LEVEL_INFO, "Offset at 0x%x\n", obj_sel_resp.offset);
+	if (p->receipt_notify_n && s->packet + p->receipt_notify_n < s->last)
+		end = s->packet + p->receipt_notify_n;
 
-	if (object_create(p, DFU_OBJECT_TYPE_COMMAND, file_size) < 0)
-		goto out;
+	if (dfu_log_enabled(p, NRFU_LOG_LEVEL_DEBUG))
+		dfu_log_hex(p, "--> ", frames, fc->packets[end - 1].frame_end - start);
 
-	if (stream_data(p, fp, file_size, &crc, 0) < 0)
-		goto out;
+	p->progress.payload_bytes += fc->packets[end - 1].end_offset - s->offset;
+	p->progress.image_bytes = fc->packets[end - 1].end_offset;
+	progress_update(p);
 
-	if (set_execute(p) < 0)
-		goto out;
+	s->packets += end - s->packet;
+	s->packet = end;
+	s->offset = fc->packets[end - 1].end_offset;
+	s->crc = fc->packets[end - 1].crc;
 
-	ret = 0;
-out:
-	fclose(fp);
-	if (ret)
-		dfu_log(NRFU_LOG_LEVEL_ERROR, "Failed to send init-packet \"%s\"\n", init_packet);
-	return ret;
+	return dfu_send_frame(p, frames, fc->packets[end - 1].frame_end - start);
 }
 
-static int send_firmware(struct nrfu_data_t *p, const char *firmware)
+static int stream_verified(struct nrfu_ctx *p, struct dfu_msg_t *msg)
 {
-	FILE *fp;
-	uint32_t file_size, obj_offset;
-	struct object_select_response_t obj_sel_resp;
-	int ret = -1;
-	uint32_t crc = 0;
+	struct dfu_stream *s = &p->stream;
+	uint32_t offset, crc;
+
+	if (msg->payload_length < sizeof(offset) + sizeof(crc)) {
+		dfu_log(p, NRFU_LOG_LEVEL_ERROR, "Response too short for GET_CRC!\n");
+		dfu_log(p, NRFU_LOG_LEVEL_ERROR, "Received: %lu Expected: %lu!\n",
+			msg->payload_length, sizeof(offset) + sizeof(crc));
+		return -1;
+	}
+
+	offset = uint32_decode(&msg->response.payload[0]);
+	crc = uint32_decode(&msg->response.payload[sizeof(offset)]);
 
-	if (!firmware)
+	dfu_log(p, NRFU_LOG_LEVEL_INFO, "[OK]: [0x%x, 0x%x ]\n", offset, crc);
+
+	if (s->crc != crc) {
+		dfu_log(p, NRFU_LOG_LEVEL_ERROR, "CRC validation failed.");
+		dfu_log(p, NRFU_LOG_LEVEL_ERROR, "Expected: 0x%08x Received 0x%08x\n", s->crc, crc);
 		return -1;
+	}
 
-	dfu_log(NRFU_LOG_LEVEL_INFO, "open %s\n", firmware);
-	fp = fopen(firmware, "rb");
-	if (!fp) {
-		dfu_log(NRFU_LOG_LEVEL_ERROR, "Failed to open %s\n", firmware);
+	if (s->offset != offset) {
+		dfu_log(p, NRFU_LOG_LEVEL_ERROR, "Offset validation failed.");
+		dfu_log(p, NRFU_LOG_LEVEL_ERROR, "Expected: 0x%08x Received 0x%08x\n",
+			s->offset, offset);
 		return -1;
 	}
-	dfu_log(NRFU_LOG_LEVEL_INFO, "[OK]\n");
 
-	fseek(fp, 0, SEEK_END);
-	file_size = ftell(fp);
-	fseek(fp, 0, SEEK_SET);
+	return s->done(p);
+}
 
-	if (object_select(p, DFU_OBJECT_TYPE_DATA, &obj_sel_resp) < 0)
-		goto out;
+/*
+ * Send data packets until the link is full, the receipt notification window
+ * is or the turn is over. Once all data is out and acknowledged the
+ * bootloader's CRC is fetched. Returns 1 when waiting for input, else 0.
+ */
+static int stream_pump(struct nrfu_ctx *p)
+{
+	struct dfu_stream *s = &p->stream;
+	int ret;
 
-	if (obj_sel_resp.offset != 0) {
-		dfu_log(NRFU_LOG_LEVEL_INFO, "Offset at 0x%x\n", obj_sel_resp.offset);
-		obj_sel_resp.offset = 0;
-	}
+	while (s->active && !p->tx_left) {
+		/* the window is full: wait for the oldest notification first */
+		if (s->prn.pending > PRN_WINDOW)
+			return 1;
 
-	for (obj_offset = obj_sel_resp.offset; obj_offset < file_size; obj_offset += obj_sel_resp.max_size) {
-		uint32_t obj_size = obj_sel_resp.max_size;
+		if (s->offset == s->end) {
+			if (s->prn.pending)
+				return 1;
 
-		if (file_size - obj_offset < obj_sel_resp.max_size)
-			obj_size = file_size - obj_offset;
+			s->active = 0;
+			dfu_log(p, NRFU_LOG_LEVEL_INFO, "[OK]\n");
 
-		if (object_create(p, DFU_OBJECT_TYPE_DATA, obj_size) < 0)
-			goto out;
+			p->msg.command.op_code = DFU_OPCODE_GET_CRC;
+			p->msg.payload_length = 0;
+			dfu_log(p, NRFU_LOG_LEVEL_INFO, "Fetching CRC...\n");
+			return dfu_request(p, stream_verified);
+		}
+
+		if (p->progress.wire_tx_bytes - p->turn_tx_bytes >= DFU_TURN_BYTES) {
+			p->yield = 1;
+			return 0;
+		}
 
-		fseek(fp, obj_offset, SEEK_SET);
-		if (stream_data(p, fp, obj_size, &crc, obj_offset) < 0)
-			goto out;
+		ret = s->fc ? stream_send_cached(p) : stream_send_packet(p);
+		if (ret < 0) {
+			dfu_log(p, NRFU_LOG_LEVEL_ERROR, "Failed to send data!\n");
+			return -1;
+		}
 
-		if (set_execute(p) < 0)
-			goto out;
+		if (prn_expect(p) < 0)
+			return -1;
 	}
 
-	ret = 0;
-out:
-	fclose(fp);
-	if (ret)
-		dfu_log(NRFU_LOG_LEVEL_ERROR, "Failed to send firmware \"%s\"\n", firmware);
-	return ret;
+	return 0;
 }
 
-int nrfu_update(const char *devname, const char *init_packet, const char *firmware, enum nrfu_log_level log_level)
+/* Continue with next once SET_EXECUTE succeeded */
+static int execute_done(struct nrfu_ctx *p, struct dfu_msg_t *msg)
 {
-	struct nrfu_data_t priv;
-	int ret = -1;
+	dfu_log(p, NRFU_LOG_LEVEL_INFO, "[OK]\n");
+	phase_end(p, NRFU_PHASE_EXECUTE, 0);
 
-	if (!devname || !init_packet || !firmware)
-		return -1;
+	return p->execute_next(p);
+}
 
-	error_level = log_level;
+static int set_execute(struct nrfu_ctx *p, dfu_step_fn next)
+{
+	struct dfu_msg_t *msg = &p->msg;
 
-	priv.serial_fd = serial_init(devname);
-	if (priv.serial_fd < 0) {
-		dfu_log(NRFU_LOG_LEVEL_ERROR, "Failed to initialize \"%s\"!\n", devname);
-		goto err_out;
-	}
+	phase_begin(p, NRFU_PHASE_EXECUTE);
 
-	priv.receipt_notify_n = 0;
+	msg->command.op_code = DFU_OPCODE_SET_EXECUTE;
+	msg->payload_length = 0;
 
-	if (send_ping(&priv) < 0)
-		goto err_out;
+	dfu_log(p, NRFU_LOG_LEVEL_INFO, "Setting Execute...");
+	p->execute_next = next;
+	return dfu_request(p, execute_done);
+}
 
-	if (set_receipt_notify(&priv) < 0)
-		goto err_out;
+static int object_select(struct nrfu_ctx *p, enum dfu_object_type type, dfu_response_fn fn)
+{
+	struct dfu_msg_t *msg = &p->msg;
 
-	if (get_mtu(&priv) < 0)
-		goto err_out;
+	msg->command.op_code = DFU_OPCODE_OBJECT_SELECT;
+	msg->payload_length = 0;
+	msg->command.payload[msg->payload_length++] = type;
+	p->object_type = type;
 
-	if (send_init_packet(&priv, init_packet) < 0)
-		goto err_out;
+	dfu_log(p, NRFU_LOG_LEVEL_INFO, "Selecting object type %s...\n",
+		type == DFU_OBJECT_TYPE_COMMAND ? "COMMAND" : "DATA");
+	return dfu_request(p, fn);
+}
+
+static int object_select_parse(struct nrfu_ctx *p, struct dfu_msg_t *msg,
+			       struct object_select_response_t *resp)
+{
+	if (msg->payload_length < sizeof(*resp)) {
+		dfu_log(p, NRFU_LOG_LEVEL_ERROR, "Response too short for OBJ_SELECT!\n");
+		dfu_log(p, NRFU_LOG_LEVEL_ERROR, "Received: %lu Expected: %lu!\n",
+			msg->payload_length, sizeof(*resp));
+		return -1;
+	}
+
+	resp->max_size = uint32_decode(&msg->response.payload[0]);
+	resp->offset = uint32_decode(&msg->response.payload[4]);
+	resp->crc = uint32_decode(&msg->response.payload[8]);
+	p->object_bytes = resp->max_size;
+
+	dfu_log(p, NRFU_LOG_LEVEL_INFO, "[OK]: [0x%x, 0x%x, 0x%x]\n",
+		resp->max_size, resp->offset, resp->crc);
+	return 0;
+}
+
+static int object_create(struct nrfu_ctx *p, enum dfu_object_type type, uint32_t size,
+			 dfu_response_fn fn)
+{
+	struct dfu_msg_t *msg = &p->msg;
+
+	msg->command.op_code = DFU_OPCODE_OBJECT_CREATE;
+	msg->payload_length = 0;
+
+	msg->command.payload[msg->payload_length++] = type;
+	msg->payload_length += uint32_encode(size, &msg->command.payload[msg->payload_length]);
+	p->object_type = type;
+	p->object_bytes = size;
+
+	dfu_log(p, NRFU_LOG_LEVEL_INFO, "Creating object type %s, size 0x%x...\n",
+		type == DFU_OBJECT_TYPE_COMMAND ? "COMMAND" : "DATA", size);
+	return dfu_request(p, fn);
+}
+
+/*
+ * Session steps
+ *
+ * Each step sends a request and names the step that handles its response,
+ * or starts streaming and names the step that follows the verified data.
+ * A step that fails makes the session fail, unless an error step was set
+ * with dfu_on_error(); phases still open are then ended as failed.
+ */
+static int image_begin(struct nrfu_ctx *p);
+static int firmware_begin(struct nrfu_ctx *p);
+static int object_next(struct nrfu_ctx *p);
+
+static void dfu_on_error(struct nrfu_ctx *p, dfu_step_fn fn)
+{
+	p->on_error = fn;
+	p->error_phases = p->open_phases;
+}
+
+static const struct dfu_job_image *job_image(struct nrfu_ctx *p)
+{
+	return &p->job.images[p->job.current];
+}
+
+/* Execute the data object ending at end */
+static int data_execute(struct nrfu_ctx *p, uint32_t end, dfu_step_fn next)
+{
+	p->execute_validates = end == job_image(p)->firmware->size;
+	return set_execute(p, next);
+}
+
+static int init_packet_done(struct nrfu_ctx *p)
+{
+	phase_end(p, NRFU_PHASE_INIT_PACKET, 0);
+	return firmware_begin(p);
+}
+
+static int init_packet_streamed(struct nrfu_ctx *p)
+{
+	return set_execute(p, init_packet_done);
+}
+
+static int init_packet_created(struct nrfu_ctx *p, struct dfu_msg_t *msg)
+{
+	const struct image *img = job_image(p)->init_packet;
+
+	dfu_log(p, NRFU_LOG_LEVEL_INFO, "[OK]\n");
+	return stream_start(p, img, 0, img->size, 0, init_packet_streamed);
+}
+
+/*
+ * If the bootloader already holds (a prefix of) this init packet, e.g. from
+ * an earlier, interrupted attempt, only the missing part is sent before
+ * executing it, saving the create and stream round trips.
+ */
+static int init_packet_selected(struct nrfu_ctx *p, struct dfu_msg_t *msg)
+{
+	const struct image *img = job_image(p)->init_packet;
+	struct object_select_response_t resp;
+
+	if (object_select_parse(p, msg, &resp) < 0)
+		return -1;
+
+	if (img->size > resp.max_size) {
+		dfu_log(p, NRFU_LOG_LEVEL_ERROR, "Init command too long: %u (max. %u)\n",
+			img->size, resp.max_size);
+		return -1;
+	}
+
+	if (resp.offset != 0)
+		dfu_log(p, NRFU_LOG_LEVEL_INFO, "Offset at 0x%x\n", resp.offset);
+
+	if (resp.offset == 0 || resp.offset > img->size || image_crc(img, resp.offset) != resp.crc)
+		return object_create(p, DFU_OBJECT_TYPE_COMMAND, img->size, init_packet_created);
+
+	dfu_log(p, NRFU_LOG_LEVEL_INFO, "Init packet already present up to 0x%x\n", resp.offset);
+	p->progress.image_bytes = resp.offset;
+
+	if (resp.offset < img->size)
+		return stream_start(p, img, resp.offset, img->size, resp.crc, init_packet_streamed);
+
+	return set_execute(p, init_packet_done);
+}
+
+static int image_begin(struct nrfu_ctx *p)
+{
+	const struct dfu_job_image *ji = job_image(p);
+
+	if (ji->type)
+		dfu_log(p, NRFU_LOG_LEVEL_INFO, "Sending %s (%u of %u)\n", ji->type,
+			p->job.current + 1, p->job.n_images);
+
+	progress_image(p, NRFU_PHASE_INIT_PACKET, ji->init_packet);
+	phase_begin(p, NRFU_PHASE_INIT_PACKET);
+
+	return object_select(p, DFU_OBJECT_TYPE_COMMAND, init_packet_selected);
+}
+
+static int firmware_selected(struct nrfu_ctx *p, struct dfu_msg_t *msg);
+static int object_failed(struct nrfu_ctx *p);
+
+static int object_prn_set(struct nrfu_ctx *p, struct dfu_msg_t *msg)
+{
+	dfu_log(p, NRFU_LOG_LEVEL_INFO, "[OK]\n");
+	return object_select(p, DFU_OBJECT_TYPE_DATA, firmware_selected);
+}
+
+/*
+ * The bootloader answers again. Setting the receipt notification interval
+ * restarts its packet count, then the data object is selected to find out
+ * what it holds, as when resuming an interrupted transfer.
+ */
+static int object_resynced(struct nrfu_ctx *p, struct dfu_msg_t *msg)
+{
+	dfu_log(p, NRFU_LOG_LEVEL_INFO, "[OK]\n");
+
+	msg->command.op_code = DFU_OPCODE_SET_PRN;
+	msg->payload_length = 0;
+	msg->payload_length += uint16_encode(p->receipt_notify_n, &msg->command.payload[msg->payload_length]);
+
+	dfu_log(p, NRFU_LOG_LEVEL_INFO, "Setting receipt notify to %u...\n", p->receipt_notify_n);
+	return dfu_request(p, object_prn_set);
+}
+
+/*
+ * Start over from a clean link: a leading END completes any frame the
+ * bootloader holds in part, partial input is dropped and so are frames
+ * that arrive until the ping with a new id is answered.
+ */
+static int object_resync(struct nrfu_ctx *p)
+{
+	struct dfu_msg_t *msg = &p->msg;
+
+	dfu_on_error(p, object_failed);
+
+	p->rx.head = 0;
+	p->rx.count = 0;
+	slip_decoder_init(&p->rx_dec, p->rx_frame, sizeof(p->rx_frame));
+	p->tx_break = 1;
+
+	msg->command.op_code = DFU_OPCODE_PING;
+	msg->payload_length = 0;
+	msg->command.payload[msg->payload_length++] = ++p->ping_id;
+
+	dfu_log(p, NRFU_LOG_LEVEL_INFO, "Sending ping %u...\n", p->ping_id);
+	return dfu_request(p, object_resynced);
+}
+
+/*
+ * A data object failed: try it again after a delay that doubles with each
+ * attempt, unless its retries are used up or the deadline has passed.
+ */
+static int object_failed(struct nrfu_ctx *p)
+{
+	unsigned int obj = p->fw_offset / p->fw_object_size;
+	unsigned int shift, delay;
+
+	if (obj != p->retry_object) {
+		p->retry_object = obj;
+		p->object_retries = 0;
+	}
+
+	if (p->object_retries >= p->opts.retries) {
+		if (p->opts.retries)
+			dfu_log(p, NRFU_LOG_LEVEL_ERROR, "Giving up on object %u after %u retries\n",
+				obj, p->object_retries);
+		return -1;
+	}
+
+	shift = p->object_retries < DFU_RETRY_BACKOFF_MAX ? p->object_retries : DFU_RETRY_BACKOFF_MAX;
+	delay = p->opts.retry_delay_ms << shift;
+
+	if (p->retry_deadline && monotonic_ns() + delay * 1000000ULL >= p->retry_deadline) {
+		dfu_log(p, NRFU_LOG_LEVEL_ERROR, "No time left to retry object %u\n", obj);
+		return -1;
+	}
+
+	p->object_retries++;
+	p->progress.retries++;
+	dfu_log(p, NRFU_LOG_LEVEL_INFO, "Retrying object %u in %u ms (%u of %u)\n", obj, delay,
+		p->object_retries, p->opts.retries);
+
+	/* late frames of the failed attempt are dropped meanwhile */
+	p->resyncing = 1;
+	engine_set_timer(p, object_resync, delay);
+	return 0;
+}
+
+static int object_executed(struct nrfu_ctx *p)
+{
+	p->fw_offset += p->fw_object_size;
+	return object_next(p);
+}
+
+static int object_streamed(struct nrfu_ctx *p)
+{
+	p->fw_crc = p->stream.crc;
+	phase_end(p, NRFU_PHASE_OBJECT, 0);
+
+	return data_execute(p, p->stream.end, object_executed);
+}
+
+static int object_created(struct nrfu_ctx *p, struct dfu_msg_t *msg)
+{
+	const struct image *img = job_image(p)->firmware;
+	uint32_t end = p->fw_offset + p->fw_object_size;
+
+	dfu_log(p, NRFU_LOG_LEVEL_INFO, "[OK]\n");
+
+	/* firmware_resumed() leaves fw_offset at an object boundary */
+	if (p->fw_cache)
+		return stream_start_cached(p, p->fw_cache, p->fw_offset / p->fw_object_size,
+					   p->fw_crc, object_streamed);
+
+	return stream_start(p, img, p->fw_offset, end < img->size ? end : img->size, p->fw_crc,
+			    object_streamed);
+}
+
+static int image_done(struct nrfu_ctx *p);
+
+/* Create, stream and execute the data object at fw_offset */
+static int object_next(struct nrfu_ctx *p)
+{
+	const struct image *img = job_image(p)->firmware;
+	uint32_t obj_size = p->fw_object_size;
+
+	if (p->fw_offset >= img->size) {
+		p->on_error = NULL;
+		phase_end(p, NRFU_PHASE_FIRMWARE, 0);
+		return image_done(p);
+	}
+
+	if (img->size - p->fw_offset < obj_size)
+		obj_size = img->size - p->fw_offset;
+
+	p->progress.object = p->fw_offset / p->fw_object_size;
+	dfu_on_error(p, object_failed);
+	phase_begin(p, NRFU_PHASE_OBJECT);
+
+	return object_create(p, DFU_OBJECT_TYPE_DATA, obj_size, object_created);
+}
+
+static int objects_begin(struct nrfu_ctx *p)
+{
+	const struct image *img = job_image(p)->firmware;
+
+	p->progress.image_bytes = p->fw_offset;
+
+	p->fw_cache = NULL;
+	if (p->opts.frame_cache) {
+		p->fw_cache = frame_cache_get(img, p->mtu, p->fw_object_size, p->opts.fill_mtu,
+					      p->opts.frame_cache_dir);
+		if (!p->fw_cache)
+			dfu_log(p, NRFU_LOG_LEVEL_INFO, "Frame cache not available: %s\n",
+				strerror(errno));
+	}
+
+	return object_next(p);
+}
+
+static int firmware_resumed(struct nrfu_ctx *p)
+{
+	p->fw_offset = p->stream.end;
+	p->fw_crc = p->stream.crc;
+	dfu_on_error(p, object_failed);
+
+	return data_execute(p, p->fw_offset, objects_begin);
+}
+
+/* Completing the partial object failed: drop it and start it over */
+static int firmware_resume_failed(struct nrfu_ctx *p)
+{
+	const struct image *img = job_image(p)->firmware;
+
+	p->progress.retries++;
+	p->fw_offset -= p->fw_offset % p->fw_object_size;
+	p->fw_crc = image_crc(img, p->fw_offset);
+	dfu_log(p, NRFU_LOG_LEVEL_INFO, "Failed to complete object, resuming at 0x%x\n",
+		p->fw_offset);
+
+	return objects_begin(p);
+}
+
+/*
+ * Continue an interrupted transfer from what the bootloader reports. Data
+ * is kept as far as its CRC matches the local image: a partially written
+ * object is completed and executed, a corrupted one is dropped. The objects
+ * then start at fw_offset, which is always at an object boundary.
+ */
+static int firmware_selected(struct nrfu_ctx *p, struct dfu_msg_t *msg)
+{
+	const struct image *img = job_image(p)->firmware;
+	struct object_select_response_t resp;
+	uint32_t remainder, length;
+
+	if (object_select_parse(p, msg, &resp) < 0)
+		return -1;
+
+	if (!resp.max_size) {
+		dfu_log(p, NRFU_LOG_LEVEL_ERROR, "Invalid maximum object size 0\n");
+		return -1;
+	}
+
+	p->fw_object_size = resp.max_size;
+	p->progress.n_objects = (img->size + (uint64_t)resp.max_size - 1) / resp.max_size;
+
+	if (resp.offset != 0)
+		dfu_log(p, NRFU_LOG_LEVEL_INFO, "Offset at 0x%x\n", resp.offset);
+
+	p->fw_offset = 0;
+	p->fw_crc = 0;
+
+	if (resp.offset == 0 || resp.offset > img->size)
+		return objects_begin(p);
+
+	p->fw_crc = image_crc(img, resp.offset);
+	remainder = resp.offset % resp.max_size;
+
+	if (p->fw_crc != resp.crc) {
+		/* the current object is corrupted, send it again; retries count themselves */
+		if (p->on_error != object_failed)
+			p->progress.retries++;
+		p->fw_offset = resp.offset - (remainder ? remainder : resp.max_size);
+		p->fw_crc = image_crc(img, p->fw_offset);
+		dfu_log(p, NRFU_LOG_LEVEL_INFO, "CRC mismatch at 0x%x, resuming at 0x%x\n",
+			resp.offset, p->fw_offset);
+		return objects_begin(p);
+	}
+
+	p->fw_offset = resp.offset;
+	dfu_log(p, NRFU_LOG_LEVEL_INFO, "Resuming at 0x%x\n", p->fw_offset);
+
+	if (!remainder || p->fw_offset == img->size)
+		return data_execute(p, p->fw_offset, objects_begin);
+
+	length = resp.max_size - remainder;
+	if (img->size - p->fw_offset < length)
+		length = img->size - p->fw_offset;
+
+	p->progress.image_bytes = p->fw_offset;
+	dfu_on_error(p, firmware_resume_failed);
+	return stream_start(p, img, p->fw_offset, p->fw_offset + length, p->fw_crc,
+			    firmware_resumed);
+}
+
+static int firmware_begin(struct nrfu_ctx *p)
+{
+	progress_image(p, NRFU_PHASE_FIRMWARE, job_image(p)->firmware);
+	phase_begin(p, NRFU_PHASE_FIRMWARE);
+
+	return object_select(p, DFU_OBJECT_TYPE_DATA, firmware_selected);
+}
+
+void nrfu_options_init(struct nrfu_options *opts)
+{
+	opts->log_level = NRFU_LOG_LEVEL_ERROR;
+	opts->baudrate = NRFU_DEFAULT_BAUDRATE;
+	opts->flow_control = NRFU_FLOW_CONTROL_RTSCTS;
+	opts->low_latency = 0;
+	opts->prn = 0;
+	opts->fill_mtu = 0;
+	opts->frame_cache = 0;
+	opts->frame_cache_dir = NULL;
+	opts->trace_size = 0;
+	opts->trace_file = NULL;
+	opts->capture_file = NULL;
+	opts->replay_full_speed = 0;
+	opts->response_timeout_ms = NRFU_RESPONSE_TIMEOUT_MS;
+	opts->response_timeout_min_ms = NRFU_RESPONSE_TIMEOUT_MIN_MS;
+	opts->flash_timeout_ms = NRFU_FLASH_TIMEOUT_MS;
+	opts->retries = NRFU_DEFAULT_RETRIES;
+	opts->retry_delay_ms = NRFU_RETRY_DELAY_MS;
+	opts->retry_deadline_ms = 0;
+}
+
+struct nrfu_ctx *nrfu_ctx_create(void)
+{
+	struct nrfu_ctx *ctx;
+
+	ctx = calloc(1, sizeof(*ctx));
+	if (!ctx)
+		return NULL;
+
+	/* large enough for any control message and the default MTU */
+	ctx->tx_buf_size = DFU_CONTROL_BYTES + 1;
+	ctx->tx_buf = malloc(ctx->tx_buf_size);
+	if (!ctx->tx_buf) {
+		free(ctx);
+		return NULL;
+	}
+
+	nrfu_options_init(&ctx->opts);
+	ctx->link.fd = -1;
+
+	return ctx;
+}
+
+void nrfu_ctx_destroy(struct nrfu_ctx *ctx)
+{
+	if (!ctx)
+		return;
+
+	nrfu_ctx_cancel(ctx);
+	trace_ring_free(&ctx->trace);
+	free(ctx->tx_buf);
+	free(ctx);
+}
+
+/* Checks shared with fleets, see context.h */
+const char *nrfu_options_check(const struct nrfu_options *opts)
+{
+	if (opts->prn > UINT16_MAX)
+		return "Receipt notify interval too large";
+
+	if (!opts->response_timeout_ms || opts->response_timeout_min_ms > opts->response_timeout_ms)
+		return "Invalid response timeouts";
+
+	return NULL;
+}
+
+int nrfu_ctx_set_options(struct nrfu_ctx *p, const struct nrfu_options *opts)
+{
+	const char *err;
+
+	if (!p || !opts)
+		return -1;
+
+	err = nrfu_options_check(opts);
+	if (err) {
+		dfu_log(p, NRFU_LOG_LEVEL_ERROR, "%s\n", err);
+		errno = EINVAL;
+		return -1;
+	}
+
+	p->opts = *opts;
+	return 0;
+}
+
+void nrfu_ctx_set_log_fn(struct nrfu_ctx *ctx, nrfu_log_fn fn, void *userdata)
+{
+	ctx->log_fn = fn;
+	ctx->log_data = userdata;
+}
+
+void nrfu_ctx_set_transport(struct nrfu_ctx *ctx, const struct nrfu_transport_ops *ops,
+			    void *userdata)
+{
+	ctx->transport_ops = ops;
+	ctx->transport_data = userdata;
+}
+
+int nrfu_ctx_write_trace(struct nrfu_ctx *p, const char *path)
+{
+	if (!p || !path || !p->tracing) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	return trace_ring_write(&p->trace, path);
+}
+
+void nrfu_ctx_set_progress_fn(struct nrfu_ctx *ctx, nrfu_progress_fn fn, void *userdata)
+{
+	ctx->progress_fn = fn;
+	ctx->progress_data = userdata;
+}
+
+int nrfu_ctx_get_rtt_stats(const struct nrfu_ctx *ctx, enum nrfu_rtt_kind kind,
+			   struct nrfu_rtt_stats *stats)
+{
+	if (!ctx || !stats || kind < 0 || kind >= NRFU_RTT_COUNT) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	*stats = ctx->rtt[kind];
+	return 0;
+}
+
+/* Open the port and negotiate the session parameters with the bootloader */
+static int link_open(struct nrfu_ctx *p, const char *devname)
+{
+	struct transport_config cfg = {
+		.baudrate = p->opts.baudrate,
+		.flow_control = p->opts.flow_control == NRFU_FLOW_CONTROL_RTSCTS,
+		.custom = p->transport_ops,
+		.custom_data = p->transport_data,
+	};
+
+	if (transport_open(&p->link, devname, &cfg) < 0)
+		return -1;
+
+	if (p->opts.low_latency && p->link.tty && serial_set_low_latency(p->link.fd) < 0)
+		dfu_log(p, NRFU_LOG_LEVEL_INFO, "Low latency mode not supported by \"%s\": %s\n",
+			devname, strerror(errno));
+
+	return 0;
+}
+
+/* "replay:<file>" plays a capture back instead of opening a port */
+static int replay_transport_open(struct nrfu_ctx *p, const char *devname)
+{
+	if (!p->replay) {
+		p->replay = replay_load(devname + strlen(REPLAY_PREFIX), p->opts.replay_full_speed);
+		if (!p->replay)
+			return -1;
+	}
+
+	return replay_open(p->replay, &p->link);
+}
+
+static int mtu_received(struct nrfu_ctx *p, struct dfu_msg_t *msg)
+{
+	if (msg->payload_length < sizeof(p->mtu)) {
+		dfu_log(p, NRFU_LOG_LEVEL_ERROR, "Response too short for MTU!\n");
+		dfu_log(p, NRFU_LOG_LEVEL_ERROR, "Received: %lu Expected: %lu!\n", msg->payload_length, sizeof(p->mtu));
+		return -1;
+	}
+
+	p->mtu = uint16_decode(msg->response.payload);
+	if (p->mtu < DFU_MTU_MIN) {
+		dfu_log(p, NRFU_LOG_LEVEL_ERROR, "MTU too small: %u\n", p->mtu);
+		return -1;
+	}
+
+	if (p->mtu > p->tx_buf_size) {
+		uint8_t *buf = realloc(p->tx_buf, p->mtu);
+
+		if (!buf) {
+			dfu_log(p, NRFU_LOG_LEVEL_ERROR, "Failed to allocate frame for MTU %u\n", p->mtu);
+			return -1;
+		}
+		p->tx_buf = buf;
+		p->tx_buf_size = p->mtu;
+	}
+
+	dfu_log(p, NRFU_LOG_LEVEL_INFO, "[OK]: MTU is %u\n", p->mtu);
+	phase_end(p, NRFU_PHASE_MTU, 0);
+
+	/* the session is open, a reconnect is complete */
+	p->on_error = NULL;
+	return image_begin(p);
+}
+
+static int prn_set(struct nrfu_ctx *p, struct dfu_msg_t *msg)
+{
+	dfu_log(p, NRFU_LOG_LEVEL_INFO, "[OK]\n");
+	phase_end(p, NRFU_PHASE_PRN, 0);
+
+	phase_begin(p, NRFU_PHASE_MTU);
+	msg->command.op_code = DFU_OPCODE_GET_MTU;
+	msg->payload_length = 0;
+
+	dfu_log(p, NRFU_LOG_LEVEL_INFO, "Getting MTU...\n");
+	return dfu_request(p, mtu_received);
+}
+
+static int ping_received(struct nrfu_ctx *p, struct dfu_msg_t *msg)
+{
+	dfu_log(p, NRFU_LOG_LEVEL_INFO, "[OK]\n");
+	phase_end(p, NRFU_PHASE_PING, 0);
+
+	phase_begin(p, NRFU_PHASE_PRN);
+	msg->command.op_code = DFU_OPCODE_SET_PRN;
+	msg->payload_length = 0;
+	msg->payload_length += uint16_encode(p->receipt_notify_n, &msg->command.payload[msg->payload_length]);
+
+	dfu_log(p, NRFU_LOG_LEVEL_INFO, "Setting receipt notify to %u...\n", p->receipt_notify_n);
+	return dfu_request(p, prn_set);
+}
+
+static int session_connected(struct nrfu_ctx *p);
+
+/*
+ * Open the link, a network connect is completed by engine_run() before
+ * the session continues.
+ */
+static int session_open(struct nrfu_ctx *p)
+{
+	const char *devname = p->job.devname;
+	int ret;
+
+	p->rx.head = 0;
+	p->rx.count = 0;
+	slip_decoder_init(&p->rx_dec, p->rx_frame, sizeof(p->rx_frame));
+
+	phase_begin(p, NRFU_PHASE_CONNECT);
+	if (!strncmp(devname, REPLAY_PREFIX, strlen(REPLAY_PREFIX)))
+		ret = replay_transport_open(p, devname);
+	else
+		ret = link_open(p, devname);
+	if (ret < 0) {
+		dfu_log(p, NRFU_LOG_LEVEL_ERROR, "Failed to initialize \"%s\": %s\n",
+			devname, strerror(errno));
+		return -1;
+	}
+
+	if (p->link.connecting) {
+		p->on_connect = session_connected;
+		p->deadline = monotonic_ns() + DFU_CONNECT_TIMEOUT_MS * 1000000ULL;
+		return 0;
+	}
+
+	return session_connected(p);
+}
+
+/* The link is up, start talking to the bootloader */
+static int session_connected(struct nrfu_ctx *p)
+{
+	struct dfu_msg_t *msg = &p->msg;
+
+	if (p->capture)
+		capture_add(p->capture, CAPTURE_OPEN, NULL, 0);
+	phase_end(p, NRFU_PHASE_CONNECT, 0);
+
+	p->acked_tx_bytes = p->progress.wire_tx_bytes;
+
+	p->receipt_notify_n = p->opts.prn;
+
+	phase_begin(p, NRFU_PHASE_PING);
+	msg->command.op_code = DFU_OPCODE_PING;
+	msg->payload_length = 0;
+	msg->command.payload[msg->payload_length++] = p->ping_id = 0x01;
+
+	dfu_log(p, NRFU_LOG_LEVEL_INFO, "Sending ping...\n");
+	return dfu_request(p, ping_received);
+}
+
+static int session_begin(struct nrfu_ctx *p)
+{
+	size_t trace_size = p->opts.trace_size ? p->opts.trace_size : NRFU_TRACE_DEFAULT_SIZE;
+
+	memset(&p->progress, 0, sizeof(p->progress));
+	memset(p->rtt, 0, sizeof(p->rtt));
+	p->last_update = 0;
+	p->retry_object = UINT_MAX;
+	p->object_retries = 0;
+	p->retry_deadline = 0;
+	if (p->opts.retry_deadline_ms)
+		p->retry_deadline = monotonic_ns() + p->opts.retry_deadline_ms * 1000000ULL;
+	p->resyncing = 0;
+	p->tx_break = 0;
+	p->open_phases = 0;
+
+	p->tracing = p->opts.trace_size || p->opts.trace_file;
+	if (p->tracing && trace_ring_init(&p->trace, trace_size) < 0) {
+		dfu_log(p, NRFU_LOG_LEVEL_ERROR, "Failed to set up tracing: %s\n", strerror(errno));
+		p->tracing = 0;
+		return -1;
+	}
+
+	if (p->opts.capture_file) {
+		p->capture = capture_open(p->opts.capture_file);
+		if (!p->capture) {
+			dfu_log(p, NRFU_LOG_LEVEL_ERROR, "Failed to create capture %s: %s\n",
+				p->opts.capture_file, strerror(errno));
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+static void session_end(struct nrfu_ctx *p)
+{
+	if (p->tracing && p->opts.trace_file && trace_ring_write(&p->trace, p->opts.trace_file) < 0)
+		dfu_log(p, NRFU_LOG_LEVEL_ERROR, "Failed to write trace %s: %s\n",
+			p->opts.trace_file, strerror(errno));
+
+	if (capture_close(p->capture) < 0)
+		dfu_log(p, NRFU_LOG_LEVEL_ERROR, "Failed to write capture %s: %s\n",
+			p->opts.capture_file, strerror(errno));
+	p->capture = NULL;
+
+	replay_free(p->replay);
+	p->replay = NULL;
+}
+
+static void session_close(struct nrfu_ctx *p)
+{
+	if (p->link.ops)
+		p->link.ops->close(&p->link);
+	p->link.ops = NULL;
+	p->link.fd = -1;
+}
+
+/* Continue with fn in ms milliseconds */
+static void engine_set_timer(struct nrfu_ctx *p, dfu_step_fn fn, unsigned int ms)
+{
+	p->on_timer = fn;
+	p->deadline = monotonic_ns() + ms * 1000000ULL;
+}
+
+static int session_reconnect(struct nrfu_ctx *p);
+
+/*
+ * After a SoftDevice or bootloader update the device resets into the new
+ * bootloader, and a USB serial port disappears meanwhile. Keep trying to
+ * open a session until DFU_RECONNECT_TIMEOUT_MS have passed.
+ */
+static int session_reconnect_failed(struct nrfu_ctx *p)
+{
+	session_close(p);
+	p->progress.retries++;
+
+	p->reconnect_waited += DFU_RECONNECT_INTERVAL_MS;
+	if (p->reconnect_waited >= DFU_RECONNECT_TIMEOUT_MS) {
+		dfu_log(p, NRFU_LOG_LEVEL_ERROR, "Bootloader did not come back on \"%s\"\n",
+			p->job.devname);
+		return -1;
+	}
 
-	if (send_firmware(&priv, firmware) < 0)
+	dfu_log(p, NRFU_LOG_LEVEL_INFO, "Waiting for the bootloader on \"%s\"...\n", p->job.devname);
+	engine_set_timer(p, session_reconnect, DFU_RECONNECT_INTERVAL_MS);
+	return 0;
+}
+
+static int session_reconnect(struct nrfu_ctx *p)
+{
+	dfu_on_error(p, session_reconnect_failed);
+	return session_open(p);
+}
+
+static int image_done(struct nrfu_ctx *p)
+{
+	if (++p->job.current == p->job.n_images)
+		return engine_finish(p, 0);
+
+	session_close(p);
+	p->reconnect_waited = 0;
+
+	dfu_log(p, NRFU_LOG_LEVEL_INFO, "Waiting for the bootloader on \"%s\"...\n", p->job.devname);
+	engine_set_timer(p, session_reconnect, DFU_RECONNECT_INTERVAL_MS);
+	return 0;
+}
+
+/* Any wait of the engine is over */
+static void engine_clear_wait(struct nrfu_ctx *p)
+{
+	p->tx_left = 0;
+	p->on_response = NULL;
+	p->on_timer = NULL;
+	p->on_connect = NULL;
+	p->stream.active = 0;
+	p->deadline = 0;
+	p->events = 0;
+	p->yield = 0;
+}
+
+/* End the phases that are open apart from those in keep as failed */
+static void phases_fail(struct nrfu_ctx *p, unsigned int keep)
+{
+	int phase;
+
+	for (phase = NRFU_PHASE_COUNT - 1; phase >= 0; phase--) {
+		if (!(p->open_phases & ~keep & (1U << phase)))
+			continue;
+
+		if (phase == NRFU_PHASE_INIT_PACKET)
+			dfu_log(p, NRFU_LOG_LEVEL_ERROR, "Failed to send init-packet \"%s\"\n",
+				job_image(p)->init_packet->name);
+		else if (phase == NRFU_PHASE_FIRMWARE)
+			dfu_log(p, NRFU_LOG_LEVEL_ERROR, "Failed to send firmware \"%s\"\n",
+				job_image(p)->firmware->name);
+
+		phase_end(p, phase, -1);
+	}
+}
+
+static void job_release(struct dfu_job *job)
+{
+	if (job->pkg.n_images)
+		package_close(&job->pkg);
+	if (job->owns_images) {
+		image_release(&job->firmware);
+		image_release(&job->init_packet);
+	}
+	free(job->devname);
+	memset(job, 0, sizeof(*job));
+}
+
+static int engine_finish(struct nrfu_ctx *p, int result)
+{
+	engine_clear_wait(p);
+	session_close(p);
+	session_end(p);
+	job_release(&p->job);
+
+	p->state = result < 0 ? DFU_ENGINE_FAILED : DFU_ENGINE_DONE;
+	return result;
+}
+
+/*
+ * A step failed: continue with the error step if one is set, otherwise
+ * the session is over. Returns 0 if it goes on, -1 if it failed.
+ */
+static int engine_fail(struct nrfu_ctx *p)
+{
+	dfu_step_fn fn;
+
+	engine_clear_wait(p);
+
+	while ((fn = p->on_error)) {
+		p->on_error = NULL;
+		phases_fail(p, p->error_phases);
+		if (fn(p) == 0)
+			return 0;
+		engine_clear_wait(p);
+	}
+
+	phases_fail(p, 0);
+	return engine_finish(p, -1);
+}
+
+static int engine_waits_for_input(const struct nrfu_ctx *p)
+{
+	return p->on_response || (p->stream.active && p->stream.prn.pending);
+}
+
+/*
+ * Advance the session as far as possible without blocking. Returns
+ * NRFU_IN_PROGRESS with events and deadline telling what to wait for, 0
+ * once the session is complete or -1 when it failed.
+ */
+static int engine_run(struct nrfu_ctx *p)
+{
+	int timed_out = p->timed_out;
+	dfu_step_fn fn;
+	int ret;
+
+	p->turn_tx_bytes = p->progress.wire_tx_bytes;
+	p->yield = 0;
+	p->timed_out = 0;
+
+	while (p->state == DFU_ENGINE_RUNNING) {
+		p->events = 0;
+
+		if (p->cancel_pending)
+			break;
+
+		if (p->on_connect) {
+			ret = transport_connect(&p->link);
+			if (ret > 0 && monotonic_ns() < p->deadline) {
+				p->events = POLLOUT;
+				return NRFU_IN_PROGRESS;
+			}
+			if (ret > 0)
+				errno = ETIMEDOUT;
+
+			fn = p->on_connect;
+			p->on_connect = NULL;
+			p->deadline = 0;
+			if (ret) {
+				dfu_log(p, NRFU_LOG_LEVEL_ERROR, "Failed to connect to \"%s\": %s\n",
+					p->job.devname, strerror(errno));
+				engine_fail(p);
+			} else if (fn(p) < 0) {
+				engine_fail(p);
+			}
+			continue;
+		}
+
+		if (p->link.ops) {
+			ret = dfu_flush(p);
+			if (ret > 0) {
+				p->events = POLLOUT;
+				return NRFU_IN_PROGRESS;
+			}
+
+			if (ret == 0)
+				ret = dfu_input(p);
+			if (ret < 0) {
+				engine_fail(p);
+				continue;
+			}
+			/* handled frames may have led anywhere */
+			if (ret > 0 || p->tx_left)
+				continue;
+		}
+
+		if (p->on_timer) {
+			if (monotonic_ns() < p->deadline)
+				return NRFU_IN_PROGRESS;
+
+			fn = p->on_timer;
+			p->on_timer = NULL;
+			p->deadline = 0;
+			if (fn(p) < 0)
+				engine_fail(p);
+			continue;
+		}
+
+		if (p->stream.active) {
+			ret = stream_pump(p);
+			if (ret < 0) {
+				engine_fail(p);
+				continue;
+			}
+			if (p->yield)
+				return NRFU_IN_PROGRESS;
+			if (ret == 0)
+				continue;
+		}
+
+		if (!engine_waits_for_input(p)) {
+			/* a step that neither sent a request nor started a stream */
+			dfu_log(p, NRFU_LOG_LEVEL_ERROR, "Session stalled\n");
+			engine_fail(p);
+			continue;
+		}
+
+		if (!p->deadline)
+			p->deadline = prn_deadline(p);
+
+		if (timed_out || monotonic_ns() >= p->deadline) {
+			timed_out = 0;
+			if (p->on_response) {
+				p->rtt[p->request_kind].timeouts++;
+				dfu_log(p, NRFU_LOG_LEVEL_ERROR, "Timeout waiting for response to 0x%02x\n",
+					p->response_opcode);
+			} else {
+				p->rtt[NRFU_RTT_RECEIPT].timeouts++;
+				dfu_log(p, NRFU_LOG_LEVEL_ERROR, "Timeout waiting for receipt notification\n");
+			}
+			engine_fail(p);
+			continue;
+		}
+
+		p->events = POLLIN;
+		return NRFU_IN_PROGRESS;
+	}
+
+	return p->state == DFU_ENGINE_DONE ? 0 : -1;
+}
+
+/* Start the session described by p->job, which is released when it ends */
+static int engine_start(struct nrfu_ctx *p)
+{
+	if (session_begin(p) < 0) {
+		session_end(p);
+		job_release(&p->job);
+		return -1;
+	}
+
+	p->state = DFU_ENGINE_RUNNING;
+	p->cancel_pending = 0;
+	p->on_error = NULL;
+	engine_clear_wait(p);
+	/* the port is opened by the first nrfu_ctx_process() */
+	engine_set_timer(p, session_open, 0);
+
+	return 0;
+}
+
+static int job_begin(struct nrfu_ctx *p, const char *devname)
+{
+	if (p->state == DFU_ENGINE_RUNNING) {
+		dfu_log(p, NRFU_LOG_LEVEL_ERROR, "A session is already running\n");
+		errno = EBUSY;
+		return -1;
+	}
+
+	memset(&p->job, 0, sizeof(p->job));
+	p->job.devname = strdup(devname);
+	if (!p->job.devname)
+		return -1;
+
+	p->job.n_images = 1;
+	return 0;
+}
+
+/* Start a session with images that are already loaded, see context.h */
+int nrfu_ctx_start_images(struct nrfu_ctx *p, const char *devname,
+			  const struct image *init_packet, const struct image *firmware)
+{
+	if (!p || !devname || !init_packet || !firmware)
+		return -1;
+
+	if (job_begin(p, devname) < 0)
+		return -1;
+
+	p->job.images[0].init_packet = init_packet;
+	p->job.images[0].firmware = firmware;
+
+	return engine_start(p);
+}
+
+int nrfu_ctx_start(struct nrfu_ctx *p, const char *devname, const char *init_packet,
+		   const char *firmware)
+{
+	struct dfu_job *job;
+
+	if (!p || !devname || !init_packet || !firmware)
+		return -1;
+
+	if (job_begin(p, devname) < 0)
+		return -1;
+	job = &p->job;
+
+	if (image_load_file(&job->init_packet, init_packet) < 0) {
+		dfu_log(p, NRFU_LOG_LEVEL_ERROR, "Failed to open %s: %s\n", init_packet, strerror(errno));
+		goto err_out;
+	}
+
+	if (image_load_file(&job->firmware, firmware) < 0) {
+		dfu_log(p, NRFU_LOG_LEVEL_ERROR, "Failed to open %s: %s\n", firmware, strerror(errno));
+		image_release(&job->init_packet);
+		goto err_out;
+	}
+
+	job->owns_images = 1;
+	job->images[0].init_packet = &job->init_packet;
+	job->images[0].firmware = &job->firmware;
+
+	return engine_start(p);
+
+err_out:
+	job_release(job);
+	return -1;
+}
+
+int nrfu_ctx_start_mem(struct nrfu_ctx *p, const char *devname,
+		       const void *init_packet, size_t init_packet_size,
+		       const void *firmware, size_t firmware_size)
+{
+	struct dfu_job *job;
+
+	if (!p || !devname || !init_packet || !firmware)
+		return -1;
+
+	if (job_begin(p, devname) < 0)
+		return -1;
+	job = &p->job;
+
+	if (image_from_memory(&job->init_packet, "init-packet", init_packet, init_packet_size) < 0) {
+		dfu_log(p, NRFU_LOG_LEVEL_ERROR, "Invalid init-packet: %s\n", strerror(errno));
+		goto err_out;
+	}
+
+	if (image_from_memory(&job->firmware, "firmware", firmware, firmware_size) < 0) {
+		dfu_log(p, NRFU_LOG_LEVEL_ERROR, "Invalid firmware: %s\n", strerror(errno));
+		image_release(&job->init_packet);
 		goto err_out;
+	}
+
+	job->owns_images = 1;
+	job->images[0].init_packet = &job->init_packet;
+	job->images[0].firmware = &job->firmware;
+
+	return engine_start(p);
 
-	ret = 0;
 err_out:
-	if (priv.serial_fd >= 0)
-		close(priv.serial_fd);
+	job_release(job);
+	return -1;
+}
+
+int nrfu_ctx_start_package(struct nrfu_ctx *p, const char *devname, const char *package)
+{
+	struct dfu_job *job;
+	unsigned int i;
+
+	if (!p || !devname || !package)
+		return -1;
+
+	if (job_begin(p, devname) < 0)
+		return -1;
+	job = &p->job;
+
+	if (package_open(&job->pkg, package) < 0) {
+		dfu_log(p, NRFU_LOG_LEVEL_ERROR, "Failed to open package %s: %s\n", package,
+			strerror(errno));
+		job_release(job);
+		return -1;
+	}
+
+	job->n_images = job->pkg.n_images;
+	for (i = 0; i < job->n_images; i++) {
+		job->images[i].type = job->pkg.images[i].type;
+		job->images[i].init_packet = &job->pkg.images[i].init_packet;
+		job->images[i].firmware = &job->pkg.images[i].firmware;
+	}
+
+	return engine_start(p);
+}
+
+int nrfu_ctx_process(struct nrfu_ctx *p)
+{
+	int ret;
+
+	if (!p)
+		return -1;
+
+	if (p->state != DFU_ENGINE_RUNNING)
+		return p->state == DFU_ENGINE_DONE ? 0 : -1;
+
+	p->in_engine = 1;
+	ret = engine_run(p);
+	p->in_engine = 0;
+
+	/* requested by a progress or log handler during the run */
+	if (p->cancel_pending && p->state == DFU_ENGINE_RUNNING) {
+		nrfu_ctx_cancel(p);
+		ret = -1;
+	}
+	p->cancel_pending = 0;
+
+	return ret;
+}
+
+int nrfu_ctx_get_fd(const struct nrfu_ctx *p)
+{
+	return p && p->state == DFU_ENGINE_RUNNING && p->link.ops ? p->link.fd : -1;
+}
+
+int nrfu_ctx_poll_events(const struct nrfu_ctx *p)
+{
+	return p && p->state == DFU_ENGINE_RUNNING ? p->events : 0;
+}
+
+/* Milliseconds until the deadline, rounded up; -1 if there is none */
+static int engine_timeout(const struct nrfu_ctx *p)
+{
+	uint64_t now;
+
+	if (p->state != DFU_ENGINE_RUNNING || p->yield)
+		return 0;
+
+	if (!p->deadline)
+		return -1;
+
+	now = monotonic_ns();
+	if (now >= p->deadline)
+		return 0;
+
+	return (p->deadline - now + 999999) / 1000000;
+}
+
+int nrfu_ctx_get_timeout(const struct nrfu_ctx *p)
+{
+	int timeout;
+
+	if (!p)
+		return 0;
+
+	timeout = engine_timeout(p);
+
+	/* input of a transport without a descriptor can only be polled for */
+	if (p->events & POLLIN && nrfu_ctx_get_fd(p) < 0 &&
+	    (timeout < 0 || timeout > DFU_POLL_INTERVAL_MS))
+		timeout = DFU_POLL_INTERVAL_MS;
+
+	return timeout;
+}
+
+void nrfu_ctx_cancel(struct nrfu_ctx *p)
+{
+	if (!p || p->state != DFU_ENGINE_RUNNING)
+		return;
+
+	/* the step that called the handler still runs, end the session after it */
+	if (p->in_engine) {
+		p->cancel_pending = 1;
+		return;
+	}
+
+	dfu_log(p, NRFU_LOG_LEVEL_INFO, "Session cancelled\n");
+	p->on_error = NULL;
+	engine_clear_wait(p);
+	phases_fail(p, 0);
+	engine_finish(p, -1);
+}
+
+/*
+ * Block until the engine has something to do. A transport without a
+ * descriptor, e.g. a replay, waits inside its receive() instead.
+ */
+static void engine_wait(struct nrfu_ctx *p)
+{
+	struct pollfd pfd = { .fd = nrfu_ctx_get_fd(p), .events = p->events };
+	int timeout = engine_timeout(p);
+
+	if (!timeout)
+		return;
+
+	if (pfd.fd < 0 && p->link.ops && p->events & POLLIN) {
+		if (dfu_read(p, timeout) < 0) {
+			p->in_engine = 1;
+			engine_fail(p);
+			p->in_engine = 0;
+		}
+		return;
+	}
+
+	if (pfd.fd < 0)
+		pfd.events = 0;
+
+	poll(&pfd, pfd.fd < 0 ? 0 : 1, timeout);
+}
+
+/* Drive the session started by one of the nrfu_ctx_start*() to its end */
+static int engine_complete(struct nrfu_ctx *p)
+{
+	int ret;
+
+	while ((ret = nrfu_ctx_process(p)) == NRFU_IN_PROGRESS)
+		engine_wait(p);
+
+	return ret;
+}
+
+/* Run a session with images that are already loaded, see context.h */
+int nrfu_ctx_run_images(struct nrfu_ctx *p, const char *devname,
+			const struct image *init_packet, const struct image *firmware)
+{
+	if (nrfu_ctx_start_images(p, devname, init_packet, firmware) < 0)
+		return -1;
+
+	return engine_complete(p);
+}
+
+int nrfu_ctx_run_package(struct nrfu_ctx *p, const char *devname, const char *package)
+{
+	if (nrfu_ctx_start_package(p, devname, package) < 0)
+		return -1;
+
+	return engine_complete(p);
+}
+
+int nrfu_ctx_run(struct nrfu_ctx *p, const char *devname, const char *init_packet,
+		 const char *firmware)
+{
+	if (nrfu_ctx_start(p, devname, init_packet, firmware) < 0)
+		return -1;
+
+	return engine_complete(p);
+}
+
+int nrfu_ctx_run_mem(struct nrfu_ctx *p, const char *devname,
+		     const void *init_packet, size_t init_packet_size,
+		     const void *firmware, size_t firmware_size)
+{
+	if (nrfu_ctx_start_mem(p, devname, init_packet, init_packet_size,
+			       firmware, firmware_size) < 0)
+		return -1;
+
+	return engine_complete(p);
+}
+
+int nrfu_update_opts(const char *devname, const char *init_packet, const char *firmware,
+		     const struct nrfu_options *opts)
+{
+	struct nrfu_ctx *ctx;
+	int ret = -1;
+
+	if (!devname || !init_packet || !firmware || !opts)
+		return -1;
+
+	ctx = nrfu_ctx_create();
+	if (!ctx)
+		return -1;
+
+	if (nrfu_ctx_set_options(ctx, opts) == 0)
+		ret = nrfu_ctx_run(ctx, devname, init_packet, firmware);
+
+	nrfu_ctx_destroy(ctx);
+	return ret;
+}
+
+int nrfu_update_package(const char *devname, const char *package,
+			const struct nrfu_options *opts)
+{
+	struct nrfu_ctx *ctx;
+	int ret = -1;
+
+	if (!devname || !package || !opts)
+		return -1;
+
+	ctx = nrfu_ctx_create();
+	if (!ctx)
+		return -1;
+
+	if (nrfu_ctx_set_options(ctx, opts) == 0)
+		ret = nrfu_ctx_run_package(ctx, devname, package);
+
+	nrfu_ctx_destroy(ctx);
+	return ret;
+}
+
+int nrfu_update_mem(const char *devname, const void *init_packet, size_t init_packet_size,
+		    const void *firmware, size_t firmware_size, const struct nrfu_options *opts)
+{
+	struct nrfu_ctx *ctx;
+	int ret = -1;
+
+	if (!devname || !init_packet || !firmware || !opts)
+		return -1;
+
+	ctx = nrfu_ctx_create();
+	if (!ctx)
+		return -1;
+
+	if (nrfu_ctx_set_options(ctx, opts) == 0)
+		ret = nrfu_ctx_run_mem(ctx, devname, init_packet, init_packet_size,
+				       firmware, firmware_size);
 
+	nrfu_ctx_destroy(ctx);
 	return ret;
 }
+
+int nrfu_update(const char *devname, const char *init_packet, const char *firmware, enum nrfu_log_level log_level)
+{
+	struct nrfu_options opts;
+
+	nrfu_options_init(&opts);
+	opts.log_level = log_level;
+
+	return nrfu_update_opts(devname, init_packet, firmware, &opts);
+}
@@ -0,0 +1,416 @@
+// SPDX-License-Identifier: BSD-3-Clause
+/*
+ * Copyright (C) 2022 Leica Geosystems AG
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <zlib.h>
+
+#include "package.h"
+#include "toolbox.h"
+
+#define ZIP_LOCAL_HEADER_SIG	0x04034b50
+#define ZIP_CENTRAL_HEADER_SIG	0x02014b50
+#define ZIP_END_OF_CD_SIG	0x06054b50
+#define ZIP_LOCAL_HEADER_SIZE	30
+#define ZIP_CENTRAL_HEADER_SIZE	46
+#define ZIP_END_OF_CD_SIZE	22
+#define ZIP_FLAG_ENCRYPTED	0x0001
+#define ZIP_METHOD_STORED	0
+#define ZIP_METHOD_DEFLATED	8
+
+#define MANIFEST_NAME		"manifest.json"
+#define MANIFEST_MAX_DEPTH	16
+#define MANIFEST_KEY_SIZE	32
+#define MANIFEST_NAME_SIZE	256
+
+/* in the order nrfutil sends them */
+static const char *package_types[PACKAGE_MAX_IMAGES] = {
+	"softdevice_bootloader",
+	"softdevice",
+	"bootloader",
+	"application",
+};
+
+struct zip_member {
+	uint16_t flags;
+	uint16_t method;
+	uint32_t crc;
+	uint32_t compressed_size;
+	uint32_t size;
+	uint32_t local_offset;
+};
+
+/*
+ * Single pass over the manifest without building a document: only the
+ * string values at manifest.<type>.bin_file and .dat_file are kept.
+ */
+struct manifest_parser {
+	const char *pos;
+	const char *end;
+	char keys[MANIFEST_MAX_DEPTH][MANIFEST_KEY_SIZE];
+	struct {
+		char bin_file[MANIFEST_NAME_SIZE];
+		char dat_file[MANIFEST_NAME_SIZE];
+	} images[PACKAGE_MAX_IMAGES];
+};
+
+static void json_skip_ws(struct manifest_parser *mp)
+{
+	while (mp->pos < mp->end &&
+	       (*mp->pos == ' ' || *mp->pos == '\t' || *mp->pos == '\n' || *mp->pos == '\r'))
+		mp->pos++;
+}
+
+/*
+ * Parse a string into out, or skip it if out is NULL. A string that does
+ * not fit is returned empty, so it cannot match any name.
+ */
+static int json_string(struct manifest_parser *mp, char *out, size_t size)
+{
+	size_t n = 0;
+	int truncated = 0;
+	char c;
+
+	if (mp->pos >= mp->end || *mp->pos++ != '"')
+		return -1;
+
+	while (mp->pos < mp->end) {
+		c = *mp->pos++;
+		if (c == '"') {
+			if (out)
+				out[truncated ? 0 : n] = '\0';
+			return 0;
+		}
+
+		if (c == '\\') {
+			if (mp->pos >= mp->end)
+				return -1;
+			c = *mp->pos++;
+			switch (c) {
+			case 'b': c = '\b'; break;
+			case 'f': c = '\f'; break;
+			case 'n': c = '\n'; break;
+			case 'r': c = '\r'; break;
+			case 't': c = '\t'; break;
+			case 'u':
+				/* file names are ASCII, anything else cannot match */
+				if (mp->end - mp->pos < 4)
+					return -1;
+				mp->pos += 4;
+				truncated = 1;
+				break;
+			}
+		}
+
+		if (out && n + 1 < size)
+			out[n++] = c;
+		else
+			truncated = 1;
+	}
+
+	return -1;
+}
+
+static char *manifest_target(struct manifest_parser *mp, int depth)
+{
+	int i;
+
+	if (depth != 3 || strcmp(mp->keys[0], "manifest"))
+		return NULL;
+
+	for (i = 0; i < PACKAGE_MAX_IMAGES; i++) {
+		if (strcmp(mp->keys[1], package_types[i]))
+			continue;
+		if (!strcmp(mp->keys[2], "bin_file"))
+			return mp->images[i].bin_file;
+		if (!strcmp(mp->keys[2], "dat_file"))
+			return mp->images[i].dat_file;
+	}
+
+	return NULL;
+}
+
+static int json_value(struct manifest_parser *mp, int depth)
+{
+	char *target;
+	char open;
+
+	if (depth >= MANIFEST_MAX_DEPTH)
+		return -1;
+
+	json_skip_ws(mp);
+	if (mp->pos >= mp->end)
+		return -1;
+
+	switch (*mp->pos) {
+	case '{':
+	case '[':
+		open = *mp->pos++;
+		json_skip_ws(mp);
+		if (mp->pos < mp->end && *mp->pos == (open == '{' ? '}' : ']')) {
+			mp->pos++;
+			return 0;
+		}
+
+		for (;;) {
+			mp->keys[depth][0] = '\0';
+			if (open == '{') {
+				json_skip_ws(mp);
+				if (json_string(mp, mp->keys[depth], MANIFEST_KEY_SIZE))
+					return -1;
+				json_skip_ws(mp);
+				if (mp->pos >= mp->end || *mp->pos++ != ':')
+					return -1;
+			}
+
+			if (json_value(mp, depth + 1))
+				return -1;
+
+			json_skip_ws(mp);
+			if (mp->pos >= mp->end)
+				return -1;
+			if (*mp->pos == ',') {
+				mp->pos++;
+				continue;
+			}
+			if (*mp->pos++ != (open == '{' ? '}' : ']'))
+				return -1;
+			return 0;
+		}
+	case '"':
+		target = manifest_target(mp, depth);
+		return json_string(mp, target, MANIFEST_NAME_SIZE);
+	default:
+		/* numbers, true, false and null */
+		target = (char *)mp->pos;
+		while (mp->pos < mp->end &&
+		       ((*mp->pos >= '0' && *mp->pos <= '9') || (*mp->pos >= 'a' && *mp->pos <= 'z') ||
+			*mp->pos == '-' || *mp->pos == '+' || *mp->pos == '.' || *mp->pos == 'E'))
+			mp->pos++;
+		return mp->pos > target ? 0 : -1;
+	}
+}
+
+static int zip_find(const struct image *zip, const char *name, struct zip_member *member)
+{
+	const uint8_t *eocd = NULL, *cd, *end;
+	size_t name_length = strlen(name);
+	uint32_t i, n_entries, cd_size, cd_offset;
+	int64_t pos;
+
+	/* the end of central directory record is followed by a comment of up to 64k */
+	for (pos = (int64_t)zip->size - ZIP_END_OF_CD_SIZE;
+	     pos >= 0 && pos >= (int64_t)zip->size - ZIP_END_OF_CD_SIZE - UINT16_MAX; pos--) {
+		if (uint32_decode(&zip->data[pos]) == ZIP_END_OF_CD_SIG) {
+			eocd = &zip->data[pos];
+			break;
+		}
+	}
+	if (!eocd)
+		goto invalid;
+
+	n_entries = uint16_decode(&eocd[10]);
+	cd_size = uint32_decode(&eocd[12]);
+	cd_offset = uint32_decode(&eocd[16]);
+	if (cd_offset > zip->size || cd_size > zip->size - cd_offset)
+		goto invalid;
+
+	cd = &zip->data[cd_offset];
+	end = cd + cd_size;
+	for (i = 0; i < n_entries; i++) {
+		uint16_t n, extra, comment;
+
+		if (end - cd < ZIP_CENTRAL_HEADER_SIZE || uint32_decode(cd) != ZIP_CENTRAL_HEADER_SIG)
+			goto invalid;
+
+		n = uint16_decode(&cd[28]);
+		extra = uint16_decode(&cd[30]);
+		comment = uint16_decode(&cd[32]);
+		if (end - cd < ZIP_CENTRAL_HEADER_SIZE + n + extra + comment)
+			goto invalid;
+
+		if (n == name_length && !memcmp(&cd[ZIP_CENTRAL_HEADER_SIZE], name, n)) {
+			member->flags = uint16_decode(&cd[8]);
+			member->method = uint16_decode(&cd[10]);
+			member->crc = uint32_decode(&cd[16]);
+			member->compressed_size = uint32_decode(&cd[20]);
+			member->size = uint32_decode(&cd[24]);
+			member->local_offset = uint32_decode(&cd[42]);
+			return 0;
+		}
+
+		cd += ZIP_CENTRAL_HEADER_SIZE + n + extra + comment;
+	}
+
+	errno = ENOENT;
+	return -1;
+
+invalid:
+	errno = EBADMSG;
+	return -1;
+}
+
+static int zip_inflate(const uint8_t *data, uint32_t length, uint8_t *out, uint32_t size)
+{
+	z_stream zs;
+	int ret;
+
+	memset(&zs, 0, sizeof(zs));
+	if (inflateInit2(&zs, -MAX_WBITS) != Z_OK) {
+		errno = ENOMEM;
+		return -1;
+	}
+
+	zs.next_in = (Bytef *)data;
+	zs.avail_in = length;
+	zs.next_out = out;
+	zs.avail_out = size;
+
+	ret = inflate(&zs, Z_FINISH);
+	inflateEnd(&zs);
+
+	if (ret != Z_STREAM_END || zs.total_out != size) {
+		errno = EBADMSG;
+		return -1;
+	}
+
+	return 0;
+}
+
+/* Load a member into img, in place if it is stored uncompressed */
+static int zip_extract(const struct image *zip, const char *name, struct image *img)
+{
+	struct zip_member m;
+	const uint8_t *local, *data;
+	uint8_t *buf = NULL;
+
+	if (zip_find(zip, name, &m))
+		return -1;
+
+	if (m.flags & ZIP_FLAG_ENCRYPTED ||
+	    (m.method != ZIP_METHOD_STORED && m.method != ZIP_METHOD_DEFLATED)) {
+		errno = ENOTSUP;
+		return -1;
+	}
+
+	if (m.local_offset > zip->size || zip->size - m.local_offset < ZIP_LOCAL_HEADER_SIZE)
+		goto invalid;
+
+	local = &zip->data[m.local_offset];
+	if (uint32_decode(local) != ZIP_LOCAL_HEADER_SIG)
+		goto invalid;
+
+	data = local + ZIP_LOCAL_HEADER_SIZE + uint16_decode(&local[26]) + uint16_decode(&local[28]);
+	if (data > zip->data + zip->size || zip->data + zip->size - data < m.compressed_size)
+		goto invalid;
+
+	if (m.method == ZIP_METHOD_DEFLATED) {
+		buf = malloc(m.size ? m.size : 1);
+		if (!buf)
+			return -1;
+		if (zip_inflate(data, m.compressed_size, buf, m.size)) {
+			free(buf);
+			return -1;
+		}
+		data = buf;
+	} else if (m.compressed_size != m.size) {
+		goto invalid;
+	}
+
+	if (crc32_compute(data, m.size, 0) != m.crc) {
+		free(buf);
+		goto invalid;
+	}
+
+	/* the image owns the inflated copy */
+	if (buf)
+		return image_from_buffer(img, name, buf, m.size, NULL);
+
+	return image_from_memory(img, name, data, m.size);
+
+invalid:
+	errno = EBADMSG;
+	return -1;
+}
+
+/*
+ * Open a DFU package and load its images. Errors are reported through
+ * errno, EBADMSG for a malformed zip file or manifest.
+ */
+int package_open(struct package *pkg, const char *path)
+{
+	struct manifest_parser *mp;
+	struct image manifest;
+	unsigned int i;
+	int ret = -1, err;
+
+	memset(pkg, 0, sizeof(*pkg));
+
+	if (image_load_file(&pkg->zip, path))
+		return -1;
+
+	mp = calloc(1, sizeof(*mp));
+	if (!mp)
+		goto out;
+
+	if (zip_extract(&pkg->zip, MANIFEST_NAME, &manifest))
+		goto out;
+
+	mp->pos = (const char *)manifest.data;
+	mp->end = mp->pos + manifest.size;
+	ret = json_value(mp, 0);
+	image_release(&manifest);
+	if (ret) {
+		errno = EBADMSG;
+		goto out;
+	}
+	ret = -1;
+
+	for (i = 0; i < PACKAGE_MAX_IMAGES; i++) {
+		struct image *init_packet = &pkg->images[pkg->n_images].init_packet;
+		struct image *firmware = &pkg->images[pkg->n_images].firmware;
+
+		if (!mp->images[i].bin_file[0] && !mp->images[i].dat_file[0])
+			continue;
+
+		if (zip_extract(&pkg->zip, mp->images[i].dat_file, init_packet))
+			goto out;
+		if (zip_extract(&pkg->zip, mp->images[i].bin_file, firmware)) {
+			image_release(init_packet);
+			goto out;
+		}
+
+		pkg->images[pkg->n_images++].type = package_types[i];
+	}
+
+	if (!pkg->n_images) {
+		errno = ENOENT;
+		goto out;
+	}
+
+	ret = 0;
+out:
+	err = errno;
+	free(mp);
+	if (ret)
+		package_close(pkg);
+	errno = err;
+	return ret;
+}
+
+void package_close(struct package *pkg)
+{
+	unsigned int i;
+
+	for (i = 0; i < pkg->n_images; i++) {
+		image_release(&pkg->images[i].init_packet);
+		image_release(&pkg->images[i].firmware);
+	}
+
+	image_release(&pkg->zip);
+	memset(pkg, 0, sizeof(*pkg));
+}
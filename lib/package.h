@@ -0,0 +1,32 @@
+/* SPDX-License-Identifier: BSD-3-Clause */
+/*
+ * Copyright (C) 2022 Leica Geosystems AG
+ */
+#ifndef PACKAGE_H_
+#define PACKAGE_H_
+
+#include "image.h"
+
+/* softdevice_bootloader, softdevice, bootloader and application */
+#define PACKAGE_MAX_IMAGES	4
+
+/*
+ * A DFU zip package as written by nrfutil pkg generate. The zip file is
+ * mapped, stored members are used in place and deflated ones are inflated
+ * into memory, nothing is extracted to disk. The images are in the order
+ * they have to be sent.
+ */
+struct package {
+	struct image zip;
+	unsigned int n_images;
+	struct {
+		const char *type;
+		struct image init_packet;
+		struct image firmware;
+	} images[PACKAGE_MAX_IMAGES];
+};
+
+int package_open(struct package *pkg, const char *path);
+void package_close(struct package *pkg);
+
+#endif /* PACKAGE_H_ */
@@ -0,0 +1,303 @@
+// SPDX-License-Identifier: BSD-3-Clause
+/*
+ * Copyright (C) 2022 Leica Geosystems AG
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+
+#include "image.h"
+#include "replay.h"
+#include "serial.h"
+#include "toolbox.h"
+
+#define CAPTURE_ALIGN(n)	(((n) + 7) & ~(size_t)7)
+
+struct capture {
+	FILE *f;
+	uint64_t start_ns;
+	int failed;
+};
+
+/*
+ * A capture played back as the bootloader: bytes sent by the host are
+ * compared against the recorded TX stream, recorded RX data is handed
+ * out once everything sent before it has been matched. Reads time out
+ * exactly where nothing was received in the capture, so the host takes
+ * the same path through the protocol. Without full_speed
+ * the recorded gaps before RX data are kept.
+ */
+struct replay {
+	struct image file;
+	size_t pos;		/* offset of the current record */
+	size_t done;		/* bytes of the current record already matched or delivered */
+	int full_speed;
+	uint64_t last_ts;	/* capture time of the last completed record */
+	uint64_t last_ns;	/* and when it was completed during replay */
+};
+
+static const uint8_t pad[8];
+
+struct capture *capture_open(const char *path)
+{
+	struct capture_header hdr = { .magic = CAPTURE_MAGIC };
+	struct capture *cap;
+
+	cap = calloc(1, sizeof(*cap));
+	if (!cap)
+		return NULL;
+
+	cap->f = fopen(path, "wb");
+	if (!cap->f) {
+		free(cap);
+		return NULL;
+	}
+
+	cap->start_ns = monotonic_ns();
+	if (fwrite(&hdr, sizeof(hdr), 1, cap->f) != 1)
+		cap->failed = 1;
+
+	return cap;
+}
+
+static void capture_write(struct capture *cap, const void *data, size_t length)
+{
+	if (length && fwrite(data, length, 1, cap->f) != 1)
+		cap->failed = 1;
+}
+
+static void capture_header(struct capture *cap, enum capture_dir dir, size_t length)
+{
+	struct capture_record rec = {
+		.timestamp_ns = monotonic_ns() - cap->start_ns,
+		.length = length,
+		.dir = dir,
+	};
+
+	capture_write(cap, &rec, sizeof(rec));
+}
+
+void capture_add(struct capture *cap, enum capture_dir dir, const uint8_t *data, size_t length)
+{
+	capture_header(cap, dir, length);
+	capture_write(cap, data, length);
+	capture_write(cap, pad, CAPTURE_ALIGN(length) - length);
+}
+
+/* Record the last length bytes that were read into ring */
+void capture_add_ring(struct capture *cap, const struct serial_rx_ring *ring, size_t length)
+{
+	size_t start = (ring->head + ring->count - length) % SERIAL_RX_RING_SIZE;
+	size_t first = SERIAL_RX_RING_SIZE - start < length ? SERIAL_RX_RING_SIZE - start : length;
+
+	capture_header(cap, CAPTURE_RX, length);
+	capture_write(cap, &ring->data[start], first);
+	capture_write(cap, ring->data, length - first);
+	capture_write(cap, pad, CAPTURE_ALIGN(length) - length);
+}
+
+/* Returns -1 with errno if anything could not be written */
+int capture_close(struct capture *cap)
+{
+	int failed;
+
+	if (!cap)
+		return 0;
+
+	failed = fclose(cap->f) || cap->failed;
+	free(cap);
+
+	if (failed && !errno)
+		errno = EIO;
+	return failed ? -1 : 0;
+}
+
+/* The record at pos, if it fits into the file along with its padding */
+static const struct capture_record *capture_record_at(const struct image *file, size_t pos)
+{
+	const struct capture_record *rec;
+
+	if (pos > file->size || file->size - pos < sizeof(*rec))
+		return NULL;
+
+	rec = (const void *)&file->data[pos];
+	if (file->size - pos - sizeof(*rec) < CAPTURE_ALIGN(rec->length))
+		return NULL;
+
+	return rec;
+}
+
+static const struct capture_record *replay_record(const struct replay *r)
+{
+	return capture_record_at(&r->file, r->pos);
+}
+
+static void replay_next(struct replay *r, const struct capture_record *rec)
+{
+	r->pos += sizeof(*rec) + CAPTURE_ALIGN(rec->length);
+	r->done = 0;
+	r->last_ts = rec->timestamp_ns;
+	r->last_ns = monotonic_ns();
+}
+
+static void replay_sleep(uint64_t ns)
+{
+	struct timespec ts = {
+		.tv_sec = ns / 1000000000,
+		.tv_nsec = ns % 1000000000,
+	};
+
+	while (nanosleep(&ts, &ts) && errno == EINTR)
+		;
+}
+
+static ssize_t replay_send(struct transport *t, const uint8_t *data, size_t length)
+{
+	struct replay *r = t->priv;
+	const struct capture_record *rec;
+	size_t sent = length;
+
+	while (length) {
+		size_t n;
+
+		rec = replay_record(r);
+		if (!rec || rec->dir != CAPTURE_TX) {
+			/* more data than recorded at this point */
+			errno = EPROTO;
+			return -1;
+		}
+
+		n = rec->length - r->done < length ? rec->length - r->done : length;
+		if (memcmp((const uint8_t *)(rec + 1) + r->done, data, n)) {
+			errno = EPROTO;
+			return -1;
+		}
+
+		data += n;
+		length -= n;
+		r->done += n;
+		if (r->done == rec->length)
+			replay_next(r, rec);
+	}
+
+	return sent;
+}
+
+static int replay_receive(struct transport *t, struct serial_rx_ring *ring, int timeout_ms)
+{
+	struct replay *r = t->priv;
+	const struct capture_record *rec;
+	uint64_t timeout_ns = (uint64_t)timeout_ms * 1000000;
+	size_t n;
+
+	rec = replay_record(r);
+	if (!rec || rec->dir != CAPTURE_RX) {
+		/* nothing was received at this point of the capture */
+		if (!timeout_ms)
+			return 0;
+		if (!r->full_speed)
+			replay_sleep(timeout_ns);
+		errno = ETIMEDOUT;
+		return -1;
+	}
+
+	if (!r->full_speed && !r->done) {
+		uint64_t due = r->last_ns + (rec->timestamp_ns - r->last_ts);
+		uint64_t now = monotonic_ns();
+
+		if (due > now)
+			replay_sleep(due - now);
+	}
+
+	n = serial_ring_put(ring, (const uint8_t *)(rec + 1) + r->done, rec->length - r->done);
+	r->done += n;
+	if (r->done == rec->length)
+		replay_next(r, rec);
+
+	return n;
+}
+
+static void replay_close(struct transport *t)
+{
+	t->priv = NULL;
+}
+
+static const struct transport_ops replay_ops = {
+	.send = replay_send,
+	.receive = replay_receive,
+	.close = replay_close,
+};
+
+struct replay *replay_load(const char *path, int full_speed)
+{
+	const struct capture_header *hdr;
+	const struct capture_record *rec;
+	struct replay *r;
+	size_t pos;
+
+	r = calloc(1, sizeof(*r));
+	if (!r)
+		return NULL;
+
+	if (image_load_file(&r->file, path)) {
+		free(r);
+		return NULL;
+	}
+
+	hdr = (const void *)r->file.data;
+	if (r->file.size < sizeof(*hdr) || hdr->magic != CAPTURE_MAGIC)
+		goto err_badmsg;
+
+	/* a capture cut short, e.g. by a crash or a full disk, is not played */
+	pos = sizeof(*hdr);
+	while (pos < r->file.size) {
+		rec = capture_record_at(&r->file, pos);
+		if (!rec)
+			goto err_badmsg;
+		pos += sizeof(*rec) + CAPTURE_ALIGN(rec->length);
+	}
+
+	r->pos = sizeof(*hdr);
+	r->full_speed = full_speed;
+	return r;
+
+err_badmsg:
+	replay_free(r);
+	errno = EBADMSG;
+	return NULL;
+}
+
+/*
+ * Continue the replay behind the next OPEN record, the capture holds one
+ * per time the port was opened.
+ */
+int replay_open(struct replay *r, struct transport *t)
+{
+	const struct capture_record *rec;
+
+	while ((rec = replay_record(r))) {
+		replay_next(r, rec);
+		if (rec->dir == CAPTURE_OPEN) {
+			t->ops = &replay_ops;
+			t->fd = -1;
+			t->priv = r;
+			return 0;
+		}
+	}
+
+	errno = ENODEV;
+	return -1;
+}
+
+void replay_free(struct replay *r)
+{
+	if (!r)
+		return;
+
+	image_release(&r->file);
+	free(r);
+}
@@ -0,0 +1,51 @@
+/* SPDX-License-Identifier: BSD-3-Clause */
+/*
+ * Copyright (C) 2022 Leica Geosystems AG
+ */
+#ifndef REPLAY_H_
+#define REPLAY_H_
+
+#include "transport.h"
+
+/* device names starting with this replay a capture file */
+#define REPLAY_PREFIX		"replay:"
+
+/*
+ * Capture file: a header followed by records in host byte order, each
+ * followed by its data padded to a multiple of 8. Timestamps are relative
+ * to the start of the capture. An OPEN record marks each time the port
+ * was opened, e.g. when reconnecting between the images of a package.
+ */
+#define CAPTURE_MAGIC		0x315041435546524eULL	/* "NRFUCAP1" */
+
+enum capture_dir {
+	CAPTURE_TX = 0,
+	CAPTURE_RX = 1,
+	CAPTURE_OPEN = 2,
+};
+
+struct capture_header {
+	uint64_t magic;
+	uint64_t reserved;
+};
+
+struct capture_record {
+	uint64_t timestamp_ns;
+	uint32_t length;
+	uint8_t dir;
+	uint8_t reserved[3];
+};
+
+struct capture;
+struct replay;
+
+struct capture *capture_open(const char *path);
+void capture_add(struct capture *cap, enum capture_dir dir, const uint8_t *data, size_t length);
+void capture_add_ring(struct capture *cap, const struct serial_rx_ring *ring, size_t length);
+int capture_close(struct capture *cap);
+
+struct replay *replay_load(const char *path, int full_speed);
+int replay_open(struct replay *r, struct transport *t);
+void replay_free(struct replay *r);
+
+#endif /* REPLAY_H_ */
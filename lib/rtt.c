@@ -0,0 +1,47 @@
+// SPDX-License-Identifier: BSD-3-Clause
+/*
+ * Copyright (C) 2022 Leica Geosystems AG
+ */
+
+#include <stdint.h>
+
+#include "rtt.h"
+
+/* The estimator of RFC 6298 with alpha = 1/8 and beta = 1/4 */
+void rtt_sample(struct nrfu_rtt_stats *stats, uint64_t rtt_ns)
+{
+	uint64_t delta;
+
+	if (!stats->samples) {
+		stats->srtt_ns = rtt_ns;
+		stats->rttvar_ns = rtt_ns / 2;
+		stats->min_ns = rtt_ns;
+		stats->max_ns = rtt_ns;
+	} else {
+		delta = stats->srtt_ns > rtt_ns ? stats->srtt_ns - rtt_ns : rtt_ns - stats->srtt_ns;
+		stats->rttvar_ns = (3 * stats->rttvar_ns + delta) / 4;
+		stats->srtt_ns = (7 * stats->srtt_ns + rtt_ns) / 8;
+		if (rtt_ns < stats->min_ns)
+			stats->min_ns = rtt_ns;
+		if (rtt_ns > stats->max_ns)
+			stats->max_ns = rtt_ns;
+	}
+
+	stats->samples++;
+}
+
+uint64_t rtt_timeout(const struct nrfu_rtt_stats *stats, uint64_t min_ns, uint64_t max_ns)
+{
+	uint64_t timeout;
+
+	if (!stats->samples)
+		return max_ns;
+
+	timeout = stats->srtt_ns + 4 * stats->rttvar_ns;
+	if (timeout < min_ns)
+		return min_ns;
+	if (timeout > max_ns)
+		return max_ns;
+
+	return timeout;
+}
@@ -0,0 +1,16 @@
+/* SPDX-License-Identifier: BSD-3-Clause */
+/*
+ * Copyright (C) 2022 Leica Geosystems AG
+ */
+#ifndef RTT_H_
+#define RTT_H_
+
+#include <stdint.h>
+#include <nrfu.h>
+
+/* Add a measured round trip time to the statistics */
+void rtt_sample(struct nrfu_rtt_stats *stats, uint64_t rtt_ns);
+/* srtt + 4 * rttvar within [min_ns, max_ns], max_ns without samples */
+uint64_t rtt_timeout(const struct nrfu_rtt_stats *stats, uint64_t min_ns, uint64_t max_ns);
+
+#endif /* RTT_H_ */
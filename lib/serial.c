@@ -3,7 +3,6 @@
  * Copyright (C) 2022 Leica Geosystems AG
  */
 
-#include <stdio.h>
 #include <unistd.h>
 #include <stdint.h>
 #include <string.h>
@@ -11,37 +10,104 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <sys/select.h>
+#include <sys/uio.h>
 #include <sys/file.h>
+#include <sys/ioctl.h>
+#include <linux/serial.h>
 
 #include "serial.h"
 
-int serial_init(const char *devname)
+struct serial_speed {
+	unsigned int baudrate;
+	speed_t speed;
+};
+
+static const struct serial_speed serial_speeds[] = {
+	{ 9600, B9600 },
+	{ 19200, B19200 },
+	{ 38400, B38400 },
+	{ 57600, B57600 },
+	{ 115200, B115200 },
+	{ 230400, B230400 },
+	{ 460800, B460800 },
+	{ 500000, B500000 },
+	{ 576000, B576000 },
+	{ 921600, B921600 },
+	{ 1000000, B1000000 },
+	{ 1152000, B1152000 },
+	{ 1500000, B1500000 },
+	{ 2000000, B2000000 },
+	{ 2500000, B2500000 },
+	{ 3000000, B3000000 },
+	{ 3500000, B3500000 },
+	{ 4000000, B4000000 },
+	{ }
+};
+
+static speed_t serial_lookup_speed(unsigned int baudrate)
+{
+	const struct serial_speed *s;
+
+	for (s = serial_speeds; s->baudrate; s++)
+		if (s->baudrate == baudrate)
+			return s->speed;
+
+	return B0;
+}
+
+/* Not supported by every driver (e.g. USB-CDC), so callers treat failure as a hint */
+int serial_set_low_latency(int tty_fd)
+{
+	struct serial_struct ss;
+
+	if (ioctl(tty_fd, TIOCGSERIAL, &ss))
+		return -1;
+
+	ss.flags |= ASYNC_LOW_LATENCY;
+	return ioctl(tty_fd, TIOCSSERIAL, &ss);
+}
+
+/*
+ * Errors are reported through errno only, so that the caller can log them
+ * within its own context.
+ */
+int serial_init(const char *devname, const struct serial_options *opts)
 {
 	int fd;
-	const speed_t speed = B115200;
+	speed_t speed = B0;
+	int custom_speed = 0;
 	struct termios options;
 
-	fd = open(devname, O_RDWR | O_NOCTTY);
-	if (fd < 0)	{
-		fprintf(stderr, "Failed to open %s: %s\n", devname, strerror(errno));
-		goto err_exit;
+	/* rates without a Bxxx constant are set with termios2 below */
+	if (opts->baudrate) {
+		speed = serial_lookup_speed(opts->baudrate);
+		custom_speed = speed == B0;
 	}
 
+	/* without waiting for carrier detect */
+	fd = open(devname, O_RDWR | O_NOCTTY | O_NONBLOCK);
+	if (fd < 0)
+		goto err_exit;
+
 	if (flock(fd, LOCK_EX | LOCK_NB) == -1) {
-		fprintf(stderr, "Device %s already in use\n", devname);
+		errno = EBUSY;
 		goto err_exit;
 	}
 
 	tcgetattr(fd, &options);
 
-	if (cfsetispeed(&options, speed))
-		goto err_exit;
-	if (cfsetospeed(&options, speed))
-		goto err_exit;
+	if (speed != B0) {
+		if (cfsetispeed(&options, speed))
+			goto err_exit;
+		if (cfsetospeed(&options, speed))
+			goto err_exit;
+	}
 
 	/* 8N1 */
-	options.c_cflag &= ~(PARENB | PARODD | CMSPAR | CSTOPB | CSIZE);
-	options.c_cflag |= (CLOCAL | CREAD | CS8 | CRTSCTS);
+	options.c_cflag &= ~(PARENB | PARODD | CMSPAR | CSTOPB | CSIZE | CRTSCTS);
+	options.c_cflag |= (CLOCAL | CREAD | CS8);
+	if (opts->flow_control)
+		options.c_cflag |= CRTSCTS;
 	options.c_iflag = 0;
 	options.c_oflag = 0;
 	options.c_lflag = 0;
@@ -54,58 +120,134 @@ int serial_init(const char *devname)
 	if (tcsetattr(fd, TCSANOW, &options))
 		goto err_exit;
 
+	if (custom_speed && serial_set_custom_speed(fd, opts->baudrate))
+		goto err_exit;
+
 	return fd;
 
 err_exit:
-	if (fd >= 0)
+	if (fd >= 0) {
+		int err = errno;
+
 		close(fd);
+		errno = err;
+	}
 
 	return -1;
 }
 
-int serial_send(int tty_fd, uint8_t *data, size_t data_length)
+/*
+ * Write as much of data as the descriptor takes without blocking.
+ * Returns the number of bytes written, 0 if it is full, -1 on error.
+ */
+ssize_t serial_send(int tty_fd, const uint8_t *data, size_t data_length)
 {
-	if (write(tty_fd, data, data_length) < 0) {
-		fprintf(stderr, "Failed to write: %s\n", strerror(errno));
-		return -1;
-	}
+	for (;;) {
+		ssize_t v = write(tty_fd, data, data_length);
+
+		if (v < 0 && errno == EINTR)
+			continue;
+		if (v < 0 && errno == EAGAIN)
+			return 0;
 
-	return 0;
+		return v;
+	}
 }
 
-size_t serial_receive(int tty_fd, uint8_t *data, size_t max_length, uint8_t stop_byte)
+/*
+ * Wait up to timeout_ms for data and read as much as is available into the
+ * free space of the ring buffer with a single readv(). With a timeout of 0
+ * the descriptor must be non-blocking, it is read without waiting.
+ * Returns the number of bytes read, 0 on timeout or a full ring, -1 on error.
+ */
+int serial_receive(int tty_fd, struct serial_rx_ring *ring, int timeout_ms)
 {
-	size_t n = 0;
+	struct iovec iov[2];
+	int iovcnt = 0;
+	size_t tail, space;
 	fd_set fds;
 	struct timeval tv;
-
-	tv.tv_sec = 1;
-	tv.tv_usec = 0;
-
-	FD_ZERO(&fds);
-	FD_SET(tty_fd, &fds);
+	ssize_t v;
+
+	space = SERIAL_RX_RING_SIZE - ring->count;
+	if (!space)
+		return 0;
+
+	tail = (ring->head + ring->count) % SERIAL_RX_RING_SIZE;
+	iov[iovcnt].iov_base = &ring->data[tail];
+	iov[iovcnt].iov_len = SERIAL_RX_RING_SIZE - tail;
+	if (iov[iovcnt].iov_len > space)
+		iov[iovcnt].iov_len = space;
+	space -= iov[iovcnt++].iov_len;
+	if (space) {
+		iov[iovcnt].iov_base = ring->data;
+		iov[iovcnt++].iov_len = space;
+	}
 
 	for (;;) {
-		int v = 0;
-
-		if (select(tty_fd + 1, &fds, NULL, NULL, &tv) <= 0) {
-			fprintf(stderr, "%s: timeout!\n", __func__);
-			break;
+		int r;
+
+		if (timeout_ms) {
+			tv.tv_sec = timeout_ms / 1000;
+			tv.tv_usec = (timeout_ms % 1000) * 1000;
+			FD_ZERO(&fds);
+			FD_SET(tty_fd, &fds);
+
+			r = select(tty_fd + 1, &fds, NULL, NULL, &tv);
+			if (r < 0 && errno == EINTR)
+				continue;
+			if (r < 0)
+				return -1;
+			if (r == 0)
+				return 0;
 		}
 
-		v = read(tty_fd, &data[n], 1);
+		v = readv(tty_fd, iov, iovcnt);
+		if (v < 0 && errno == EAGAIN && !timeout_ms)
+			return 0;
+		if (v < 0 && (errno == EINTR || errno == EAGAIN))
+			continue;
 		if (v < 0)
-			return v;
+			return -1;
+		if (v == 0) {
+			errno = EIO;
+			return -1;
+		}
+		break;
+	}
 
-		if (data[n] == stop_byte)
-			break;
+	ring->count += v;
+	return v;
+}
 
-		if (v > 0)
-			n += v;
+/* Get the contiguous run of buffered bytes starting at the ring head. */
+void serial_ring_peek(struct serial_rx_ring *ring, const uint8_t **data, size_t *length)
+{
+	*data = &ring->data[ring->head];
+	*length = SERIAL_RX_RING_SIZE - ring->head;
+	if (*length > ring->count)
+		*length = ring->count;
+}
 
-		if (n >= max_length)
-			break;
-	}
+void serial_ring_consume(struct serial_rx_ring *ring, size_t length)
+{
+	ring->head = (ring->head + length) % SERIAL_RX_RING_SIZE;
+	ring->count -= length;
+	if (!ring->count)
+		ring->head = 0;
+}
+
+/* Append data to the ring, returns how much of it fit */
+size_t serial_ring_put(struct serial_rx_ring *ring, const uint8_t *data, size_t length)
+{
+	size_t i, space = SERIAL_RX_RING_SIZE - ring->count;
+
+	if (length > space)
+		length = space;
+
+	for (i = 0; i < length; i++)
+		ring->data[(ring->head + ring->count + i) % SERIAL_RX_RING_SIZE] = data[i];
+	ring->count += length;
 
-	return n;
+	return length;
 }
@@ -5,8 +5,31 @@
 #ifndef SERIAL_H_
 #define SERIAL_H_
 
-int serial_init(const char *devname);
-int serial_send(int tty_fd, uint8_t *data, size_t data_length);
-size_t serial_receive(int tty_fd, uint8_t *data, size_t max_length, uint8_t stop_byte);
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#define SERIAL_RX_RING_SIZE	512
+
+struct serial_rx_ring {
+	uint8_t data[SERIAL_RX_RING_SIZE];
+	size_t head;	/* index of the first buffered byte */
+	size_t count;	/* number of buffered bytes */
+};
+
+struct serial_options {
+	unsigned int baudrate;	/* 0 keeps the current speed (e.g. USB-CDC) */
+	int flow_control;	/* RTS/CTS hardware flow control */
+};
+
+int serial_init(const char *devname, const struct serial_options *opts);
+int serial_set_custom_speed(int tty_fd, unsigned int baudrate);
+int serial_set_low_latency(int tty_fd);
+ssize_t serial_send(int tty_fd, const uint8_t *data, size_t data_length);
+int serial_receive(int tty_fd, struct serial_rx_ring *ring, int timeout_ms);
+
+void serial_ring_peek(struct serial_rx_ring *ring, const uint8_t **data, size_t *length);
+void serial_ring_consume(struct serial_rx_ring *ring, size_t length);
+size_t serial_ring_put(struct serial_rx_ring *ring, const uint8_t *data, size_t length);
 
 #endif /* SERIAL_H_ */
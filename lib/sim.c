@@ -0,0 +1,545 @@
+// SPDX-License-Identifier: BSD-3-Clause
+/*
+ * Copyright (C) 2022 Leica Geosystems AG
+ */
+
+#define _GNU_SOURCE	/* ppoll() */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#include "dfu.h"
+#include "sim.h"
+#include "slip.h"
+#include "toolbox.h"
+
+/* op code, result code and at most three 32 bit values */
+#define SIM_RESPONSE_MAX	(3 + 12)
+#define SIM_QUEUE_LEN		64
+
+/* per object type: the received bytes and what was executed of them */
+struct sim_object {
+	uint8_t *data;
+	uint32_t max_size;	/* per object, reported by SELECT */
+	uint32_t capacity;	/* of all objects of this type */
+	uint32_t start;		/* of the current object */
+	uint32_t end;
+	uint32_t offset;
+	uint32_t crc;
+	uint32_t committed;
+	uint32_t committed_crc;
+};
+
+struct sim_response {
+	uint64_t due_ns;
+	size_t length;
+	uint8_t frame[SLIP_ENCODED_MAX(SIM_RESPONSE_MAX) + 1];
+};
+
+struct sim {
+	struct sim_config cfg;
+	struct sim_object objects[2];	/* command and data */
+	struct sim_object *current;
+	uint16_t prn;
+	uint32_t packets;		/* since the current object was created */
+	uint64_t firmware_bytes;
+	int power_lost;
+
+	uint8_t *frame;
+	struct slip_decoder dec;
+
+	/* responses in order of their due time, sent from the serve loop */
+	struct sim_response queue[SIM_QUEUE_LEN];
+	unsigned int queue_head;
+	unsigned int queue_count;
+
+	uint64_t byte_ns;		/* line time of one byte, 0 without a rate limit */
+	uint64_t rx_clock;
+	uint64_t tx_clock;
+	uint64_t down_until;
+	uint64_t rng;
+
+	struct sim_stats stats;
+};
+
+void sim_config_init(struct sim_config *cfg)
+{
+	memset(cfg, 0, sizeof(*cfg));
+	cfg->mtu = SIM_DEFAULT_MTU;
+	cfg->object_size = SIM_DEFAULT_OBJECT_SIZE;
+	cfg->flash_size = SIM_DEFAULT_FLASH_SIZE;
+	cfg->reboot_ms = SIM_DEFAULT_REBOOT_MS;
+	cfg->image_fd = -1;
+}
+
+struct sim *sim_create(const struct sim_config *cfg)
+{
+	struct sim *sim;
+
+	sim = calloc(1, sizeof(*sim));
+	if (!sim)
+		return NULL;
+
+	sim->cfg = *cfg;
+	if (!sim->cfg.mtu)
+		sim->cfg.mtu = SIM_DEFAULT_MTU;
+	if (!sim->cfg.object_size)
+		sim->cfg.object_size = SIM_DEFAULT_OBJECT_SIZE;
+	if (!sim->cfg.flash_size)
+		sim->cfg.flash_size = SIM_DEFAULT_FLASH_SIZE;
+
+	if (sim->cfg.mtu < DFU_MTU_MIN || sim->cfg.mtu > UINT16_MAX) {
+		free(sim);
+		errno = EINVAL;
+		return NULL;
+	}
+
+	sim->objects[0].max_size = SIM_COMMAND_OBJECT_SIZE;
+	sim->objects[0].capacity = SIM_COMMAND_OBJECT_SIZE;
+	sim->objects[1].max_size = sim->cfg.object_size;
+	sim->objects[1].capacity = sim->cfg.flash_size;
+
+	sim->objects[0].data = malloc(sim->objects[0].capacity);
+	sim->objects[1].data = malloc(sim->objects[1].capacity);
+	sim->frame = malloc(sim->cfg.mtu);
+	if (!sim->objects[0].data || !sim->objects[1].data || !sim->frame) {
+		sim_destroy(sim);
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	slip_decoder_init(&sim->dec, sim->frame, sim->cfg.mtu);
+
+	if (sim->cfg.baudrate)
+		sim->byte_ns = 10ULL * 1000000000 / sim->cfg.baudrate;
+	/* spread small seeds, xorshift starts slowly from few set bits */
+	sim->rng = (sim->cfg.seed ^ 0x9e3779b97f4a7c15ULL) * 0xbf58476d1ce4e5b9ULL;
+
+	return sim;
+}
+
+void sim_destroy(struct sim *sim)
+{
+	if (!sim)
+		return;
+
+	free(sim->objects[0].data);
+	free(sim->objects[1].data);
+	free(sim->frame);
+	free(sim);
+}
+
+const uint8_t *sim_image(const struct sim *sim, size_t *size)
+{
+	*size = sim->objects[1].committed;
+	return sim->objects[1].data;
+}
+
+void sim_get_stats(const struct sim *sim, struct sim_stats *stats)
+{
+	*stats = sim->stats;
+}
+
+/* xorshift64*, uniform in [0, 1) */
+static double sim_random(struct sim *sim)
+{
+	sim->rng ^= sim->rng >> 12;
+	sim->rng ^= sim->rng << 25;
+	sim->rng ^= sim->rng >> 27;
+	return (sim->rng * 0x2545f4914f6cdd1dULL >> 11) / 9007199254740992.0;
+}
+
+static void put_le32(uint8_t *p, uint32_t v)
+{
+	p[0] = v;
+	p[1] = v >> 8;
+	p[2] = v >> 16;
+	p[3] = v >> 24;
+}
+
+static uint32_t get_le32(const uint8_t *p)
+{
+	return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static void sim_respond(struct sim *sim, uint8_t opcode, uint8_t result,
+			const uint8_t *payload, size_t length, uint64_t now)
+{
+	uint8_t msg[SIM_RESPONSE_MAX];
+	struct sim_response *r;
+	uint64_t due = now + sim->cfg.latency_us * 1000ULL;
+
+	if (sim->queue_count == SIM_QUEUE_LEN)
+		return;
+
+	msg[0] = DFU_OPCODE_RESPONSE;
+	msg[1] = opcode;
+	msg[2] = result;
+	memcpy(&msg[3], payload, length);
+
+	r = &sim->queue[(sim->queue_head + sim->queue_count++) % SIM_QUEUE_LEN];
+	r->length = slip_encode(r->frame, msg, length + 3);
+	r->frame[r->length++] = SLIP_BYTE_END;
+
+	if (due < sim->tx_clock)
+		due = sim->tx_clock;
+	r->due_ns = due;
+	sim->tx_clock = due + r->length * sim->byte_ns;
+}
+
+static void sim_respond_crc(struct sim *sim, uint8_t opcode, uint64_t now)
+{
+	const struct sim_object *obj = sim->current ? sim->current : &sim->objects[1];
+	uint8_t payload[8];
+
+	put_le32(&payload[0], obj->offset);
+	put_le32(&payload[4], obj->crc);
+	sim_respond(sim, opcode, DFU_RESCODE_SUCCESS, payload, sizeof(payload), now);
+}
+
+/* The settings page is only written on execute, anything after it is lost */
+static void sim_rollback(struct sim_object *obj)
+{
+	obj->start = obj->committed;
+	obj->end = obj->committed;
+	obj->offset = obj->committed;
+	obj->crc = obj->committed_crc;
+}
+
+static void sim_object_reset(struct sim_object *obj)
+{
+	obj->committed = 0;
+	obj->committed_crc = 0;
+	sim_rollback(obj);
+}
+
+static void sim_power_loss(struct sim *sim, uint64_t now)
+{
+	sim_rollback(&sim->objects[0]);
+	sim_rollback(&sim->objects[1]);
+	sim->current = NULL;
+	sim->prn = 0;
+	sim->queue_count = 0;
+	slip_decoder_init(&sim->dec, sim->frame, sim->cfg.mtu);
+
+	sim->power_lost = 1;
+	sim->stats.power_losses++;
+	sim->down_until = now + sim->cfg.reboot_ms * 1000000ULL;
+}
+
+static void sim_object_create(struct sim *sim, const uint8_t *frame, size_t length, uint64_t now)
+{
+	struct sim_object *obj;
+	uint32_t size;
+	uint8_t result = DFU_RESCODE_SUCCESS;
+
+	if (length < 6) {
+		sim_respond(sim, frame[0], DFU_RESCODE_INVALID_PARAMETER, NULL, 0, now);
+		return;
+	}
+
+	if (frame[1] != DFU_OBJECT_TYPE_COMMAND && frame[1] != DFU_OBJECT_TYPE_DATA) {
+		sim_respond(sim, frame[0], DFU_RESCODE_UNSUPPORTED_TYPE, NULL, 0, now);
+		return;
+	}
+
+	obj = &sim->objects[frame[1] - 1];
+	size = get_le32(&frame[2]);
+
+	/* a new init packet starts the update over */
+	if (frame[1] == DFU_OBJECT_TYPE_COMMAND) {
+		sim_object_reset(&sim->objects[0]);
+		sim_object_reset(&sim->objects[1]);
+	}
+	sim_rollback(obj);
+
+	if (!size)
+		result = DFU_RESCODE_INVALID_PARAMETER;
+	else if (size > obj->max_size || size > obj->capacity - obj->start)
+		result = DFU_RESCODE_INSUFFICIENT_RESOURCES;
+
+	if (result == DFU_RESCODE_SUCCESS) {
+		obj->end = obj->start + size;
+		sim->current = obj;
+		sim->packets = 0;
+	}
+
+	sim_respond(sim, frame[0], result, NULL, 0, now);
+}
+
+static void sim_write_object(struct sim *sim, const uint8_t *data, size_t length, uint64_t now)
+{
+	struct sim_object *obj = sim->current;
+
+	if (!obj || length > obj->end - obj->offset) {
+		sim_respond(sim, DFU_OPCODE_WRITE_OBJECT, DFU_RESCODE_OPERATION_NOT_PERMITTED,
+			    NULL, 0, now);
+		return;
+	}
+
+	if (obj == &sim->objects[1]) {
+		sim->firmware_bytes += length;
+		if (sim->cfg.power_loss_at && !sim->power_lost &&
+		    sim->firmware_bytes >= sim->cfg.power_loss_at) {
+			sim_power_loss(sim, now);
+			return;
+		}
+	}
+
+	memcpy(&obj->data[obj->offset], data, length);
+	obj->crc = crc32_compute(data, length, obj->crc);
+	obj->offset += length;
+
+	sim->packets++;
+	if (sim->prn && !(sim->packets % sim->prn))
+		sim_respond_crc(sim, DFU_OPCODE_GET_CRC, now);
+}
+
+static int sim_execute(struct sim *sim, uint64_t now)
+{
+	struct sim_object *obj = sim->current;
+
+	if (!obj || obj->offset != obj->end) {
+		sim_respond(sim, DFU_OPCODE_SET_EXECUTE, DFU_RESCODE_OPERATION_NOT_PERMITTED,
+			    NULL, 0, now);
+		return 0;
+	}
+
+	if (obj == &sim->objects[1] && sim->cfg.image_fd >= 0 &&
+	    pwrite(sim->cfg.image_fd, &obj->data[obj->start], obj->end - obj->start,
+		   obj->start) < 0)
+		return -1;
+
+	obj->committed = obj->offset;
+	obj->committed_crc = obj->crc;
+	obj->start = obj->offset;
+	sim->stats.objects_executed++;
+
+	sim_respond(sim, DFU_OPCODE_SET_EXECUTE, DFU_RESCODE_SUCCESS, NULL, 0, now);
+	return 0;
+}
+
+static int sim_handle_frame(struct sim *sim, const uint8_t *frame, size_t length, uint64_t now)
+{
+	uint8_t payload[12];
+
+	sim->stats.frames++;
+
+	switch (frame[0]) {
+	case DFU_OPCODE_PING:
+		if (length < 2)
+			break;
+		sim_respond(sim, frame[0], DFU_RESCODE_SUCCESS, &frame[1], 1, now);
+		return 0;
+	case DFU_OPCODE_SET_PRN:
+		if (length < 3)
+			break;
+		/* like the nRF5 SDK, restart counting towards the next notification */
+		sim->prn = frame[1] | frame[2] << 8;
+		sim->packets = 0;
+		sim_respond(sim, frame[0], DFU_RESCODE_SUCCESS, NULL, 0, now);
+		return 0;
+	case DFU_OPCODE_GET_MTU:
+		payload[0] = sim->cfg.mtu;
+		payload[1] = sim->cfg.mtu >> 8;
+		sim_respond(sim, frame[0], DFU_RESCODE_SUCCESS, payload, 2, now);
+		return 0;
+	case DFU_OPCODE_OBJECT_SELECT:
+		if (length < 2)
+			break;
+		if (frame[1] != DFU_OBJECT_TYPE_COMMAND && frame[1] != DFU_OBJECT_TYPE_DATA) {
+			sim_respond(sim, frame[0], DFU_RESCODE_UNSUPPORTED_TYPE, NULL, 0, now);
+			return 0;
+		}
+		sim->current = &sim->objects[frame[1] - 1];
+		put_le32(&payload[0], sim->current->max_size);
+		put_le32(&payload[4], sim->current->offset);
+		put_le32(&payload[8], sim->current->crc);
+		sim_respond(sim, frame[0], DFU_RESCODE_SUCCESS, payload, 12, now);
+		return 0;
+	case DFU_OPCODE_OBJECT_CREATE:
+		sim_object_create(sim, frame, length, now);
+		return 0;
+	case DFU_OPCODE_WRITE_OBJECT:
+		sim_write_object(sim, &frame[1], length - 1, now);
+		return 0;
+	case DFU_OPCODE_GET_CRC:
+		sim_respond_crc(sim, frame[0], now);
+		return 0;
+	case DFU_OPCODE_SET_EXECUTE:
+		return sim_execute(sim, now);
+	default:
+		sim->stats.bad_frames++;
+		sim_respond(sim, frame[0], DFU_RESCODE_OP_CODE_NOT_SUPPORTED, NULL, 0, now);
+		return 0;
+	}
+
+	sim_respond(sim, frame[0], DFU_RESCODE_INVALID_PARAMETER, NULL, 0, now);
+	return 0;
+}
+
+/*
+ * Feed bytes that arrived from the host through the faults into the
+ * decoder. Returns -1 if an executed object could not be written out.
+ */
+static int sim_input(struct sim *sim, uint8_t *data, size_t length, uint64_t now)
+{
+	double fault_rate = sim->cfg.drop_rate + sim->cfg.corrupt_rate;
+	size_t i, n = 0, consumed;
+
+	if (fault_rate > 0) {
+		for (i = 0; i < length; i++) {
+			double r = sim_random(sim);
+
+			if (r < sim->cfg.drop_rate) {
+				sim->stats.dropped_bytes++;
+				continue;
+			}
+			if (r < fault_rate) {
+				data[i] ^= 1 << (sim->rng & 7);
+				sim->stats.corrupted_bytes++;
+			}
+			data[n++] = data[i];
+		}
+		length = n;
+	}
+
+	while (length && sim->down_until <= now) {
+		enum slip_decode_status status = slip_decode(&sim->dec, data, length, &consumed);
+
+		data += consumed;
+		length -= consumed;
+
+		if (status == SLIP_DECODE_FRAME && sim->dec.length &&
+		    sim_handle_frame(sim, sim->frame, sim->dec.length, now) < 0)
+			return -1;
+		if (status == SLIP_DECODE_ERROR)
+			sim->stats.bad_frames++;
+
+		if (status != SLIP_DECODE_MORE)
+			slip_decoder_init(&sim->dec, sim->frame, sim->cfg.mtu);
+	}
+
+	return 0;
+}
+
+static int sim_write(int fd, const uint8_t *data, size_t length)
+{
+	while (length) {
+		ssize_t v = send(fd, data, length, MSG_NOSIGNAL);
+
+		if (v < 0 && errno == ENOTSOCK)
+			v = write(fd, data, length);
+		if (v < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+
+		data += v;
+		length -= v;
+	}
+
+	return 0;
+}
+
+/* Send the responses that are due, returns when the next one will be */
+static int sim_flush(struct sim *sim, int fd, uint64_t now, uint64_t *next)
+{
+	while (sim->queue_count) {
+		struct sim_response *r = &sim->queue[sim->queue_head];
+
+		if (r->due_ns > now) {
+			*next = r->due_ns;
+			return 0;
+		}
+
+		if (sim_write(fd, r->frame, r->length) < 0)
+			return -1;
+		sim->stats.tx_bytes += r->length;
+
+		sim->queue_head = (sim->queue_head + 1) % SIM_QUEUE_LEN;
+		sim->queue_count--;
+	}
+
+	return 0;
+}
+
+/*
+ * Data read from fd is held back until it would have arrived over the
+ * emulated line, so it is read in chunks of about a millisecond of line
+ * time to keep receipt notifications in step with the stream.
+ */
+int sim_serve(struct sim *sim, int fd)
+{
+	uint8_t buf[4096];
+	size_t chunk = sizeof(buf), pending = 0;
+	uint64_t pending_due = 0;
+
+	if (sim->byte_ns && 1000000 / sim->byte_ns + 1 < chunk)
+		chunk = 1000000 / sim->byte_ns + 1;
+
+	for (;;) {
+		struct pollfd pfd = { .fd = fd };
+		uint64_t now = monotonic_ns(), next = UINT64_MAX;
+		struct timespec ts, *timeout = NULL;
+		ssize_t n;
+
+		if (pending && pending_due <= now) {
+			if (sim_input(sim, buf, pending, now) < 0)
+				return -1;
+			pending = 0;
+		}
+
+		if (sim_flush(sim, fd, now, &next) < 0)
+			return -1;
+
+		if (pending && pending_due < next)
+			next = pending_due;
+		if (!pending)
+			pfd.events = POLLIN;
+
+		if (next != UINT64_MAX) {
+			ts.tv_sec = (next - now) / 1000000000;
+			ts.tv_nsec = (next - now) % 1000000000;
+			timeout = &ts;
+		}
+
+		if (ppoll(&pfd, 1, timeout, NULL) < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+
+		if (pending || !(pfd.revents & (POLLIN | POLLHUP | POLLERR)))
+			continue;
+
+		n = read(fd, buf, chunk);
+		if (n < 0 && (errno == EINTR || errno == EAGAIN))
+			continue;
+		if (n < 0)
+			return -1;
+		if (n == 0)
+			return 0;
+
+		now = monotonic_ns();
+		sim->stats.rx_bytes += n;
+
+		/* rebooting after a power loss, nobody is listening */
+		if (sim->down_until > now) {
+			sim->rx_clock = now;
+			continue;
+		}
+
+		pending = n;
+		sim->rx_clock = (sim->rx_clock > now ? sim->rx_clock : now) + n * sim->byte_ns;
+		pending_due = sim->rx_clock;
+	}
+}
@@ -0,0 +1,68 @@
+/* SPDX-License-Identifier: BSD-3-Clause */
+/*
+ * Copyright (C) 2022 Leica Geosystems AG
+ */
+#ifndef SIM_H_
+#define SIM_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* what the nRF5 SDK serial bootloader reports */
+#define SIM_DEFAULT_MTU			131
+#define SIM_DEFAULT_OBJECT_SIZE		4096
+#define SIM_COMMAND_OBJECT_SIZE		512
+#define SIM_DEFAULT_FLASH_SIZE		(1024 * 1024)
+#define SIM_DEFAULT_REBOOT_MS		500
+
+/*
+ * Host-side emulation of the nRF5 serial DFU bootloader. Zero fields
+ * select the defaults above, no line rate limit, latency or faults.
+ */
+struct sim_config {
+	unsigned int mtu;
+	unsigned int object_size;	/* maximum size of a data object */
+	unsigned int flash_size;	/* maximum firmware size */
+	unsigned int baudrate;		/* emulated line rate, 10 bits per byte */
+	unsigned int latency_us;	/* until a response leaves the device */
+	double drop_rate;		/* probability of losing a received byte */
+	double corrupt_rate;		/* probability of flipping bits in a received byte */
+	/*
+	 * lose power once after this many firmware bytes were received: the
+	 * object that was not executed yet is lost and the device does not
+	 * answer for reboot_ms. 0 disables it.
+	 */
+	unsigned long power_loss_at;
+	unsigned int reboot_ms;
+	unsigned int seed;		/* of the fault generator */
+	int image_fd;			/* executed data objects are written here, -1 for none */
+};
+
+struct sim_stats {
+	uint64_t rx_bytes;
+	uint64_t tx_bytes;
+	uint64_t frames;
+	uint64_t bad_frames;		/* malformed, too long or with an unknown opcode */
+	uint64_t dropped_bytes;
+	uint64_t corrupted_bytes;
+	uint64_t objects_executed;
+	unsigned int power_losses;
+};
+
+struct sim;
+
+void sim_config_init(struct sim_config *cfg);
+struct sim *sim_create(const struct sim_config *cfg);
+void sim_destroy(struct sim *sim);
+
+/*
+ * Serve the bootloader side of a link on fd until the host closes it.
+ * Returns 0 on EOF, -1 with errno on errors.
+ */
+int sim_serve(struct sim *sim, int fd);
+
+/* The firmware executed so far */
+const uint8_t *sim_image(const struct sim *sim, size_t *size);
+void sim_get_stats(const struct sim *sim, struct sim_stats *stats);
+
+#endif /* SIM_H_ */
@@ -0,0 +1,138 @@
+// SPDX-License-Identifier: BSD-3-Clause
+/*
+ * Copyright (C) 2022 Leica Geosystems AG
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "slip.h"
+
+/*
+ * Escape data_length bytes of data into out, which must provide at least
+ * SLIP_ENCODED_MAX(data_length) bytes. No END byte is appended.
+ * Returns the number of bytes written.
+ */
+size_t slip_encode(uint8_t *out, const uint8_t *data, size_t data_length)
+{
+	size_t n = 0;
+	size_t i;
+
+	for (i = 0; i < data_length; i++) {
+		switch (data[i]) {
+		case SLIP_BYTE_END:
+			out[n++] = SLIP_BYTE_ESC;
+			out[n++] = SLIP_BYTE_ESC_END;
+			break;
+
+		case SLIP_BYTE_ESC:
+			out[n++] = SLIP_BYTE_ESC;
+			out[n++] = SLIP_BYTE_ESC_ESC;
+			break;
+
+		default:
+			out[n++] = data[i];
+		}
+	}
+
+	return n;
+}
+
+/*
+ * Escape as many bytes of data as fit into out_size bytes of output, based
+ * on the actual escaped length rather than the worst case. The number of
+ * input bytes used is stored in consumed. No END byte is appended.
+ * Returns the number of bytes written.
+ */
+size_t slip_pack(uint8_t *out, size_t out_size, const uint8_t *data, size_t data_length,
+		 size_t *consumed)
+{
+	size_t n = 0;
+	size_t i;
+
+	for (i = 0; i < data_length; i++) {
+		uint8_t c = data[i];
+
+		if (c == SLIP_BYTE_END || c == SLIP_BYTE_ESC) {
+			if (n + 2 > out_size)
+				break;
+			out[n++] = SLIP_BYTE_ESC;
+			out[n++] = c == SLIP_BYTE_END ? SLIP_BYTE_ESC_END : SLIP_BYTE_ESC_ESC;
+		} else {
+			if (n + 1 > out_size)
+				break;
+			out[n++] = c;
+		}
+	}
+
+	*consumed = i;
+	return n;
+}
+
+void slip_decoder_init(struct slip_decoder *dec, uint8_t *buf, size_t size)
+{
+	dec->buf = buf;
+	dec->size = size;
+	dec->length = 0;
+	dec->escape = 0;
+	dec->error = 0;
+}
+
+static void slip_decoder_put(struct slip_decoder *dec, uint8_t c)
+{
+	if (dec->length < dec->size)
+		dec->buf[dec->length++] = c;
+	else
+		dec->error = 1;
+}
+
+/*
+ * Feed data into the decoder until a frame is complete or the input is
+ * exhausted. The number of bytes used is stored in consumed, so that the
+ * remainder can be fed in again for the next frame. Empty frames (e.g. a
+ * leading END byte used for resynchronisation) are skipped.
+ * After SLIP_DECODE_FRAME the decoded frame is in dec->buf with dec->length
+ * bytes; the decoder has to be re-initialised before feeding the next frame.
+ */
+enum slip_decode_status slip_decode(struct slip_decoder *dec, const uint8_t *data,
+				    size_t data_length, size_t *consumed)
+{
+	size_t i;
+
+	for (i = 0; i < data_length; i++) {
+		uint8_t c = data[i];
+
+		if (c == SLIP_BYTE_END) {
+			int error = dec->error || dec->escape;
+
+			dec->escape = 0;
+			dec->error = 0;
+			if (!dec->length && !error)
+				continue;
+
+			*consumed = i + 1;
+			if (error) {
+				dec->length = 0;
+				return SLIP_DECODE_ERROR;
+			}
+			return SLIP_DECODE_FRAME;
+		}
+
+		if (dec->escape) {
+			dec->escape = 0;
+			if (c == SLIP_BYTE_ESC_END)
+				slip_decoder_put(dec, SLIP_BYTE_END);
+			else if (c == SLIP_BYTE_ESC_ESC)
+				slip_decoder_put(dec, SLIP_BYTE_ESC);
+			else
+				dec->error = 1;
+		} else if (c == SLIP_BYTE_ESC) {
+			dec->escape = 1;
+		} else {
+			slip_decoder_put(dec, c);
+		}
+	}
+
+	*consumed = data_length;
+	return SLIP_DECODE_MORE;
+}
@@ -0,0 +1,38 @@
+/* SPDX-License-Identifier: BSD-3-Clause */
+/*
+ * Copyright (C) 2022 Leica Geosystems AG
+ */
+#ifndef SLIP_H_
+#define SLIP_H_
+
+#define SLIP_BYTE_END		0xC0	/* indicates end of packet */
+#define SLIP_BYTE_ESC		0xDB	/* indicates byte stuffing */
+#define SLIP_BYTE_ESC_END	0xDC	/* ESC ESC_END means END data byte */
+#define SLIP_BYTE_ESC_ESC	0xDD	/* ESC ESC_ESC means ESC data byte */
+
+/* worst case: every byte escaped */
+#define SLIP_ENCODED_MAX(len)	(2 * (len))
+
+enum slip_decode_status {
+	SLIP_DECODE_ERROR = -1,	/* frame ended, but was malformed or too long */
+	SLIP_DECODE_MORE = 0,	/* input exhausted, frame not yet complete */
+	SLIP_DECODE_FRAME = 1,	/* frame complete */
+};
+
+struct slip_decoder {
+	uint8_t *buf;
+	size_t size;
+	size_t length;
+	int escape;
+	int error;
+};
+
+size_t slip_encode(uint8_t *out, const uint8_t *data, size_t data_length);
+size_t slip_pack(uint8_t *out, size_t out_size, const uint8_t *data, size_t data_length,
+		 size_t *consumed);
+
+void slip_decoder_init(struct slip_decoder *dec, uint8_t *buf, size_t size);
+enum slip_decode_status slip_decode(struct slip_decoder *dec, const uint8_t *data,
+				    size_t data_length, size_t *consumed);
+
+#endif /* SLIP_H_ */
@@ -0,0 +1,31 @@
+// SPDX-License-Identifier: BSD-3-Clause
+/*
+ * Copyright (C) 2022 Leica Geosystems AG
+ */
+
+/*
+ * The kernel's struct termios2 clashes with the libc definition from
+ * <termios.h>, so arbitrary baud rates are set up in this separate unit.
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/ioctl.h>
+#include <asm/termbits.h>
+
+#include "serial.h"
+
+int serial_set_custom_speed(int tty_fd, unsigned int baudrate)
+{
+	struct termios2 options;
+
+	if (ioctl(tty_fd, TCGETS2, &options))
+		return -1;
+
+	options.c_cflag &= ~(CBAUD | (CBAUD << IBSHIFT));
+	options.c_cflag |= BOTHER | (BOTHER << IBSHIFT);
+	options.c_ispeed = baudrate;
+	options.c_ospeed = baudrate;
+
+	return ioctl(tty_fd, TCSETS2, &options);
+}
@@ -4,6 +4,7 @@
  */
 
 #include <stdint.h>
+#include <time.h>
 
 #include "toolbox.h"
 
@@ -37,7 +38,27 @@ uint8_t uint32_encode(uint32_t value, uint8_t *data)
 	return sizeof(uint32_t);
 }
 
-uint32_t crc32_compute(const uint8_t *data, uint32_t size, uint32_t crc)
+uint64_t monotonic_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/*
+ * CRC-32 (IEEE 802.3, reflected polynomial 0xEDB88320) as used by the DFU
+ * bootloader. crc32_compute() dispatches at load time to the fastest
+ * implementation available on the host; all variants give identical results
+ * and can be called directly (e.g. for benchmarking).
+ */
+#define CRC32_POLY		0xEDB88320U
+
+static uint32_t crc32_table[8][256];
+static int crc32_have_clmul;
+static uint32_t (*crc32_impl)(const uint8_t *data, uint32_t size, uint32_t crc) = crc32_compute_sliced;
+
+uint32_t crc32_compute_bitwise(const uint8_t *data, uint32_t size, uint32_t crc)
 {
 	uint32_t ret;
 	int j;
@@ -46,7 +67,282 @@ uint32_t crc32_compute(const uint8_t *data, uint32_t size, uint32_t crc)
 	for (uint32_t i = 0; i < size; i++) {
 		ret = ret ^ data[i];
 		for (j = 8; j > 0; j--)
-			ret = (ret >> 1) ^ (0xEDB88320U & ((ret & 1) ? 0xFFFFFFFF : 0));
+			ret = (ret >> 1) ^ (CRC32_POLY & ((ret & 1) ? 0xFFFFFFFF : 0));
 	}
 	return ~ret;
 }
+
+/* Operates on the inverted CRC register, as crc32_compute() does internally */
+static uint32_t crc32_sliced_raw(const uint8_t *data, uint32_t size, uint32_t ret)
+{
+	while (size >= 8) {
+		uint32_t lo = ret ^ uint32_decode(data);
+		uint32_t hi = uint32_decode(data + 4);
+
+		ret = crc32_table[7][lo & 0xFF] ^
+		      crc32_table[6][(lo >> 8) & 0xFF] ^
+		      crc32_table[5][(lo >> 16) & 0xFF] ^
+		      crc32_table[4][lo >> 24] ^
+		      crc32_table[3][hi & 0xFF] ^
+		      crc32_table[2][(hi >> 8) & 0xFF] ^
+		      crc32_table[1][(hi >> 16) & 0xFF] ^
+		      crc32_table[0][hi >> 24];
+		data += 8;
+		size -= 8;
+	}
+
+	while (size--)
+		ret = (ret >> 8) ^ crc32_table[0][(ret ^ *data++) & 0xFF];
+
+	return ret;
+}
+
+uint32_t crc32_compute_sliced(const uint8_t *data, uint32_t size, uint32_t crc)
+{
+	return ~crc32_sliced_raw(data, size, ~crc);
+}
+
+/*
+ * Carry-less multiplication folding as described in Intel's "Fast CRC
+ * Computation for Generic Polynomials Using PCLMULQDQ Instruction".
+ * The constants are the bit-reflected x^n mod P(x) values from the paper.
+ * The kernels need at least 64 bytes and consume a multiple of 16 bytes,
+ * the remainder is handled by the sliced implementation.
+ */
+#define CRC32_CLMUL_MIN		64
+
+static const uint64_t crc32_k1k2[] __attribute__((aligned(16))) = { 0x0154442bd4, 0x01c6e41596 };
+static const uint64_t crc32_k3k4[] __attribute__((aligned(16))) = { 0x01751997d0, 0x00ccaa009e };
+static const uint64_t crc32_k5k0[] __attribute__((aligned(16))) = { 0x0163cd6124, 0x0000000000 };
+static const uint64_t crc32_poly[] __attribute__((aligned(16))) = { 0x01db710641, 0x01f7011641 };
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+
+#define CRC32_HAVE_CLMUL
+
+__attribute__((target("pclmul,sse4.1")))
+static uint32_t crc32_clmul_raw(const uint8_t *buf, uint32_t len, uint32_t crc)
+{
+	__m128i x0, x1, x2, x3, x4, x5, x6, x7, x8, y5, y6, y7, y8;
+
+	x1 = _mm_loadu_si128((const __m128i *)(buf + 0x00));
+	x2 = _mm_loadu_si128((const __m128i *)(buf + 0x10));
+	x3 = _mm_loadu_si128((const __m128i *)(buf + 0x20));
+	x4 = _mm_loadu_si128((const __m128i *)(buf + 0x30));
+	x1 = _mm_xor_si128(x1, _mm_cvtsi32_si128(crc));
+	x0 = _mm_load_si128((const __m128i *)crc32_k1k2);
+	buf += 64;
+	len -= 64;
+
+	/* fold 4 x 128 bit in parallel */
+	while (len >= 64) {
+		x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+		x6 = _mm_clmulepi64_si128(x2, x0, 0x00);
+		x7 = _mm_clmulepi64_si128(x3, x0, 0x00);
+		x8 = _mm_clmulepi64_si128(x4, x0, 0x00);
+		x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+		x2 = _mm_clmulepi64_si128(x2, x0, 0x11);
+		x3 = _mm_clmulepi64_si128(x3, x0, 0x11);
+		x4 = _mm_clmulepi64_si128(x4, x0, 0x11);
+		y5 = _mm_loadu_si128((const __m128i *)(buf + 0x00));
+		y6 = _mm_loadu_si128((const __m128i *)(buf + 0x10));
+		y7 = _mm_loadu_si128((const __m128i *)(buf + 0x20));
+		y8 = _mm_loadu_si128((const __m128i *)(buf + 0x30));
+		x1 = _mm_xor_si128(_mm_xor_si128(x1, x5), y5);
+		x2 = _mm_xor_si128(_mm_xor_si128(x2, x6), y6);
+		x3 = _mm_xor_si128(_mm_xor_si128(x3, x7), y7);
+		x4 = _mm_xor_si128(_mm_xor_si128(x4, x8), y8);
+		buf += 64;
+		len -= 64;
+	}
+
+	/* fold into a single 128 bit value */
+	x0 = _mm_load_si128((const __m128i *)crc32_k3k4);
+	x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+	x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+	x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+	x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+	x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+	x1 = _mm_xor_si128(_mm_xor_si128(x1, x3), x5);
+	x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+	x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+	x1 = _mm_xor_si128(_mm_xor_si128(x1, x4), x5);
+
+	while (len >= 16) {
+		x2 = _mm_loadu_si128((const __m128i *)buf);
+		x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+		x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+		x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+		buf += 16;
+		len -= 16;
+	}
+
+	/* fold 128 to 64 bit */
+	x2 = _mm_clmulepi64_si128(x1, x0, 0x10);
+	x3 = _mm_setr_epi32(~0, 0, ~0, 0);
+	x1 = _mm_srli_si128(x1, 8);
+	x1 = _mm_xor_si128(x1, x2);
+	x0 = _mm_loadl_epi64((const __m128i *)crc32_k5k0);
+	x2 = _mm_srli_si128(x1, 4);
+	x1 = _mm_and_si128(x1, x3);
+	x1 = _mm_clmulepi64_si128(x1, x0, 0x00);
+	x1 = _mm_xor_si128(x1, x2);
+
+	/* Barrett reduction to 32 bit */
+	x0 = _mm_load_si128((const __m128i *)crc32_poly);
+	x2 = _mm_and_si128(x1, x3);
+	x2 = _mm_clmulepi64_si128(x2, x0, 0x10);
+	x2 = _mm_and_si128(x2, x3);
+	x2 = _mm_clmulepi64_si128(x2, x0, 0x00);
+	x1 = _mm_xor_si128(x1, x2);
+
+	return _mm_extract_epi32(x1, 1);
+}
+
+static int crc32_clmul_supported(void)
+{
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("pclmul") && __builtin_cpu_supports("sse4.1");
+}
+
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+
+#define CRC32_HAVE_CLMUL
+
+__attribute__((target("+crypto")))
+static inline uint64x2_t crc32_pmull(uint64x2_t a, int a_hi, uint64x2_t b, int b_hi)
+{
+	poly64_t pa = (poly64_t)(a_hi ? vgetq_lane_u64(a, 1) : vgetq_lane_u64(a, 0));
+	poly64_t pb = (poly64_t)(b_hi ? vgetq_lane_u64(b, 1) : vgetq_lane_u64(b, 0));
+
+	return vreinterpretq_u64_p128(vmull_p64(pa, pb));
+}
+
+/* Same folding scheme as the x86 kernel, expressed with PMULL */
+__attribute__((target("+crypto")))
+static uint32_t crc32_clmul_raw(const uint8_t *buf, uint32_t len, uint32_t crc)
+{
+	uint64x2_t x0, x1, x2, x3, x4, x5, x6, x7, x8;
+	const uint64x2_t mask32 = vreinterpretq_u64_u32((uint32x4_t){ ~0U, 0, ~0U, 0 });
+
+	x1 = vld1q_u64((const uint64_t *)(buf + 0x00));
+	x2 = vld1q_u64((const uint64_t *)(buf + 0x10));
+	x3 = vld1q_u64((const uint64_t *)(buf + 0x20));
+	x4 = vld1q_u64((const uint64_t *)(buf + 0x30));
+	x1 = veorq_u64(x1, vsetq_lane_u64((uint64_t)crc, vdupq_n_u64(0), 0));
+	x0 = vld1q_u64(crc32_k1k2);
+	buf += 64;
+	len -= 64;
+
+	while (len >= 64) {
+		x5 = crc32_pmull(x1, 0, x0, 0);
+		x6 = crc32_pmull(x2, 0, x0, 0);
+		x7 = crc32_pmull(x3, 0, x0, 0);
+		x8 = crc32_pmull(x4, 0, x0, 0);
+		x1 = crc32_pmull(x1, 1, x0, 1);
+		x2 = crc32_pmull(x2, 1, x0, 1);
+		x3 = crc32_pmull(x3, 1, x0, 1);
+		x4 = crc32_pmull(x4, 1, x0, 1);
+		x1 = veorq_u64(veorq_u64(x1, x5), vld1q_u64((const uint64_t *)(buf + 0x00)));
+		x2 = veorq_u64(veorq_u64(x2, x6), vld1q_u64((const uint64_t *)(buf + 0x10)));
+		x3 = veorq_u64(veorq_u64(x3, x7), vld1q_u64((const uint64_t *)(buf + 0x20)));
+		x4 = veorq_u64(veorq_u64(x4, x8), vld1q_u64((const uint64_t *)(buf + 0x30)));
+		buf += 64;
+		len -= 64;
+	}
+
+	x0 = vld1q_u64(crc32_k3k4);
+	x5 = crc32_pmull(x1, 0, x0, 0);
+	x1 = crc32_pmull(x1, 1, x0, 1);
+	x1 = veorq_u64(veorq_u64(x1, x2), x5);
+	x5 = crc32_pmull(x1, 0, x0, 0);
+	x1 = crc32_pmull(x1, 1, x0, 1);
+	x1 = veorq_u64(veorq_u64(x1, x3), x5);
+	x5 = crc32_pmull(x1, 0, x0, 0);
+	x1 = crc32_pmull(x1, 1, x0, 1);
+	x1 = veorq_u64(veorq_u64(x1, x4), x5);
+
+	while (len >= 16) {
+		x2 = vld1q_u64((const uint64_t *)buf);
+		x5 = crc32_pmull(x1, 0, x0, 0);
+		x1 = crc32_pmull(x1, 1, x0, 1);
+		x1 = veorq_u64(veorq_u64(x1, x2), x5);
+		buf += 16;
+		len -= 16;
+	}
+
+	x2 = crc32_pmull(x1, 0, x0, 1);
+	x1 = vcombine_u64(vget_high_u64(x1), vdup_n_u64(0));
+	x1 = veorq_u64(x1, x2);
+	x0 = vld1q_u64(crc32_k5k0);
+	x2 = vreinterpretq_u64_u8(vextq_u8(vreinterpretq_u8_u64(x1), vdupq_n_u8(0), 4));
+	x1 = vandq_u64(x1, mask32);
+	x1 = crc32_pmull(x1, 0, x0, 0);
+	x1 = veorq_u64(x1, x2);
+
+	x0 = vld1q_u64(crc32_poly);
+	x2 = vandq_u64(x1, mask32);
+	x2 = crc32_pmull(x2, 0, x0, 1);
+	x2 = vandq_u64(x2, mask32);
+	x2 = crc32_pmull(x2, 0, x0, 0);
+	x1 = veorq_u64(x1, x2);
+
+	return vgetq_lane_u32(vreinterpretq_u32_u64(x1), 1);
+}
+
+static int crc32_clmul_supported(void)
+{
+	return !!(getauxval(AT_HWCAP) & HWCAP_PMULL);
+}
+#endif
+
+uint32_t crc32_compute_clmul(const uint8_t *data, uint32_t size, uint32_t crc)
+{
+#ifdef CRC32_HAVE_CLMUL
+	uint32_t ret = ~crc;
+	uint32_t bulk = size & ~15U;
+
+	if (size >= CRC32_CLMUL_MIN && crc32_have_clmul) {
+		ret = crc32_clmul_raw(data, bulk, ret);
+		data += bulk;
+		size -= bulk;
+	}
+
+	return ~crc32_sliced_raw(data, size, ret);
+#else
+	return crc32_compute_sliced(data, size, crc);
+#endif
+}
+
+__attribute__((constructor))
+static void crc32_init(void)
+{
+	for (uint32_t i = 0; i < 256; i++) {
+		uint32_t c = i;
+		int j;
+
+		for (j = 0; j < 8; j++)
+			c = (c >> 1) ^ (CRC32_POLY & ((c & 1) ? 0xFFFFFFFF : 0));
+		crc32_table[0][i] = c;
+	}
+
+	for (uint32_t i = 0; i < 256; i++)
+		for (int t = 1; t < 8; t++)
+			crc32_table[t][i] = (crc32_table[t - 1][i] >> 8) ^
+					    crc32_table[0][crc32_table[t - 1][i] & 0xFF];
+
+#ifdef CRC32_HAVE_CLMUL
+	crc32_have_clmul = crc32_clmul_supported();
+	if (crc32_have_clmul)
+		crc32_impl = crc32_compute_clmul;
+#endif
+}
+
+uint32_t crc32_compute(const uint8_t *data, uint32_t size, uint32_t crc)
+{
+	return crc32_impl(data, size, crc);
+}
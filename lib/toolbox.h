@@ -9,6 +9,10 @@ uint32_t uint32_decode(const uint8_t *data);
 uint16_t uint16_decode(const uint8_t *data);
 uint8_t uint16_encode(uint16_t value, uint8_t *data);
 uint8_t uint32_encode(uint32_t value, uint8_t *data);
+uint64_t monotonic_ns(void);
 uint32_t crc32_compute(const uint8_t *data, uint32_t size, uint32_t crc);
+uint32_t crc32_compute_bitwise(const uint8_t *data, uint32_t size, uint32_t crc);
+uint32_t crc32_compute_sliced(const uint8_t *data, uint32_t size, uint32_t crc);
+uint32_t crc32_compute_clmul(const uint8_t *data, uint32_t size, uint32_t crc);
 
 #endif /* TOOLBOX_H_ */
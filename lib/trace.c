@@ -0,0 +1,138 @@
+// SPDX-License-Identifier: BSD-3-Clause
+/*
+ * Copyright (C) 2022 Leica Geosystems AG
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "trace.h"
+
+/* records are 8 byte aligned, but may wrap around the end of the ring */
+static void ring_put(struct trace_ring *ring, size_t pos, const void *data, size_t length)
+{
+	size_t first;
+
+	pos %= ring->size;
+	first = ring->size - pos < length ? ring->size - pos : length;
+	memcpy(&ring->buf[pos], data, first);
+	memcpy(ring->buf, (const uint8_t *)data + first, length - first);
+}
+
+static void ring_get(const struct trace_ring *ring, size_t pos, void *data, size_t length)
+{
+	size_t first;
+
+	pos %= ring->size;
+	first = ring->size - pos < length ? ring->size - pos : length;
+	memcpy(data, &ring->buf[pos], first);
+	memcpy((uint8_t *)data + first, ring->buf, length - first);
+}
+
+static size_t record_size(const struct nrfu_trace_record *rec)
+{
+	return sizeof(*rec) + NRFU_TRACE_ALIGN(rec->captured);
+}
+
+int trace_ring_init(struct trace_ring *ring, size_t size)
+{
+	size = NRFU_TRACE_ALIGN(size);
+	if (size < sizeof(struct nrfu_trace_record) + NRFU_TRACE_SNAPLEN) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (ring->size != size) {
+		uint8_t *buf = realloc(ring->buf, size);
+
+		if (!buf)
+			return -1;
+		ring->buf = buf;
+		ring->size = size;
+	}
+
+	trace_ring_reset(ring);
+	return 0;
+}
+
+void trace_ring_free(struct trace_ring *ring)
+{
+	free(ring->buf);
+	memset(ring, 0, sizeof(*ring));
+}
+
+void trace_ring_reset(struct trace_ring *ring)
+{
+	ring->tail = 0;
+	ring->used = 0;
+	ring->dropped = 0;
+}
+
+void trace_add(struct trace_ring *ring, uint64_t timestamp_ns, enum nrfu_trace_dir dir,
+	       const uint8_t *data, size_t length)
+{
+	struct nrfu_trace_record rec;
+
+	rec.timestamp_ns = timestamp_ns;
+	rec.length = length;
+	rec.captured = length < NRFU_TRACE_SNAPLEN ? length : NRFU_TRACE_SNAPLEN;
+	rec.dir = dir;
+	rec.opcode = length ? data[0] : 0;
+
+	while (ring->size - ring->used < record_size(&rec)) {
+		struct nrfu_trace_record old;
+
+		ring_get(ring, ring->tail, &old, sizeof(old));
+		ring->tail = (ring->tail + record_size(&old)) % ring->size;
+		ring->used -= record_size(&old);
+		ring->dropped++;
+	}
+
+	ring_put(ring, ring->tail + ring->used, &rec, sizeof(rec));
+	ring_put(ring, ring->tail + ring->used + sizeof(rec), data, rec.captured);
+	ring->used += record_size(&rec);
+}
+
+/* Write the records in the ring to a trace file, see nrfu_trace.h */
+int trace_ring_write(const struct trace_ring *ring, const char *path)
+{
+	struct nrfu_trace_header hdr = {
+		.magic = NRFU_TRACE_MAGIC,
+		.snaplen = NRFU_TRACE_SNAPLEN,
+		.dropped = ring->dropped,
+	};
+	uint64_t rec[(sizeof(struct nrfu_trace_record) + NRFU_TRACE_SNAPLEN) / 8];
+	size_t pos, length;
+	FILE *f;
+	int err;
+
+	f = fopen(path, "wb");
+	if (!f)
+		return -1;
+
+	if (fwrite(&hdr, sizeof(hdr), 1, f) != 1)
+		goto err_out;
+
+	for (pos = 0; pos < ring->used; pos += length) {
+		ring_get(ring, ring->tail + pos, rec, sizeof(struct nrfu_trace_record));
+		length = record_size((struct nrfu_trace_record *)rec);
+		ring_get(ring, ring->tail + pos, rec, length);
+
+		if (fwrite(rec, length, 1, f) != 1)
+			goto err_out;
+	}
+
+	if (fclose(f))
+		return -1;
+
+	return 0;
+
+err_out:
+	err = errno;
+	fclose(f);
+	errno = err;
+	return -1;
+}
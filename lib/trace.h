@@ -0,0 +1,29 @@
+/* SPDX-License-Identifier: BSD-3-Clause */
+/*
+ * Copyright (C) 2022 Leica Geosystems AG
+ */
+#ifndef TRACE_H_
+#define TRACE_H_
+
+#include <nrfu_trace.h>
+
+/*
+ * Ring buffer of nrfu_trace_records. Adding a record only copies the
+ * frame; when the ring is full the oldest records are dropped.
+ */
+struct trace_ring {
+	uint8_t *buf;
+	size_t size;
+	size_t tail;
+	size_t used;
+	uint64_t dropped;
+};
+
+int trace_ring_init(struct trace_ring *ring, size_t size);
+void trace_ring_free(struct trace_ring *ring);
+void trace_ring_reset(struct trace_ring *ring);
+void trace_add(struct trace_ring *ring, uint64_t timestamp_ns, enum nrfu_trace_dir dir,
+	       const uint8_t *data, size_t length);
+int trace_ring_write(const struct trace_ring *ring, const char *path);
+
+#endif /* TRACE_H_ */
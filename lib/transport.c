@@ -0,0 +1,343 @@
+// SPDX-License-Identifier: BSD-3-Clause
+/*
+ * Copyright (C) 2022 Leica Geosystems AG
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include "serial.h"
+#include "transport.h"
+
+#define TRANSPORT_TCP		"tcp:"
+#define TRANSPORT_UNIX		"unix:"
+#define TRANSPORT_FD		"fd:"
+
+static ssize_t fd_send(struct transport *t, const uint8_t *data, size_t length)
+{
+	return serial_send(t->fd, data, length);
+}
+
+static int fd_receive(struct transport *t, struct serial_rx_ring *ring, int timeout_ms)
+{
+	return serial_receive(t->fd, ring, timeout_ms);
+}
+
+static void fd_close(struct transport *t)
+{
+	close(t->fd);
+	t->fd = -1;
+}
+
+/* A connect in progress still holds the addresses left to try */
+static void socket_close(struct transport *t)
+{
+	if (t->addrs)
+		freeaddrinfo(t->addrs);
+	t->addrs = NULL;
+	t->addr = NULL;
+	t->connecting = 0;
+	fd_close(t);
+}
+
+/* The caller owns the descriptor */
+static void fd_release(struct transport *t)
+{
+	t->fd = -1;
+}
+
+/* A peer that went away must not raise SIGPIPE in the host process */
+static ssize_t socket_send(struct transport *t, const uint8_t *data, size_t length)
+{
+	for (;;) {
+		ssize_t v = send(t->fd, data, length, MSG_NOSIGNAL);
+
+		if (v < 0 && errno == EINTR)
+			continue;
+		if (v < 0 && errno == EAGAIN)
+			return 0;
+
+		return v;
+	}
+}
+
+static const struct transport_ops serial_ops = {
+	.send = fd_send,
+	.receive = fd_receive,
+	.close = fd_close,
+};
+
+static const struct transport_ops socket_ops = {
+	.send = socket_send,
+	.receive = fd_receive,
+	.close = socket_close,
+};
+
+static const struct transport_ops fd_ops = {
+	.send = fd_send,
+	.receive = fd_receive,
+	.close = fd_release,
+};
+
+/*
+ * Start connecting to t->addr or the addresses after it. Returns 0 once
+ * a connect is under way or done, -1 with the last error, initially err,
+ * if none of them can be reached.
+ */
+static int tcp_connect_next(struct transport *t, int err)
+{
+	const struct addrinfo *ai;
+
+	for (ai = t->addr; ai; ai = ai->ai_next) {
+		t->fd = socket(ai->ai_family, ai->ai_socktype | SOCK_CLOEXEC | SOCK_NONBLOCK,
+			       ai->ai_protocol);
+		if (t->fd < 0) {
+			err = errno;
+			continue;
+		}
+
+		if (!connect(t->fd, ai->ai_addr, ai->ai_addrlen) || errno == EINPROGRESS) {
+			t->addr = ai->ai_next;
+			t->connecting = 1;
+			return 0;
+		}
+
+		err = errno;
+		close(t->fd);
+		t->fd = -1;
+	}
+
+	errno = err;
+	return -1;
+}
+
+/*
+ * "<host>:<port>", an IPv6 host in brackets. Only the name lookup blocks,
+ * the connect completes in transport_connect().
+ */
+static int tcp_connect(struct transport *t, const char *name)
+{
+	struct addrinfo hints = { .ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM };
+	const char *port = strrchr(name, ':');
+	char host[256];
+	size_t host_length;
+	int ret;
+
+	if (!port || port == name) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	host_length = port - name;
+	if (name[0] == '[' && name[host_length - 1] == ']') {
+		name++;
+		host_length -= 2;
+	}
+	if (host_length >= sizeof(host)) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	memcpy(host, name, host_length);
+	host[host_length] = '\0';
+
+	ret = getaddrinfo(host, port + 1, &hints, &t->addrs);
+	if (ret) {
+		errno = ret == EAI_SYSTEM ? errno : EHOSTUNREACH;
+		t->addrs = NULL;
+		return -1;
+	}
+
+	t->addr = t->addrs;
+	if (tcp_connect_next(t, EHOSTUNREACH) < 0) {
+		int err = errno;
+
+		freeaddrinfo(t->addrs);
+		t->addrs = NULL;
+		errno = err;
+		return -1;
+	}
+
+	return t->fd;
+}
+
+static int unix_connect(const char *path)
+{
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+	int fd;
+
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	strcpy(addr.sun_path, path);
+
+	fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+	if (fd < 0)
+		return -1;
+
+	/* completes at once or fails with EAGAIN if the listener's backlog is full */
+	if (connect(fd, (struct sockaddr *)&addr, sizeof(addr))) {
+		int err = errno;
+
+		close(fd);
+		errno = err;
+		return -1;
+	}
+
+	return fd;
+}
+
+static int fd_parse(const char *name)
+{
+	char *end;
+	long fd;
+
+	errno = 0;
+	fd = strtol(name, &end, 10);
+	if (errno || end == name || *end || fd < 0 || fd > INT32_MAX ||
+	    fcntl(fd, F_GETFD) < 0) {
+		errno = EBADF;
+		return -1;
+	}
+
+	return fd;
+}
+
+/*
+ * A transport plugged in by the application. Its send() takes all of the
+ * data at once, its receive() is offered the contiguous free space of the
+ * ring, a wrapped rest is left to the next call.
+ */
+static ssize_t custom_send(struct transport *t, const uint8_t *data, size_t length)
+{
+	if (t->custom->send(t->priv, data, length) < 0)
+		return -1;
+
+	return length;
+}
+
+static int custom_receive(struct transport *t, struct serial_rx_ring *ring, int timeout_ms)
+{
+	size_t tail = (ring->head + ring->count) % SERIAL_RX_RING_SIZE;
+	size_t space = SERIAL_RX_RING_SIZE - ring->count;
+	int ret;
+
+	if (!space)
+		return 0;
+
+	if (space > SERIAL_RX_RING_SIZE - tail)
+		space = SERIAL_RX_RING_SIZE - tail;
+
+	ret = t->custom->receive(t->priv, &ring->data[tail], space, timeout_ms);
+	if (ret > 0)
+		ring->count += ret;
+
+	return ret;
+}
+
+static void custom_close(struct transport *t)
+{
+	t->custom->close(t->priv);
+	t->priv = NULL;
+}
+
+static const struct transport_ops custom_ops = {
+	.send = custom_send,
+	.receive = custom_receive,
+	.close = custom_close,
+};
+
+/*
+ * Open the link named by devname, errors are reported through errno.
+ */
+int transport_open(struct transport *t, const char *devname, const struct transport_config *cfg)
+{
+	memset(t, 0, sizeof(*t));
+	t->fd = -1;
+
+	if (cfg->custom) {
+		t->priv = cfg->custom->open(devname, cfg->custom_data);
+		if (!t->priv)
+			return -1;
+		t->ops = &custom_ops;
+		t->custom = cfg->custom;
+		return 0;
+	}
+
+	if (!strncmp(devname, TRANSPORT_TCP, strlen(TRANSPORT_TCP))) {
+		t->fd = tcp_connect(t, devname + strlen(TRANSPORT_TCP));
+		t->ops = &socket_ops;
+	} else if (!strncmp(devname, TRANSPORT_UNIX, strlen(TRANSPORT_UNIX))) {
+		t->fd = unix_connect(devname + strlen(TRANSPORT_UNIX));
+		t->ops = &socket_ops;
+	} else if (!strncmp(devname, TRANSPORT_FD, strlen(TRANSPORT_FD))) {
+		t->fd = fd_parse(devname + strlen(TRANSPORT_FD));
+		t->ops = &fd_ops;
+	} else {
+		struct serial_options serial_opts = {
+			.baudrate = cfg->baudrate,
+			.flow_control = cfg->flow_control,
+		};
+
+		t->fd = serial_init(devname, &serial_opts);
+		t->ops = &serial_ops;
+		t->tty = 1;
+	}
+
+	if (t->fd < 0 || fcntl(t->fd, F_SETFL, fcntl(t->fd, F_GETFL) | O_NONBLOCK) < 0) {
+		if (t->fd >= 0)
+			t->ops->close(t);
+		t->ops = NULL;
+		t->tty = 0;
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Complete a connect started by transport_open() without waiting: 0 once
+ * the link is up, 1 while it waits for POLLOUT on t->fd, which changes
+ * when the next address is tried, -1 with errno set if all failed.
+ */
+int transport_connect(struct transport *t)
+{
+	struct pollfd pfd = { .fd = t->fd, .events = POLLOUT };
+	socklen_t length = sizeof(int);
+	int err = 0, one = 1;
+
+	if (!t->connecting)
+		return 0;
+
+	if (poll(&pfd, 1, 0) == 0)
+		return 1;
+
+	if (getsockopt(t->fd, SOL_SOCKET, SO_ERROR, &err, &length) < 0)
+		err = errno;
+
+	if (err) {
+		close(t->fd);
+		t->fd = -1;
+		return tcp_connect_next(t, err) < 0 ? -1 : 1;
+	}
+
+	freeaddrinfo(t->addrs);
+	t->addrs = NULL;
+	t->addr = NULL;
+	t->connecting = 0;
+
+	/* every frame is a complete request, don't let Nagle hold it back */
+	setsockopt(t->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	return 0;
+}
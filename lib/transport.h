@@ -0,0 +1,55 @@
+/* SPDX-License-Identifier: BSD-3-Clause */
+/*
+ * Copyright (C) 2022 Leica Geosystems AG
+ */
+#ifndef TRANSPORT_H_
+#define TRANSPORT_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include <nrfu.h>
+
+struct addrinfo;
+struct serial_rx_ring;
+struct transport;
+
+/*
+ * Same semantics as serial_send() and serial_receive(): send() writes what
+ * the link takes without blocking, receive() with a timeout of 0 does not
+ * wait either. Descriptors are switched to non-blocking mode. A receive()
+ * that knows nothing arrives within timeout_ms may fail with ETIMEDOUT
+ * right away, the engine then treats its deadline as passed.
+ */
+struct transport_ops {
+	ssize_t (*send)(struct transport *t, const uint8_t *data, size_t length);
+	int (*receive)(struct transport *t, struct serial_rx_ring *ring, int timeout_ms);
+	void (*close)(struct transport *t);
+};
+
+/* The link to the bootloader, see nrfu_transport_ops for the device names */
+struct transport {
+	const struct transport_ops *ops;
+	int fd;
+	int tty;	/* fd is a serial port configured by serial_init() */
+	void *priv;
+	const struct nrfu_transport_ops *custom;
+	/* a TCP connect in progress and the addresses left to try */
+	int connecting;
+	struct addrinfo *addrs;
+	const struct addrinfo *addr;
+};
+
+struct transport_config {
+	unsigned int baudrate;
+	int flow_control;
+	/* if set, every device name is opened with these instead */
+	const struct nrfu_transport_ops *custom;
+	void *custom_data;
+};
+
+int transport_open(struct transport *t, const char *devname, const struct transport_config *cfg);
+int transport_connect(struct transport *t);
+
+#endif /* TRANSPORT_H_ */
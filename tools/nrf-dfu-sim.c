@@ -0,0 +1,176 @@
+// SPDX-License-Identifier: BSD-3-Clause
+/*
+ * Copyright (C) 2022 Leica Geosystems AG
+ */
+
+#define _GNU_SOURCE	/* posix_openpt(), ptsname() */
+
+#include <stdio.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <termios.h>
+
+#include "sim.h"
+
+static void print_help(void)
+{
+	printf("nrf-dfu-sim\n");
+	printf("\n");
+	printf("Emulate a nRF5 serial DFU bootloader on a pseudo terminal.\n");
+	printf("The path of the terminal to pass to nrf-update -d is printed on stdout.\n");
+	printf("\n");
+	printf("Usage: nrf-dfu-sim [options]\n");
+	printf("  -m <mtu>\t\tMTU to report (default is %u)\n", SIM_DEFAULT_MTU);
+	printf("  -o <object-size>\tmaximum data object size (default is %u)\n",
+	       SIM_DEFAULT_OBJECT_SIZE);
+	printf("  -s <flash-size>\tmaximum firmware size (default is %u)\n", SIM_DEFAULT_FLASH_SIZE);
+	printf("  -b <baudrate>\t\temulated line rate (default is 0, unlimited)\n");
+	printf("  -l <latency>\t\tresponse latency in microseconds\n");
+	printf("  -D <rate>\t\tprobability of dropping a received byte\n");
+	printf("  -C <rate>\t\tprobability of corrupting a received byte\n");
+	printf("  -P <bytes>\t\tlose power once after receiving this many firmware bytes\n");
+	printf("  -R <ms>\t\ttime to reboot after a power loss (default is %u)\n",
+	       SIM_DEFAULT_REBOOT_MS);
+	printf("  -S <seed>\t\tseed of the fault generator\n");
+	printf("  -w <file>\t\twrite executed firmware objects to file\n");
+	printf("  -L <path>\t\talso create a symlink to the terminal at path\n");
+	printf("  -h\t\t\tdisplay this message and exit\n");
+	printf("\n");
+}
+
+/*
+ * The slave side is kept open, so the master does not see a hangup when
+ * the host closes the terminal between sessions.
+ */
+static int open_pty(int *slave_fd)
+{
+	struct termios tio;
+	int fd;
+
+	fd = posix_openpt(O_RDWR | O_NOCTTY);
+	if (fd < 0)
+		return -1;
+
+	if (grantpt(fd) || unlockpt(fd))
+		goto err_out;
+
+	*slave_fd = open(ptsname(fd), O_RDWR | O_NOCTTY);
+	if (*slave_fd < 0)
+		goto err_out;
+
+	if (tcgetattr(*slave_fd, &tio) == 0) {
+		cfmakeraw(&tio);
+		tcsetattr(*slave_fd, TCSANOW, &tio);
+	}
+
+	return fd;
+
+err_out:
+	close(fd);
+	return -1;
+}
+
+int main(int argc, char **argv)
+{
+	struct sim_config cfg;
+	struct sim *sim;
+	const char *image_file = NULL, *link = NULL;
+	int c, fd, slave_fd, ret;
+
+	sim_config_init(&cfg);
+
+	while ((c = getopt(argc, argv, "hm:o:s:b:l:D:C:P:R:S:w:L:")) != -1) {
+		switch (c) {
+		case 'm':
+			cfg.mtu = strtoul(optarg, NULL, 0);
+			break;
+		case 'o':
+			cfg.object_size = strtoul(optarg, NULL, 0);
+			break;
+		case 's':
+			cfg.flash_size = strtoul(optarg, NULL, 0);
+			break;
+		case 'b':
+			cfg.baudrate = strtoul(optarg, NULL, 0);
+			break;
+		case 'l':
+			cfg.latency_us = strtoul(optarg, NULL, 0);
+			break;
+		case 'D':
+			cfg.drop_rate = strtod(optarg, NULL);
+			break;
+		case 'C':
+			cfg.corrupt_rate = strtod(optarg, NULL);
+			break;
+		case 'P':
+			cfg.power_loss_at = strtoul(optarg, NULL, 0);
+			break;
+		case 'R':
+			cfg.reboot_ms = strtoul(optarg, NULL, 0);
+			break;
+		case 'S':
+			cfg.seed = strtoul(optarg, NULL, 0);
+			break;
+		case 'w':
+			image_file = optarg;
+			break;
+		case 'L':
+			link = optarg;
+			break;
+		case 'h':
+			print_help();
+			return 0;
+		default:
+			return -1;
+		}
+	}
+
+	if (image_file) {
+		cfg.image_fd = open(image_file, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+		if (cfg.image_fd < 0) {
+			perror(image_file);
+			return -1;
+		}
+	}
+
+	sim = sim_create(&cfg);
+	if (!sim) {
+		perror("Failed to create the simulator");
+		return -1;
+	}
+
+	fd = open_pty(&slave_fd);
+	if (fd < 0) {
+		perror("Failed to open a pseudo terminal");
+		sim_destroy(sim);
+		return -1;
+	}
+
+	if (link) {
+		unlink(link);
+		if (symlink(ptsname(fd), link)) {
+			perror(link);
+			sim_destroy(sim);
+			return -1;
+		}
+	}
+
+	printf("%s\n", ptsname(fd));
+	fflush(stdout);
+
+	ret = sim_serve(sim, fd);
+	if (ret < 0)
+		perror("Simulator stopped");
+
+	if (link)
+		unlink(link);
+	close(slave_fd);
+	close(fd);
+	sim_destroy(sim);
+
+	return ret;
+}
@@ -0,0 +1,241 @@
+// SPDX-License-Identifier: BSD-3-Clause
+/*
+ * Copyright (C) 2022 Leica Geosystems AG
+ */
+
+#include <stdio.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <nrfu_trace.h>
+
+#define SLIP_END		0xc0
+#define SLIP_ESC		0xdb
+#define SLIP_ESC_END		0xdc
+#define SLIP_ESC_ESC		0xdd
+
+#define OPCODE_RESPONSE		0x60
+
+static const char *opcode_names[] = {
+	[0x01] = "OBJECT_CREATE",
+	[0x02] = "SET_PRN",
+	[0x03] = "GET_CRC",
+	[0x04] = "EXECUTE",
+	[0x06] = "OBJECT_SELECT",
+	[0x07] = "GET_MTU",
+	[0x08] = "WRITE_OBJECT",
+	[0x09] = "PING",
+};
+
+static int show_hex;
+
+static void print_help(void)
+{
+	printf("nrf-trace\n");
+	printf("\n");
+	printf("Decode a trace written by libnrfu (nrf-update -t) into a protocol log.\n");
+	printf("\n");
+	printf("Usage: nrf-trace [-x] <trace-file>\n");
+	printf("  -x\t\t\talso print the raw bytes of each frame\n");
+	printf("  -h\t\t\tdisplay this message and exit\n");
+	printf("\n");
+}
+
+static const char *opcode_name(uint8_t opcode)
+{
+	if (opcode < sizeof(opcode_names) / sizeof(opcode_names[0]) && opcode_names[opcode])
+		return opcode_names[opcode];
+
+	return "UNKNOWN";
+}
+
+static uint32_t le32(const uint8_t *data)
+{
+	return data[0] | data[1] << 8 | data[2] << 16 | (uint32_t)data[3] << 24;
+}
+
+static void print_hex(const uint8_t *data, size_t length)
+{
+	size_t i;
+
+	if (!show_hex)
+		return;
+
+	for (i = 0; i < length; i++)
+		printf("%s%02x", i % 32 ? " " : "\n\t\t\t", data[i]);
+}
+
+static void print_command(const uint8_t *frame, size_t length)
+{
+	printf("--> %-14s", opcode_name(frame[0]));
+
+	switch (frame[0]) {
+	case 0x01:
+		if (length >= 6)
+			printf(" type %u size %u", frame[1], le32(&frame[2]));
+		break;
+	case 0x02:
+		if (length >= 3)
+			printf(" prn %u", frame[1] | frame[2] << 8);
+		break;
+	case 0x06:
+		if (length >= 2)
+			printf(" type %u", frame[1]);
+		break;
+	case 0x08:
+		printf(" %zu bytes", length - 1);
+		break;
+	}
+
+	print_hex(frame, length);
+	printf("\n");
+}
+
+static void print_response(const uint8_t *frame, size_t length)
+{
+	const uint8_t *payload = &frame[3];
+	size_t n = length - 3;
+
+	if (length < 3 || frame[0] != OPCODE_RESPONSE) {
+		printf("<-- malformed frame of %zu bytes", length);
+		print_hex(frame, length);
+		printf("\n");
+		return;
+	}
+
+	printf("<-- %-14s", opcode_name(frame[1]));
+	if (frame[2] != 0x01) {
+		printf(" error 0x%02x", frame[2]);
+	} else {
+		switch (frame[1]) {
+		case 0x03:
+			if (n >= 8)
+				printf(" offset 0x%x crc 0x%08x", le32(payload), le32(&payload[4]));
+			break;
+		case 0x06:
+			if (n >= 12)
+				printf(" max_size 0x%x offset 0x%x crc 0x%08x",
+				       le32(payload), le32(&payload[4]), le32(&payload[8]));
+			break;
+		case 0x07:
+			if (n >= 2)
+				printf(" mtu %u", payload[0] | payload[1] << 8);
+			break;
+		default:
+			printf(" ok");
+			break;
+		}
+	}
+
+	print_hex(frame, length);
+	printf("\n");
+}
+
+/* A TX record holds SLIP encoded frames, possibly several of them */
+static void print_tx(const uint8_t *data, size_t length, double t)
+{
+	uint8_t frame[NRFU_TRACE_SNAPLEN];
+	size_t i, n = 0;
+	int esc = 0;
+
+	for (i = 0; i < length; i++) {
+		uint8_t c = data[i];
+
+		if (c == SLIP_END) {
+			if (n) {
+				printf("%12.6f ", t);
+				print_command(frame, n);
+			}
+			n = 0;
+			continue;
+		}
+
+		if (esc) {
+			c = c == SLIP_ESC_END ? SLIP_END : c == SLIP_ESC_ESC ? SLIP_ESC : c;
+			esc = 0;
+		} else if (c == SLIP_ESC) {
+			esc = 1;
+			continue;
+		}
+		frame[n++] = c;
+	}
+
+	if (n) {
+		printf("%12.6f ", t);
+		print_command(frame, n);
+	}
+}
+
+int main(int argc, char **argv)
+{
+	struct nrfu_trace_header hdr;
+	struct nrfu_trace_record rec;
+	uint8_t data[NRFU_TRACE_SNAPLEN];
+	uint64_t start = 0;
+	unsigned long n_records = 0;
+	FILE *f;
+	int c;
+
+	while ((c = getopt(argc, argv, "hx")) != -1) {
+		switch (c) {
+		case 'x':
+			show_hex = 1;
+			break;
+		case 'h':
+			print_help();
+			return 0;
+		default:
+			return -1;
+		}
+	}
+
+	if (optind >= argc) {
+		print_help();
+		fprintf(stderr, "No trace file provided\n");
+		return -1;
+	}
+
+	f = fopen(argv[optind], "rb");
+	if (!f) {
+		perror(argv[optind]);
+		return -1;
+	}
+
+	if (fread(&hdr, sizeof(hdr), 1, f) != 1 || hdr.magic != NRFU_TRACE_MAGIC ||
+	    hdr.snaplen > NRFU_TRACE_SNAPLEN) {
+		fprintf(stderr, "%s is not a libnrfu trace\n", argv[optind]);
+		fclose(f);
+		return -1;
+	}
+
+	if (hdr.dropped)
+		printf("# %llu older records were dropped\n", (unsigned long long)hdr.dropped);
+
+	while (fread(&rec, sizeof(rec), 1, f) == 1) {
+		double t;
+
+		if (rec.captured > hdr.snaplen || (rec.captured &&
+		    fread(data, NRFU_TRACE_ALIGN(rec.captured), 1, f) != 1)) {
+			fprintf(stderr, "Truncated record\n");
+			break;
+		}
+
+		if (!n_records++)
+			start = rec.timestamp_ns;
+		t = (rec.timestamp_ns - start) / 1e9;
+
+		if (rec.dir == NRFU_TRACE_TX) {
+			print_tx(data, rec.captured, t);
+		} else {
+			printf("%12.6f ", t);
+			print_response(data, rec.captured);
+		}
+
+		if (rec.captured < rec.length)
+			printf("%12s ... %u of %u bytes captured\n", "", rec.captured, rec.length);
+	}
+
+	fclose(f);
+	return 0;
+}
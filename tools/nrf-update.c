@@ -9,6 +9,10 @@
 #include <stdlib.h>
 #include <nrfu.h>
 
+/* nRF5 SDK serial bootloader defaults */
+#define DEFAULT_MTU		131
+#define DEFAULT_OBJECT_SIZE	4096
+
 static void print_help(void)
 {
 	printf("nrf-update\n");
@@ -16,27 +20,240 @@ static void print_help(void)
 	printf("Update Firmware on a nRF5 device (running in bootloader) via DFU over serial port.\n");
 	printf("\n");
 	printf("Reqired arguments:\n");
-	printf("  -d <device>\t\tserial device\n");
+	printf("  -d <device>\t\tserial device, repeat to update several devices in parallel;\n");
+	printf("\t\t\ttcp:<host>:<port> and unix:<path> connect to a socket,\n");
+	printf("\t\t\tfd:<n> uses an inherited descriptor and\n");
+	printf("\t\t\treplay:<file> plays back a capture recorded with -r\n");
 	printf("  -i <init-packet>\tinit-packet (*.dat) file\n");
-	printf("  -f <firmware>\t\tfirmware (*.bin) file\n");
+	printf("  -f <firmware>\t\tfirmware (*.bin or *.hex) file\n");
+	printf("  or\n");
+	printf("  -z <package>\t\tDFU package (*.zip) created by nrfutil, instead of -i and -f\n");
 	printf("\n");
 	printf("Optional arguments:\n");
 	printf("  -l <log-level>\t1-4 (1 means quite, 4 highest verbosity, default is 2)\n");
+	printf("  -b <baudrate>\t\tserial line speed (default is %u, 0 keeps the port setting)\n",
+	       NRFU_DEFAULT_BAUDRATE);
+	printf("  -n\t\t\tdisable RTS/CTS hardware flow control\n");
+	printf("  -L\t\t\trequest low latency mode from the serial driver\n");
+	printf("  -p <packets>\t\tcheck a receipt notification every n packets (default is 0, off)\n");
+	printf("  -P\t\t\tpack data packets up to the MTU (bootloader must support it)\n");
+	printf("  -j <jobs>\t\tmaximum number of devices updated at once (default is all)\n");
+	printf("  -T <ms>\t\tlongest wait for a response, shorter ones are adapted to the\n");
+	printf("\t\t\tmeasured round trip times (default is %u)\n", NRFU_RESPONSE_TIMEOUT_MS);
+	printf("  -R <retries>\t\tsend a failed data object again up to n times (default is %u)\n",
+	       NRFU_DEFAULT_RETRIES);
+	printf("  -D <ms>\t\tstart no retry later than ms after the session started\n");
+	printf("  -v\t\t\tshow a progress bar and the time spent in each phase, for a\n");
+	printf("\t\t\tsingle device; several print a summary per device\n");
+	printf("  -t <file>\t\trecord the frames of the session, decode with nrf-trace\n");
+	printf("  -r <file>\t\trecord all bytes exchanged with the device for replay\n");
+	printf("  -F\t\t\treplay a capture at full speed, without the recorded delays\n");
+	printf("  -c <dir>\t\tkeep pre-encoded data frames in dir and reuse them\n");
 	printf("  -h\t\t\tdisplay this message and exit\n");
 	printf("\n");
+	printf("Prebuild the frame cache of a firmware, no device needed:\n");
+	printf("  nrf-update -B -c <dir> -f <firmware> [-m <mtu>] [-o <object-size>] [-P]\n");
+	printf("  -m <mtu>\t\tMTU reported by the bootloader (default is %u)\n", DEFAULT_MTU);
+	printf("  -o <object-size>\tmaximum data object size (default is %u)\n",
+	       DEFAULT_OBJECT_SIZE);
+	printf("\n");
+}
+
+#define PROGRESS_BAR_WIDTH	30
+
+struct progress_state {
+	uint64_t phase_ns[NRFU_PHASE_COUNT];
+	unsigned int phase_count[NRFU_PHASE_COUNT];
+	uint64_t data_start_ns;
+	unsigned long data_start_bytes;
+	struct nrfu_progress last;
+	int bar_shown;
+};
+
+static void print_progress(const struct nrfu_progress *prog, struct progress_state *st)
+{
+	double seconds = (prog->timestamp_ns - st->data_start_ns) / 1e9;
+	unsigned long size = prog->image_size ? prog->image_size : 1;
+	int i, filled = PROGRESS_BAR_WIDTH * prog->image_bytes / size;
+
+	fprintf(stderr, "\r%-12s [", nrfu_phase_name(prog->phase));
+	for (i = 0; i < PROGRESS_BAR_WIDTH; i++)
+		fputc(i < filled ? '#' : '.', stderr);
+	fprintf(stderr, "] %3lu%% %lu/%lu bytes %.1f kB/s ", 100 * prog->image_bytes / size,
+		prog->image_bytes, prog->image_size,
+		seconds > 0 ? (prog->payload_bytes - st->data_start_bytes) / seconds / 1000 : 0);
+	st->bar_shown = 1;
+}
+
+static void progress_cb(const struct nrfu_progress *prog, void *userdata)
+{
+	struct progress_state *st = userdata;
+
+	st->last = *prog;
+
+	switch (prog->event) {
+	case NRFU_PROGRESS_BEGIN:
+		if (prog->phase == NRFU_PHASE_INIT_PACKET || prog->phase == NRFU_PHASE_FIRMWARE) {
+			st->data_start_ns = prog->timestamp_ns;
+			st->data_start_bytes = prog->payload_bytes;
+		}
+		break;
+	case NRFU_PROGRESS_UPDATE:
+		print_progress(prog, st);
+		break;
+	case NRFU_PROGRESS_END:
+		st->phase_ns[prog->phase] += prog->elapsed_ns;
+		st->phase_count[prog->phase]++;
+		if (prog->phase == NRFU_PHASE_FIRMWARE || prog->phase == NRFU_PHASE_INIT_PACKET) {
+			print_progress(prog, st);
+			fputc('\n', stderr);
+			st->bar_shown = 0;
+		}
+		break;
+	}
+}
+
+static void print_summary(struct nrfu_ctx *ctx, const struct progress_state *st)
+{
+	const struct nrfu_progress *prog = &st->last;
+	struct nrfu_rtt_stats rtt;
+	int i;
+
+	if (st->bar_shown)
+		fputc('\n', stderr);
+
+	fprintf(stderr, "%-12s %6s %10s\n", "phase", "count", "ms");
+	for (i = 0; i < NRFU_PHASE_COUNT; i++)
+		if (st->phase_count[i])
+			fprintf(stderr, "%-12s %6u %10.1f\n", nrfu_phase_name(i),
+				st->phase_count[i], st->phase_ns[i] / 1e6);
+
+	fprintf(stderr, "payload %lu bytes, wire %lu bytes sent (%.1f%% overhead), %lu received, %u retries\n",
+		prog->payload_bytes, prog->wire_tx_bytes,
+		prog->payload_bytes ? 100.0 * prog->wire_tx_bytes / prog->payload_bytes - 100 : 0,
+		prog->wire_rx_bytes, prog->retries);
+
+	fprintf(stderr, "%-16s %6s %8s %8s %8s %8s %8s\n", "request", "count", "srtt ms",
+		"rttvar", "min", "max", "timeouts");
+	for (i = 0; i < NRFU_RTT_COUNT; i++) {
+		nrfu_ctx_get_rtt_stats(ctx, i, &rtt);
+		if (rtt.samples || rtt.timeouts)
+			fprintf(stderr, "%-16s %6u %8.3f %8.3f %8.3f %8.3f %8u\n", nrfu_rtt_name(i),
+				rtt.samples, rtt.srtt_ns / 1e6, rtt.rttvar_ns / 1e6,
+				rtt.min_ns / 1e6, rtt.max_ns / 1e6, rtt.timeouts);
+	}
+}
+
+static int update_single(const char *device, const char *init_packet, const char *firmware,
+			 const char *package, const struct nrfu_options *opts, int verbose)
+{
+	struct progress_state st = { 0 };
+	struct nrfu_ctx *ctx;
+	int ret = -1;
+
+	ctx = nrfu_ctx_create();
+	if (!ctx)
+		return -1;
+
+	if (verbose)
+		nrfu_ctx_set_progress_fn(ctx, progress_cb, &st);
+
+	if (nrfu_ctx_set_options(ctx, opts) == 0) {
+		if (package)
+			ret = nrfu_ctx_run_package(ctx, device, package);
+		else
+			ret = nrfu_ctx_run(ctx, device, init_packet, firmware);
+	}
+
+	if (verbose)
+		print_summary(ctx, &st);
+
+	nrfu_ctx_destroy(ctx);
+	return ret;
+}
+
+static int update_fleet(char **devices, int n_devices, const char *init_packet,
+			const char *firmware, const struct nrfu_options *opts, unsigned int jobs)
+{
+	struct nrfu_fleet *fleet;
+	struct nrfu_fleet_result res;
+	unsigned long total = 0;
+	double elapsed;
+	int i, failed;
+
+	fleet = nrfu_fleet_create(init_packet, firmware);
+	if (!fleet) {
+		perror("Failed to load images");
+		return -1;
+	}
+
+	if (nrfu_fleet_set_options(fleet, opts) < 0) {
+		fprintf(stderr, "Invalid options\n");
+		nrfu_fleet_destroy(fleet);
+		return -1;
+	}
+
+	for (i = 0; i < n_devices; i++) {
+		if (nrfu_fleet_add_device(fleet, devices[i]) < 0) {
+			nrfu_fleet_destroy(fleet);
+			return -1;
+		}
+	}
+
+	failed = nrfu_fleet_run(fleet, jobs);
+	elapsed = nrfu_fleet_elapsed(fleet);
+
+	printf("%-24s %-6s %10s %10s\n", "device", "result", "seconds", "bytes/s");
+	for (i = 0; i < n_devices; i++) {
+		nrfu_fleet_get_result(fleet, i, &res);
+		printf("%-24s %-6s %10.2f %10.0f\n", res.devname, res.status ? "FAIL" : "OK",
+		       res.seconds, res.seconds > 0 ? res.bytes / res.seconds : 0);
+		total += res.bytes;
+	}
+	printf("%d of %d devices updated in %.2f s, aggregate %.0f bytes/s\n",
+	       n_devices - failed, n_devices, elapsed, elapsed > 0 ? total / elapsed : 0);
+
+	nrfu_fleet_destroy(fleet);
+	return failed ? -1 : 0;
 }
 
 int main(int argc, char **argv)
 {
 	int c;
-	char *device = NULL, *init_packet = NULL, *firmware = NULL;
+	char **devices = NULL;
+	int n_devices = 0;
+	char *init_packet = NULL, *firmware = NULL, *package = NULL;
 	int log_input = -1;
-	enum nrfu_log_level log_level;
+	unsigned int jobs = 0;
+	unsigned int mtu = DEFAULT_MTU, object_size = DEFAULT_OBJECT_SIZE;
+	int prebuild = 0, verbose = 0;
+	struct nrfu_options opts;
+	int ret = -1;
+
+	nrfu_options_init(&opts);
 
-	while ((c = getopt(argc, argv, "hd:i:f:l:")) != -1) {
+	devices = calloc(argc, sizeof(*devices));
+	if (!devices)
+		return -1;
+
+	while ((c = getopt(argc, argv, "hd:i:f:z:l:b:nLp:Pj:T:R:D:c:Bm:o:vt:r:F")) != -1) {
 		switch (c) {
 		case 'd':
-			device = optarg;
+			devices[n_devices++] = optarg;
+			break;
+		case 'j':
+			jobs = strtoul(optarg, NULL, 0);
+			break;
+		case 'T':
+			opts.response_timeout_ms = strtoul(optarg, NULL, 0);
+			if (opts.response_timeout_min_ms > opts.response_timeout_ms)
+				opts.response_timeout_min_ms = opts.response_timeout_ms;
+			break;
+		case 'R':
+			opts.retries = strtoul(optarg, NULL, 0);
+			break;
+		case 'D':
+			opts.retry_deadline_ms = strtoul(optarg, NULL, 0);
 			break;
 		case 'i':
 			init_packet = optarg;
@@ -44,56 +261,148 @@ int main(int argc, char **argv)
 		case 'f':
 			firmware = optarg;
 			break;
+		case 'z':
+			package = optarg;
+			break;
 		case 'l':
 			log_input = atoi(optarg);
 			break;
+		case 'b':
+			opts.baudrate = strtoul(optarg, NULL, 0);
+			break;
+		case 'n':
+			opts.flow_control = NRFU_FLOW_CONTROL_NONE;
+			break;
+		case 'L':
+			opts.low_latency = 1;
+			break;
+		case 'p':
+			opts.prn = strtoul(optarg, NULL, 0);
+			break;
+		case 'P':
+			opts.fill_mtu = 1;
+			break;
+		case 'c':
+			opts.frame_cache = 1;
+			opts.frame_cache_dir = optarg;
+			break;
+		case 'B':
+			prebuild = 1;
+			break;
+		case 'v':
+			verbose = 1;
+			break;
+		case 't':
+			opts.trace_file = optarg;
+			break;
+		case 'r':
+			opts.capture_file = optarg;
+			break;
+		case 'F':
+			opts.replay_full_speed = 1;
+			break;
+		case 'm':
+			mtu = strtoul(optarg, NULL, 0);
+			break;
+		case 'o':
+			object_size = strtoul(optarg, NULL, 0);
+			break;
 		case 'h':
 			print_help();
-			return 0;
+			ret = 0;
+			goto out;
 		case '?':
 		default:
-			return -1;
+			goto out;
 		}
 	}
 
 	switch (log_input) {
 	case 1:
-		log_level = NRFU_LOG_LEVEL_SILENT;
+		opts.log_level = NRFU_LOG_LEVEL_SILENT;
 		break;
 	case 3:
-		log_level = NRFU_LOG_LEVEL_INFO;
+		opts.log_level = NRFU_LOG_LEVEL_INFO;
 		break;
 	case 4:
-		log_level = NRFU_LOG_LEVEL_DEBUG;
+		opts.log_level = NRFU_LOG_LEVEL_DEBUG;
 		break;
 	case 2:
 	default:
-		log_level = NRFU_LOG_LEVEL_ERROR;
+		opts.log_level = NRFU_LOG_LEVEL_ERROR;
 		break;
 	}
 
-	if (!device) {
+	if (prebuild) {
+		if (!opts.frame_cache_dir || !firmware) {
+			print_help();
+			fprintf(stderr, "Prebuilding needs -c and -f\n");
+			goto out;
+		}
+
+		if (nrfu_frame_cache_build(firmware, opts.frame_cache_dir, mtu, object_size,
+					   opts.fill_mtu) < 0) {
+			perror("Failed to build frame cache");
+			goto out;
+		}
+
+		ret = 0;
+		goto out;
+	}
+
+	if (!n_devices) {
 		print_help();
 		fprintf(stderr, "No device provided\n");
-		return -1;
+		goto out;
+	}
+
+	if (package) {
+		if (n_devices > 1) {
+			fprintf(stderr, "A package can only be sent to one device\n");
+			goto out;
+		}
+
+		if (update_single(devices[0], NULL, NULL, package, &opts, verbose) < 0) {
+			fprintf(stderr, "Update failed!\n");
+			goto out;
+		}
+
+		ret = 0;
+		goto out;
 	}
 
 	if (!init_packet) {
 		print_help();
 		fprintf(stderr, "No *.dat file provided\n");
-		return -1;
+		goto out;
 	}
 
 	if (!firmware) {
 		print_help();
-		fprintf(stderr, "No *.bin file provided\n");
-		return -1;
+		fprintf(stderr, "No firmware file provided\n");
+		goto out;
 	}
 
-	if (nrfu_update(device, init_packet, firmware, log_level) < 0) {
+	/* all sessions of a fleet share one in-memory frame cache */
+	if (n_devices > 1) {
+		if (opts.trace_file || opts.capture_file || verbose) {
+			fprintf(stderr, "-t, -r and -v are only supported for a single device\n");
+			goto out;
+		}
+
+		opts.frame_cache = 1;
+		ret = update_fleet(devices, n_devices, init_packet, firmware, &opts, jobs);
+		goto out;
+	}
+
+	if (update_single(devices[0], init_packet, firmware, NULL, &opts, verbose) < 0) {
 		fprintf(stderr, "Update failed!\n");
-		return -1;
+		goto out;
 	}
 
-	return 0;
+	ret = 0;
+
+out:
+	free(devices);
+	return ret;
 }